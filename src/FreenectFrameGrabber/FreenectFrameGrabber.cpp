@@ -41,6 +41,7 @@
 #include <utDataflow/ComponentFactory.h>
 #include <utUtil/OS.h>
 #include <boost/array.hpp>
+#include <boost/algorithm/string.hpp>
 
 #include <log4cpp/Category.hh>
 
@@ -48,22 +49,246 @@ namespace Ubitrack { namespace Drivers {
 // get a logger
 static log4cpp::Category& logger( log4cpp::Category::getInstance( "Ubitrack.Vision.FreenectFrameGrabber" ) );
 
+// number of frames between two statistics reports
+static const unsigned long STATISTICS_INTERVAL = 300;
+
+// unsaturated saturation periods before a downgrade is undone
+static const unsigned int SATURATION_RECOVERY_PERIODS = 5;
+
+// ms to wait at stop for the pipeline workers to leave their arena
+static const int WORKER_RESTORE_TIMEOUT = 500;
+
+// accelerometer poll rate in Hz for the gravity prior without an ACCEL sensor
+static const double GRAVITY_POLL_RATE = 5.0;
+
+namespace {
+
+	class FreenectDeliveryPolicyMap
+		: public std::map< std::string, DeliveryPolicy >
+	{
+	public:
+		FreenectDeliveryPolicyMap()
+		{
+			(*this)[ "synchronous" ] = DELIVER_SYNCHRONOUS;
+			(*this)[ "latestOnly" ] = DELIVER_LATEST_ONLY;
+			(*this)[ "pipeline" ] = DELIVER_PIPELINE;
+		}
+	};
+	static FreenectDeliveryPolicyMap freenectDeliveryPolicyMap;
+
+	class FreenectFrameMemoryMap
+		: public std::map< std::string, freenect_camera::FrameMemoryMode >
+	{
+	public:
+		FreenectFrameMemoryMap()
+		{
+			(*this)[ "heap" ] = freenect_camera::FRAME_MEMORY_HEAP;
+			(*this)[ "locked" ] = freenect_camera::FRAME_MEMORY_LOCKED;
+			(*this)[ "hugepages" ] = freenect_camera::FRAME_MEMORY_HUGEPAGES;
+		}
+	};
+	static FreenectFrameMemoryMap freenectFrameMemoryMap;
+
+	class FreenectProcessingStageMap
+		: public std::map< std::string, ProcessingStage >
+	{
+	public:
+		FreenectProcessingStageMap()
+		{
+			(*this)[ "convert" ] = STAGE_CONVERT;
+			(*this)[ "upload" ] = STAGE_UPLOAD;
+			(*this)[ "send" ] = STAGE_SEND;
+			(*this)[ "compress" ] = STAGE_COMPRESS;
+			(*this)[ "normals" ] = STAGE_NORMALS;
+			(*this)[ "pyramid" ] = STAGE_PYRAMID;
+			(*this)[ "foreground" ] = STAGE_FOREGROUND;
+			(*this)[ "plane" ] = STAGE_PLANE;
+		}
+	};
+	static FreenectProcessingStageMap freenectProcessingStageMap;
+
+	class FreenectYUVOutputMap
+		: public std::map< std::string, YUVOutput >
+	{
+	public:
+		FreenectYUVOutputMap()
+		{
+			(*this)[ "RGB" ] = YUV_OUTPUT_RGB;
+			(*this)[ "GRAY" ] = YUV_OUTPUT_GRAY;
+			(*this)[ "UYVY" ] = YUV_OUTPUT_UYVY;
+		}
+	};
+	static FreenectYUVOutputMap freenectYUVOutputMap;
+
+} // anonymous namespace
+
 
 using namespace Ubitrack;
 using namespace Ubitrack::Vision;
 using namespace Ubitrack::Drivers;
 using namespace freenect_camera;
 
+/** name of a sensor type as used in UTQL */
+static const char* getSensorTypeName( SensorType type ) {
+	switch ( type ) {
+		case SENSOR_IR: return "IR";
+		case SENSOR_RGB: return "COLOR";
+		case SENSOR_DEPTH: return "DEPTH";
+		case SENSOR_ACCEL: return "ACCEL";
+		case SENSOR_COLORED_POINTCLOUD: return "COLORED_POINTCLOUD";
+		case SENSOR_FRAMESET: return "FRAMESET";
+		default: return "UNKNOWN";
+	}
+}
+
+/**
+ * Get the image layout for a frame mode of a sensor.
+ * Returns false if the mode is not supported.
+ */
+static bool getImageLayout( SensorType type, const freenect_frame_mode& mode, ImageLayout& layout ) {
+	layout.bitsPerPixel = 0;
+	switch ( type ) {
+		case SENSOR_IR:
+			if ( mode.video_format == FREENECT_VIDEO_IR_8BIT ) {
+				layout.channels = 1;
+				layout.depth = IPL_DEPTH_8U;
+				layout.pixelFormat = Vision::Image::LUMINANCE;
+				layout.bitsPerPixel = 8;
+				return true;
+			} else if ( mode.video_format == FREENECT_VIDEO_IR_10BIT || mode.video_format == FREENECT_VIDEO_IR_10BIT_PACKED ) {
+				// packed frames are unpacked by a conversion kernel
+				layout.channels = 1;
+				layout.depth = IPL_DEPTH_16U;
+				layout.pixelFormat = Vision::Image::LUMINANCE;
+				layout.bitsPerPixel = 16;
+				return true;
+			}
+			return false;
+		case SENSOR_RGB:
+			if ( mode.video_format == FREENECT_VIDEO_RGB || mode.video_format == FREENECT_VIDEO_YUV_RGB ) {
+				layout.channels = 3;
+				layout.depth = IPL_DEPTH_8U;
+				layout.pixelFormat = Vision::Image::RGB;
+				layout.bitsPerPixel = 24;
+				return true;
+			} else if ( mode.video_format == FREENECT_VIDEO_YUV_RAW ) {
+				// UYVY, converted on delivery
+				layout.channels = 2;
+				layout.depth = IPL_DEPTH_8U;
+				layout.pixelFormat = Vision::Image::YUV422;
+				layout.bitsPerPixel = 16;
+				return true;
+			}
+			return false;
+		case SENSOR_DEPTH:
+			if ( mode.depth_format == FREENECT_DEPTH_11BIT || mode.depth_format == FREENECT_DEPTH_10BIT ||
+				mode.depth_format == FREENECT_DEPTH_11BIT_PACKED || mode.depth_format == FREENECT_DEPTH_10BIT_PACKED ||
+				mode.depth_format == FREENECT_DEPTH_REGISTERED || mode.depth_format == FREENECT_DEPTH_MM ) {
+				layout.channels = 1;
+				layout.depth = IPL_DEPTH_16U;
+				layout.pixelFormat = Vision::Image::DEPTH;
+				return true;
+			}
+			return false;
+		case SENSOR_COLORED_POINTCLOUD:
+			// X, Y, Z in m and packed RGB per depth pixel
+			if ( mode.depth_format == FREENECT_DEPTH_MM && mode.width == REGISTRATION_WIDTH && mode.height == REGISTRATION_HEIGHT ) {
+				layout.channels = 4;
+				layout.depth = IPL_DEPTH_32F;
+				layout.pixelFormat = Vision::Image::UNKNOWN_PIXELFORMAT;
+				return true;
+			}
+			return false;
+		default:
+			return false;
+	}
+}
+
+/** keeps the pooled buffer of an image until the image is gone */
+struct PooledImageRelease {
+	explicit PooledImageRelease( const boost::shared_array< unsigned char >& block )
+		: block( block ) {}
+
+	void operator()( Vision::Image* image ) const {
+		delete image;
+	}
+
+	boost::shared_array< unsigned char > block;
+};
+
+/** keeps the slot of an image used in place leased and the ring mapped */
+struct SharedFrameImageRelease {
+	explicit SharedFrameImageRelease( const boost::shared_ptr< SharedFrameLease >& lease )
+		: lease( lease ) {}
+
+	void operator()( Vision::Image* image ) const {
+		delete image;
+	}
+
+	boost::shared_ptr< SharedFrameLease > lease;
+};
+
+/** an image for a frame, backed by a buffer of the pool if there is one */
+static boost::shared_ptr< Vision::Image > newFrameImage( FramePool* pool, int width, int height, const ImageLayout& layout ) {
+	if ( !pool )
+		return boost::shared_ptr< Vision::Image >( new Vision::Image( width, height, layout.channels, layout.depth ) );
+	boost::shared_array< unsigned char > block( pool->acquire() );
+	return boost::shared_ptr< Vision::Image >( new Vision::Image( width, height, layout.channels, block.get(), layout.depth, 0 ),
+		PooledImageRelease( block ) );
+}
+
+/** bytes of an image of a frame mode, rows of Vision::Image are 4 byte aligned */
+static size_t frameImageBytes( const freenect_frame_mode& mode, const ImageLayout& layout ) {
+	return ( ( size_t( mode.width ) * layout.channels * ( ( layout.depth & 0xff ) / 8 ) + 3 ) & ~size_t( 3 ) ) * mode.height;
+}
+
+/** do two frame modes need the same conversion? */
+static bool sameFrameMode( const freenect_frame_mode& a, const freenect_frame_mode& b ) {
+	// reserved identifies resolution and format
+	return a.reserved == b.reserved && a.bytes == b.bytes && a.width == b.width && a.height == b.height;
+}
+
 FreenectModule::FreenectModule( const FreenectModuleKey& moduleKey, boost::shared_ptr< Graph::UTQLSubgraph > subgraph, FactoryHelper* pFactory )
         : Module< FreenectModuleKey, FreenectComponentKey, FreenectModule, FreenectComponent >( moduleKey, pFactory )
 		, m_device_id(m_moduleKey.get())
         , m_bStop(false)
 		, m_autoGPUUpload(false)
+		, m_sharedMemoryExport(false)
+		, m_sharedMemorySlots(4)
+		, m_streamIdleTimeout(0)
+		, m_registrationCacheHit(false)
+		, m_startTime(0)
+		, m_firstFrameReported(false)
+		, m_deviceOpenRetries(3)
+		, m_streamStartStagger(200)
+		, m_frameMemory(FRAME_MEMORY_HEAP)
+		, m_streamTimeout(2000)
+		, m_lastVideoFrame(0)
+		, m_lastDepthFrame(0)
+		, m_recovering(false)
+		, m_faultTime(0)
+		, m_usbErrors(0)
+		, m_stalls(0)
+		, m_faults(0)
+		, m_recoveries(0)
+		, m_recoveryTime(0)
+		, m_cloudColorTime(0)
+		, m_cloudColorWarned(false)
+		, m_streamStarting(false)
+		, m_streamStartingType(SENSOR_DEPTH)
+		, m_streamStartingTime(0)
+		, m_lastDemandUpdate(0)
+		, m_accelInterval(0)
+		, m_lastAccelPoll(0)
+		, m_accelPollPending(false)
+		, m_accelPollTime(0)
+		, m_accelFailed(false)
+		, m_gravityValid(false)
 {
-	freenect_init(&m_driver, NULL);
-	//freenect_set_log_level(m_driver, FREENECT_LOG_FATAL); // Prevent's printing stuff to the screen
-	freenect_set_log_level(m_driver, FREENECT_LOG_DEBUG); // Prevent's printing stuff to the screen
-	freenect_select_subdevices(m_driver, (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
+	initDriver();
+
+	// detects the instruction set once per process, the kernels are checked by the kernel test
+	LOG4CPP_DEBUG( logger, "Frame conversion kernels use " << KERNEL_VARIANT_NAMES[FrameKernelRegistry::instance().variant()] );
 
 	Vision::OpenCLManager& oclManager = Vision::OpenCLManager::singleton();
 	if (oclManager.isEnabled()) {
@@ -77,11 +302,67 @@ FreenectModule::FreenectModule( const FreenectModuleKey& moduleKey, boost::share
 		}
 	}
 
+	if (subgraph->m_DataflowAttributes.hasAttribute("sharedMemoryExport")) {
+		m_sharedMemoryExport = subgraph->m_DataflowAttributes.getAttributeString("sharedMemoryExport") == "true";
+		subgraph->m_DataflowAttributes.getAttributeData("sharedMemorySlots", m_sharedMemorySlots);
+		if (m_sharedMemorySlots < 2)
+			m_sharedMemorySlots = 2;
+		if (m_sharedMemorySlots > SharedFrameRing::MAX_SLOTS)
+			m_sharedMemorySlots = SharedFrameRing::MAX_SLOTS;
+	}
+
+	if (subgraph->m_DataflowAttributes.hasAttribute("streamIdleTimeout"))
+		subgraph->m_DataflowAttributes.getAttributeData("streamIdleTimeout", m_streamIdleTimeout);
+
+	if (subgraph->m_DataflowAttributes.hasAttribute("calibrationCacheDir"))
+		m_calibrationCacheDir = subgraph->m_DataflowAttributes.getAttributeString("calibrationCacheDir");
+
+	if (subgraph->m_DataflowAttributes.hasAttribute("deviceOpenRetries"))
+		subgraph->m_DataflowAttributes.getAttributeData("deviceOpenRetries", m_deviceOpenRetries);
+	if (subgraph->m_DataflowAttributes.hasAttribute("streamStartStagger"))
+		subgraph->m_DataflowAttributes.getAttributeData("streamStartStagger", m_streamStartStagger);
+	StreamStartScheduler::instance().setStagger(Measurement::Timestamp(m_streamStartStagger) * 1000000);
+
+	if (subgraph->m_DataflowAttributes.hasAttribute("streamTimeout"))
+		subgraph->m_DataflowAttributes.getAttributeData("streamTimeout", m_streamTimeout);
+
+	if (subgraph->m_DataflowAttributes.hasAttribute("frameMemory")) {
+		std::string memory = subgraph->m_DataflowAttributes.getAttributeString("frameMemory");
+		if (freenectFrameMemoryMap.find(memory) == freenectFrameMemoryMap.end())
+			UBITRACK_THROW( "unknown frame memory: \"" + memory + "\"" );
+		m_frameMemory = freenectFrameMemoryMap[memory];
+	}
+
+	if (subgraph->m_DataflowAttributes.hasAttribute("eventThreadCpus")) {
+		std::string cpus = subgraph->m_DataflowAttributes.getAttributeString("eventThreadCpus");
+		if (!parseCpuList(cpus, m_eventThreadPlacement.cpus))
+			LOG4CPP_WARN( logger, "Invalid eventThreadCpus \"" << cpus << "\", the event thread is not pinned" );
+	}
+	if (subgraph->m_DataflowAttributes.hasAttribute("eventThreadPriority"))
+		subgraph->m_DataflowAttributes.getAttributeData("eventThreadPriority", m_eventThreadPlacement.priority);
 
 }
 
+void FreenectModule::initDriver() {
+	freenect_init(&m_driver, NULL);
+	//freenect_set_log_level(m_driver, FREENECT_LOG_FATAL); // Prevent's printing stuff to the screen
+	freenect_set_log_level(m_driver, FREENECT_LOG_DEBUG); // Prevent's printing stuff to the screen
+	freenect_select_subdevices(m_driver, (freenect_device_flags)(FREENECT_DEVICE_MOTOR | FREENECT_DEVICE_CAMERA));
+}
+
 void FreenectModule::startModule() {
 
+	m_startTime = Measurement::now();
+	m_firstFrameReported = false;
+	m_bStop = false;
+
+	// the device is opened in the thread, so several devices come up in parallel
+	m_Thread.reset( new boost::thread( boost::bind( &FreenectModule::ThreadProc, this ) ) );
+
+}
+
+bool FreenectModule::openDevice() {
+
 	m_device_serials.clear();
 	freenect_device_attributes* attr_list;
 	freenect_device_attributes* item;
@@ -94,15 +375,70 @@ void FreenectModule::startModule() {
 
 	if (m_device_serials.size() < 1) {
 		LOG4CPP_ERROR( logger, "No devices found.");
-		return;
+		return false;
 	}
 	if (m_device_id.empty())
 		m_device_id = m_device_serials.at(0);
 
-	m_device.reset(new FreenectDevice(m_driver, m_device_id));
+	if (!m_calibrationCacheDir.empty())
+		loadRegistrationCache();
+
+	// devices of other modules are opened concurrently in their threads
+	for (unsigned int attempt = 0; !m_device; attempt++) {
+		Measurement::Timestamp openStart = Measurement::now();
+		try {
+			m_device.reset(new FreenectDevice(m_driver, m_device_id));
+			LOG4CPP_INFO( logger, "Opened device " << m_device_id << " in " << (Measurement::now() - openStart) / 1000000
+				<< " ms, " << (Measurement::now() - m_startTime) / 1000000 << " ms after module start" );
+		} catch (std::runtime_error& e) {
+			LOG4CPP_WARN( logger, "Could not open device " << m_device_id << " (attempt " << attempt + 1 << "): " << e.what() );
+			if (attempt >= m_deviceOpenRetries || m_bStop) {
+				LOG4CPP_ERROR( logger, "Giving up on device " << m_device_id );
+				return false;
+			}
+			boost::this_thread::sleep( boost::posix_time::milliseconds( 250 << std::min(attempt, 4u) ) );
+		}
+	}
 
+	if (!m_calibrationCacheDir.empty())
+		m_cacheThread.reset( new boost::thread( boost::bind( &FreenectModule::refreshRegistrationCache, this ) ) );
+
+	configureDevice();
+
+	if (m_sharedMemoryExport) {
+		ComponentList allComponents( getAllComponents() );
+		for ( ComponentList::iterator it = allComponents.begin(); it != allComponents.end(); it++ ) {
+			SensorType type = (*it)->getKey().getSensorType();
+			if (type == SENSOR_ACCEL || type == SENSOR_COLORED_POINTCLOUD || type == SENSOR_FRAMESET)
+				continue;
+			size_t capacity;
+			if (type == SENSOR_DEPTH)
+				capacity = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT).bytes;
+			else
+				capacity = std::max(freenect_find_video_mode(FREENECT_RESOLUTION_HIGH, FREENECT_VIDEO_RGB).bytes,
+					freenect_find_video_mode(FREENECT_RESOLUTION_HIGH, FREENECT_VIDEO_IR_10BIT).bytes);
+			std::string name = sharedFrameRingName(m_device_id, getSensorTypeName(type));
+			try {
+				m_sharedFrameWriters[type].reset(new SharedFrameWriter(name, m_sharedMemorySlots, capacity));
+				LOG4CPP_INFO( logger, "Exporting " << getSensorTypeName(type) << " frames to shared memory: " << name );
+			} catch (boost::interprocess::interprocess_exception& e) {
+				LOG4CPP_ERROR( logger, "Could not create shared memory frame ring " << name << ": " << e.what() );
+			}
+		}
+	}
+
+	// streams are started on demand
+	m_lastDemandUpdate = 0;
+	m_streamStarting = false;
+	updateStreamDemand();
+	return true;
+}
+
+void FreenectModule::configureDevice() {
 	// check that steam only contains either IR or RGB nodes ..
 
+	m_device->setFrameMemory(m_frameMemory);
+
 	ComponentList allComponents( getAllComponents() );
 	for ( ComponentList::iterator it = allComponents.begin(); it != allComponents.end(); it++ ) {
 		(*it)->configureStream(m_device);
@@ -110,58 +446,82 @@ void FreenectModule::startModule() {
 			case SENSOR_IR:
 				m_device->registerIRCallback(&FreenectModule::irCb, *this );
 				LOG4CPP_INFO( logger, "registered IR callback");
-				if (!m_device->isIRStreamRunning())
-					m_device->startIRStream();
 				break;
 			case SENSOR_RGB:
 				m_device->registerImageCallback(&FreenectModule::rgbCb, *this );
 				LOG4CPP_INFO( logger, "registered RGB callback");
-				if (!m_device->isImageStreamRunning())
-					m_device->startImageStream();
 				break;
 			case SENSOR_DEPTH:
 				m_device->registerDepthCallback(&FreenectModule::depthCb, *this );
 				LOG4CPP_INFO( logger, "registered DEPTH callback");
-				if (!m_device->isDepthStreamRunning())
-					m_device->startDepthStream();
+				// an ACCEL sensor sets its own rate
+				if ((*it)->usesGravityPrior() && m_accelInterval == 0) {
+					m_accelInterval = static_cast< Measurement::Timestamp >( 1e9 / GRAVITY_POLL_RATE );
+					m_lastAccelPoll = 0;
+					m_accelPollPending = false;
+					m_accelFailed = false;
+					LOG4CPP_INFO( logger, "polling accelerometer at " << GRAVITY_POLL_RATE << " Hz as gravity prior");
+				}
+				break;
+			case SENSOR_COLORED_POINTCLOUD:
+				// fused from the RGB and DEPTH streams
+				m_device->registerImageCallback(&FreenectModule::rgbCb, *this );
+				m_device->registerDepthCallback(&FreenectModule::depthCb, *this );
+				LOG4CPP_INFO( logger, "registered RGB and DEPTH callbacks for the colored point cloud");
+				break;
+			case SENSOR_FRAMESET:
+				m_device->registerImageCallback(&FreenectModule::rgbCb, *this );
+				m_device->registerDepthCallback(&FreenectModule::depthCb, *this );
+				LOG4CPP_INFO( logger, "registered RGB and DEPTH callbacks for the frame set");
+				break;
+			case SENSOR_ACCEL:
+				m_accelInterval = static_cast< Measurement::Timestamp >( 1e9 / std::max( 0.1, (*it)->getAccelRate() ) );
+				m_lastAccelPoll = 0;
+				m_accelPollPending = false;
+				m_accelFailed = false;
+				LOG4CPP_INFO( logger, "polling accelerometer at " << (*it)->getAccelRate() << " Hz");
 				break;
 			default:
 				LOG4CPP_WARN( logger, "Device has no sensor with type: " << (*it)->getKey().getSensorType());
 				break;
 		}
 	}
-
-
-	// start thread immediately - it will not send images if the module is not running ..
-	m_Thread.reset( new boost::thread( boost::bind( &FreenectModule::ThreadProc, this ) ) );
-
 }
 
 void FreenectModule::stopModule() {
 
-	if (m_device) {
-		if (m_device->isDepthStreamRunning()) {
-			m_device->stopDepthStream();
-		}
-		if (m_device->isImageStreamRunning()) {
-			m_device->stopImageStream();
-		}
-		if (m_device->isIRStreamRunning()) {
-			m_device->stopIRStream();
-		}
-	}
-
 	// may need a lock here ...
 	if ( m_Thread )
 	{
 		m_bStop = true;
 		m_Thread->join();
+		m_Thread.reset();
 	}
 
-	if (m_device)
+	if ( m_cacheThread ) {
+		m_cacheThread->join();
+		m_cacheThread.reset();
+	}
+
+	if (m_device) {
+		m_device->stopDepthStream();
+		m_device->stopImageStream();
+		m_device->stopIRStream();
+		m_device->executeChanges();
 		m_device->shutdown();
+	}
 	m_device.reset();
 
+	StreamStartScheduler::instance().cancel(streamEndpoint(SENSOR_RGB));
+	StreamStartScheduler::instance().cancel(streamEndpoint(SENSOR_DEPTH));
+	m_streamRequested.clear();
+
+	if (m_faults)
+		LOG4CPP_INFO( logger, "Device " << m_device_id << " faults: " << m_faults << " (USB errors: " << m_usbErrors << ", stalls: "
+			<< m_stalls << "), recoveries: " << m_recoveries << ", total recovery time: " << m_recoveryTime / 1000000 << " ms" );
+
+	m_sharedFrameWriters.clear();
+
 }
 
 
@@ -178,39 +538,490 @@ void FreenectModule::ThreadProc()
 {
 	LOG4CPP_DEBUG( logger, "Freenect Thread started" );
 
+	if (!m_eventThreadPlacement.empty()) {
+		std::string warnings;
+		std::string effective = applyThreadPlacement(m_eventThreadPlacement, warnings);
+		if (!warnings.empty())
+			LOG4CPP_WARN( logger, "Event thread placement of " << m_device_id << " partly failed, continuing without: " << warnings );
+		LOG4CPP_INFO( logger, "Event thread of " << m_device_id << " runs on " << effective );
+	}
+
+	if (!openDevice())
+		return;
+
+	// consecutive event loop errors before the device counts as failed
+	static const int USB_ERROR_LIMIT = 3;
+	int usbErrors = 0;
+
 	while ( !m_bStop )
 	{
 
 		timeval t;
 		t.tv_sec = 0;
 		t.tv_usec = 10000;
-		if (freenect_process_events_timeout(m_driver, &t) < 0)
-			UBITRACK_THROW("freenect_process_events error");
-		if (m_device)
-			m_device->executeChanges();
+		if (freenect_process_events_timeout(m_driver, &t) < 0) {
+			++m_usbErrors;
+			LOG4CPP_WARN( logger, "freenect_process_events error on device " << m_device_id );
+			if (++usbErrors >= USB_ERROR_LIMIT) {
+				usbErrors = 0;
+				if (!recoverDevice("USB error"))
+					break;
+			}
+			continue;
+		}
+		usbErrors = 0;
+
+		if (m_device) {
+			if (const char* stalled = stalledStream(Measurement::now())) {
+				++m_stalls;
+				if (!recoverDevice(std::string(stalled) + " stream stalled"))
+					break;
+				continue;
+			}
+			pollAccelerometer();
+			updateStreamDemand();
+			bool ok = m_device->executeChanges();
+			if (m_streamStarting)
+				finishStreamStart(ok);
+		}
 	}
 
 	LOG4CPP_DEBUG( logger, "Freenect Thread stopped" );
 }
 
+const char* FreenectModule::stalledStream(Measurement::Timestamp now) {
+	if (m_streamTimeout == 0)
+		return NULL;
+	const Measurement::Timestamp timeout = Measurement::Timestamp(m_streamTimeout) * 1000000;
+	if ((m_device->isImageStreamRunning() || m_device->isIRStreamRunning()) && now > m_lastVideoFrame + timeout)
+		return "video";
+	if (m_device->isDepthStreamRunning() && now > m_lastDepthFrame + timeout)
+		return "DEPTH";
+	return NULL;
+}
+
+bool FreenectModule::recoverDevice(const std::string& reason) {
+	++m_faults;
+	m_faultTime = Measurement::now();
+	LOG4CPP_ERROR( logger, "Device " << m_device_id << " failed (" << reason << "), reopening it. Faults: " << m_faults
+		<< ", USB errors: " << m_usbErrors << ", stalls: " << m_stalls );
+
+	if ( m_cacheThread ) {
+		m_cacheThread->join();
+		m_cacheThread.reset();
+	}
+
+	// the streams the device was asked for, not only the running ones
+	FreenectDevice::StreamState state = m_device->getStreamState();
+	m_device->shutdown();
+	boost::atomic_store( &m_device, boost::shared_ptr< FreenectDevice >() );
+	if (m_streamStarting) {
+		m_streamStarting = false;
+		StreamStartScheduler::instance().failed(streamEndpoint(m_streamStartingType), m_faultTime);
+	}
+
+	// a failed transfer can leave the USB context unusable
+	freenect_shutdown(m_driver);
+	initDriver();
+
+	// keep trying until the device is back, it may have been unplugged
+	for (unsigned int attempt = 0; !m_bStop; attempt++) {
+		try {
+			boost::atomic_store( &m_device, boost::shared_ptr< FreenectDevice >( new FreenectDevice(m_driver, m_device_id) ) );
+			break;
+		} catch (std::runtime_error& e) {
+			LOG4CPP_DEBUG( logger, "Could not reopen device " << m_device_id << " (attempt " << attempt + 1 << "): " << e.what() );
+			boost::this_thread::sleep( boost::posix_time::milliseconds( 250 << std::min(attempt, 4u) ) );
+		}
+	}
+	if (!m_device)
+		return false;
+
+	m_cloudBuilder.reset();
+	m_cloudTables.reset();
+	configureDevice();
+	m_device->restoreStreamState(state);
+	m_lastVideoFrame = m_lastDepthFrame = Measurement::now();
+	m_recovering = true;
+	LOG4CPP_INFO( logger, "Reopened device " << m_device_id << " after " << (Measurement::now() - m_faultTime) / 1000000 << " ms" );
+	return true;
+}
+
+bool FreenectModule::hasStreamDemand(SensorType type, Measurement::Timestamp now) {
+	const ComponentKey key(type);
+	if (hasComponent(key) && getComponent(key)->hasDemand(now))
+		return true;
+
+	SharedFrameWriterMap::iterator it = m_sharedFrameWriters.find(type);
+	if (it != m_sharedFrameWriters.end()) {
+		if (m_streamIdleTimeout == 0)
+			return true;
+		if (it->second->hasActiveReader(boost::uint32_t(now / 1000000), m_streamIdleTimeout))
+			return true;
+	}
+	return false;
+}
+
+void FreenectModule::updateStreamDemand() {
+	Measurement::Timestamp now = Measurement::now();
+	if (now - m_lastDemandUpdate < 100000000ULL)
+		return;
+	m_lastDemandUpdate = now;
+
+	// RGB and IR share the video stream, RGB wins if both are requested
+	bool cloud = hasStreamDemand(SENSOR_COLORED_POINTCLOUD, now);
+	bool frameSet = hasStreamDemand(SENSOR_FRAMESET, now);
+	bool rgb = cloud || (frameSet && getComponent(ComponentKey(SENSOR_FRAMESET))->frameSetUses(SENSOR_RGB)) || hasStreamDemand(SENSOR_RGB, now);
+	bool ir = !rgb && hasStreamDemand(SENSOR_IR, now);
+	bool depth = cloud || (frameSet && getComponent(ComponentKey(SENSOR_FRAMESET))->frameSetUses(SENSOR_DEPTH)) || hasStreamDemand(SENSOR_DEPTH, now);
+
+	// starts go through the process-wide scheduler, stops are immediate
+	if (rgb && !m_device->isImageStreamRunning()) {
+		if (scheduleStreamStart(SENSOR_RGB, now))
+			m_device->startImageStream();
+	} else if (ir && !m_device->isIRStreamRunning()) {
+		if (scheduleStreamStart(SENSOR_IR, now))
+			m_device->startIRStream();
+	} else if (!rgb && !ir) {
+		StreamStartScheduler::instance().cancel(streamEndpoint(SENSOR_RGB));
+		if (m_device->isImageStreamRunning() || m_device->isIRStreamRunning()) {
+			LOG4CPP_INFO( logger, "No consumers for video stream, stopping it" );
+			m_device->stopImageStream();
+			m_device->stopIRStream();
+		}
+	}
+
+	if (depth && !m_device->isDepthStreamRunning()) {
+		if (scheduleStreamStart(SENSOR_DEPTH, now))
+			m_device->startDepthStream();
+	} else if (!depth) {
+		StreamStartScheduler::instance().cancel(streamEndpoint(SENSOR_DEPTH));
+		if (m_device->isDepthStreamRunning()) {
+			LOG4CPP_INFO( logger, "No consumers for DEPTH stream, stopping it" );
+			m_device->stopDepthStream();
+		}
+	}
+}
+
+std::string FreenectModule::streamEndpoint(SensorType type) const {
+	// RGB and IR share the video endpoint
+	return m_device_id + (type == SENSOR_DEPTH ? "/DEPTH" : "/VIDEO");
+}
+
+boost::uint64_t FreenectModule::streamBandwidth(SensorType type) const {
+	// formats as transferred over USB, the conversion happens on the host
+	freenect_frame_mode mode;
+	if (type == SENSOR_DEPTH)
+		mode = freenect_find_depth_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_DEPTH_11BIT_PACKED);
+	else if (type == SENSOR_IR)
+		mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_IR_10BIT_PACKED);
+	else
+		mode = freenect_find_video_mode(FREENECT_RESOLUTION_MEDIUM, FREENECT_VIDEO_BAYER);
+	return boost::uint64_t(mode.bytes) * mode.framerate;
+}
+
+bool FreenectModule::scheduleStreamStart(SensorType type, Measurement::Timestamp now) {
+	if (m_streamStarting)
+		return false;
+	requestStream(type, now);
+	StreamStartScheduler& scheduler = StreamStartScheduler::instance();
+	scheduler.request(streamEndpoint(type), streamBandwidth(type), now);
+	boost::uint64_t waited;
+	if (!scheduler.grant(streamEndpoint(type), now, waited))
+		return false;
+	LOG4CPP_DEBUG( logger, "Start of " << getSensorTypeName(type) << " stream granted after " << waited / 1000000 << " ms" );
+	m_streamStarting = true;
+	m_streamStartingType = type;
+	m_streamStartingTime = now;
+	return true;
+}
+
+void FreenectModule::finishStreamStart(bool ok) {
+	m_streamStarting = false;
+	const SensorType type = m_streamStartingType;
+	const bool running = type == SENSOR_DEPTH ? m_device->isDepthStreamRunning() :
+		type == SENSOR_IR ? m_device->isIRStreamRunning() : m_device->isImageStreamRunning();
+	Measurement::Timestamp now = Measurement::now();
+	StreamStartScheduler& scheduler = StreamStartScheduler::instance();
+	if (ok && running) {
+		scheduler.started(streamEndpoint(type), now);
+		// the watchdog counts from the start
+		if (type == SENSOR_DEPTH)
+			m_lastDepthFrame = now;
+		else
+			m_lastVideoFrame = now;
+		LOG4CPP_INFO( logger, getSensorTypeName(type) << " stream of " << m_device_id << " started in "
+			<< (now - m_streamStartingTime) / 1000000 << " ms" );
+	} else {
+		unsigned attempts = scheduler.failed(streamEndpoint(type), now);
+		LOG4CPP_WARN( logger, "Could not start " << getSensorTypeName(type) << " stream of " << m_device_id
+			<< " (attempt " << attempts << "), retrying" );
+	}
+}
+
+void FreenectModule::requestStream(SensorType type, Measurement::Timestamp now) {
+	// the stream only counts as (re)started if it was not already pending
+	if (m_streamRequested.find(type) == m_streamRequested.end()) {
+		LOG4CPP_INFO( logger, "Starting " << getSensorTypeName(type) << " stream" );
+		m_streamRequested[type] = now;
+	}
+}
+
+void FreenectModule::streamDelivered(SensorType type, const ImageBuffer& image) {
+	Measurement::Timestamp now = Measurement::now();
+	if (type == SENSOR_DEPTH)
+		m_lastDepthFrame = now;
+	else
+		m_lastVideoFrame = now;
+
+	ArrivalLateness& lateness = type == SENSOR_DEPTH ? m_depthLateness : m_videoLateness;
+	if (image.metadata.framerate > 0 && lateness.add(image.sequence, now, 1000000000 / image.metadata.framerate)) {
+		LOG4CPP_INFO( logger, getSensorTypeName(type) << " frames arrive " << lateness.mean() * 1e-6 << " ms late on average, at most "
+			<< lateness.max() * 1e-6 << " ms, " << lateness.late() << "/" << lateness.frames() << " frames more than "
+			<< ArrivalLateness::LATE_THRESHOLD / 1000000 << " ms" );
+		lateness.resetStatistics();
+	}
+	if (m_recovering) {
+		m_recovering = false;
+		++m_recoveries;
+		m_recoveryTime += now - m_faultTime;
+		LOG4CPP_INFO( logger, "Device " << m_device_id << " recovered after " << (now - m_faultTime) / 1000000 << " ms. Recoveries: "
+			<< m_recoveries << "/" << m_faults << ", total recovery time: " << m_recoveryTime / 1000000 << " ms" );
+	}
+
+	StreamRequestMap::iterator it = m_streamRequested.find(type);
+	if (it == m_streamRequested.end())
+		return;
+	if (!m_firstFrameReported) {
+		m_firstFrameReported = true;
+		LOG4CPP_INFO( logger, "First frame of " << m_device_id << " " << (Measurement::now() - m_startTime) / 1000000
+			<< " ms after module start" << (m_calibrationCacheDir.empty() ? "" : m_registrationCacheHit ? ", calibration cache hit" : ", calibration cache miss") );
+	}
+	LOG4CPP_INFO( logger, getSensorTypeName(type) << " stream started after " << (Measurement::now() - it->second) / 1000000 << " ms" );
+	if (m_frameMemory != FRAME_MEMORY_HEAP)
+		LOG4CPP_INFO( logger, getSensorTypeName(type) << " driver buffer memory: "
+			<< (type == SENSOR_DEPTH ? m_device->getDepthMemory() : m_device->getVideoMemory()).summary() );
+	m_streamRequested.erase(it);
+}
+
+void FreenectModule::loadRegistrationCache() {
+	Measurement::Timestamp start = Measurement::now();
+	std::string file = RegistrationCache::path(m_calibrationCacheDir, m_device_id);
+	boost::shared_ptr< const RegistrationCache > cache = RegistrationCache::load(file, m_device_id);
+	m_registrationCacheHit = cache.get() != NULL;
+	boost::atomic_store( &m_registrationCache, cache );
+	if (m_registrationCacheHit)
+		LOG4CPP_INFO( logger, "Loaded calibration cache " << file << " in " << (Measurement::now() - start) / 1000000 << " ms" );
+	else
+		LOG4CPP_INFO( logger, "No valid calibration cache " << file << ", it will be created" );
+}
+
+void FreenectModule::refreshRegistrationCache() {
+	Measurement::Timestamp start = Measurement::now();
+	boost::shared_ptr< const RegistrationCache > cache( getRegistrationCache() );
+	const freenect_registration& registration = m_device->getRegistration();
+	if (cache && cache->matches(registration)) {
+		LOG4CPP_DEBUG( logger, "Calibration cache of " << m_device_id << " is up to date" );
+		return;
+	}
+
+	std::string file = RegistrationCache::path(m_calibrationCacheDir, m_device_id);
+	if (!RegistrationCache::store(file, m_device_id, registration, getDepthFocalLength(registration, REGISTRATION_WIDTH))) {
+		LOG4CPP_WARN( logger, "Could not write calibration cache " << file );
+		return;
+	}
+	cache = RegistrationCache::load(file, m_device_id);
+	boost::atomic_store( &m_registrationCache, cache );
+	LOG4CPP_INFO( logger, "Calibration cache " << file << (cache ? " refreshed in " : " could not be reloaded after ")
+		<< (Measurement::now() - start) / 1000000 << " ms" );
+}
+
+bool FreenectModule::reduceResolution(SensorType type) {
+	// called from the delivery threads, the device may be replaced meanwhile
+	boost::shared_ptr< FreenectDevice > device( boost::atomic_load( &m_device ) );
+	// depth only supports a single resolution
+	if (!device || type == SENSOR_DEPTH)
+		return false;
+	if (device->getImageOutputMode() != FREENECT_RESOLUTION_HIGH)
+		return false;
+	device->setImageOutputMode(FREENECT_RESOLUTION_MEDIUM);
+	return true;
+}
+
+bool FreenectModule::restoreResolution(SensorType type) {
+	boost::shared_ptr< FreenectDevice > device( boost::atomic_load( &m_device ) );
+	if (!device || type == SENSOR_DEPTH)
+		return false;
+	if (device->getImageOutputMode() != FREENECT_RESOLUTION_MEDIUM)
+		return false;
+	device->setImageOutputMode(FREENECT_RESOLUTION_HIGH);
+	return true;
+}
+
+bool FreenectModule::getStreamSequence(SensorType type, FrameSequencer& sequence) {
+	boost::shared_ptr< FreenectDevice > device( boost::atomic_load( &m_device ) );
+	if (!device)
+		return false;
+	switch (type) {
+		case SENSOR_RGB:
+		case SENSOR_IR:
+			sequence = device->getVideoSequence();
+			return true;
+		case SENSOR_DEPTH:
+		case SENSOR_COLORED_POINTCLOUD:
+			sequence = device->getDepthSequence();
+			return true;
+		default:
+			return false;
+	}
+}
+
+void FreenectModule::storeCloudColor(const ImageBuffer& image, Measurement::Timestamp ts) {
+	if (image.metadata.video_format != FREENECT_VIDEO_RGB || image.metadata.width != REGISTRATION_WIDTH ||
+		image.metadata.height != REGISTRATION_HEIGHT) {
+		if (!m_cloudColorWarned)
+			LOG4CPP_WARN( logger, "The colored point cloud needs 640x480 RGB frames, the point cloud is not colored" );
+		m_cloudColorWarned = true;
+		m_cloudColor.clear();
+		return;
+	}
+	// libfreenect fills its buffer in place, so the frame is copied
+	const boost::uint8_t* data = static_cast< const boost::uint8_t* >( image.image_buffer.get() );
+	m_cloudColor.assign(data, data + image.metadata.bytes);
+	m_cloudColorTime = ts;
+}
+
+bool FreenectModule::buildColoredPointCloud(const ImageBuffer& depth, float* out, Measurement::Timestamp& colorTime) {
+	if (!m_cloudBuilder.ready()) {
+		// prefer the mapped tables of the calibration cache
+		m_cloudTables = getRegistrationCache();
+		if (m_cloudTables) {
+			m_cloudBuilder.setTables(m_cloudTables->registrationTable(), m_cloudTables->depthToRGBShift(), m_cloudTables->rays());
+		} else {
+			const freenect_registration& registration = m_device->getRegistration();
+			m_cloudBuilder.setRegistration(registration, getDepthFocalLength(registration, REGISTRATION_WIDTH));
+		}
+	}
+
+	const bool hasColor = !m_cloudColor.empty();
+	colorTime = hasColor ? m_cloudColorTime : 0;
+	m_cloudBuilder.build(reinterpret_cast< const boost::uint16_t* >( depth.image_buffer.get() ),
+		hasColor ? &m_cloudColor[0] : NULL, out);
+	return true;
+}
+
+bool FreenectModule::accelEnabled() {
+	// only set for an ACCEL sensor or a gravity prior
+	return m_accelInterval != 0;
+}
+
+bool FreenectModule::getGravity(double& x, double& y, double& z) {
+	boost::mutex::scoped_lock lock(m_gravityMutex);
+	if (!m_gravityValid)
+		return false;
+	x = m_gravity[0];
+	y = m_gravity[1];
+	z = m_gravity[2];
+	return true;
+}
+
+void FreenectModule::pollAccelerometer() {
+	if (!accelEnabled())
+		return;
+
+	Measurement::Timestamp now = Measurement::now();
+	if (!m_accelPollPending) {
+		// without depth frames to align with, poll on a timer
+		Measurement::Timestamp wait = m_device->isDepthStreamRunning() ? 2 * m_accelInterval : m_accelInterval;
+		if (now - m_lastAccelPoll < wait)
+			return;
+		m_accelPollTime = now;
+	}
+	m_accelPollPending = false;
+	m_lastAccelPoll = now;
+
+	double x, y, z;
+	if (!m_device->getAccelerometer(x, y, z)) {
+		if (!m_accelFailed)
+			LOG4CPP_WARN( logger, "Could not read the accelerometer, is the motor subdevice available?" );
+		m_accelFailed = true;
+		return;
+	}
+	m_accelFailed = false;
+	{
+		boost::mutex::scoped_lock lock(m_gravityMutex);
+		m_gravity[0] = x;
+		m_gravity[1] = y;
+		m_gravity[2] = z;
+		m_gravityValid = true;
+	}
+	const ComponentKey key(SENSOR_ACCEL);
+	if (hasComponent(key))
+		getComponent(key)->sendAcceleration(m_accelPollTime, x, y, z);
+}
+
+void FreenectModule::publishSharedFrame(SensorType type, const ImageBuffer& image, Measurement::Timestamp ts) {
+	SharedFrameWriterMap::iterator it = m_sharedFrameWriters.find(type);
+	if (it == m_sharedFrameWriters.end())
+		return;
+	switch (it->second->publish(image.image_buffer.get(), image.metadata, image.timestamp, ts)) {
+		case SharedFrameWriter::TOO_LARGE:
+			LOG4CPP_WARN( logger, "Frame does not fit into shared memory frame ring" );
+			break;
+		case SharedFrameWriter::ALL_LEASED:
+			LOG4CPP_DEBUG( logger, "All slots of the shared memory frame ring are leased, frame dropped" );
+			break;
+		default:
+			break;
+	}
+}
+
 void FreenectModule::rgbCb(const ImageBuffer& image, void* cookie) {
+	Measurement::Timestamp ts = Measurement::now();
+	streamDelivered(SENSOR_RGB, image);
+	if (hasComponent( ComponentKey(SENSOR_COLORED_POINTCLOUD) ))
+		storeCloudColor(image, ts);
+	publishSharedFrame(SENSOR_RGB, image, ts);
 	const ComponentKey key(SENSOR_RGB);
 	if (hasComponent( key )) {
-		getComponent( key )->imageCb(image);
+		getComponent( key )->imageCb(image, ts);
 	}
+	const ComponentKey setKey(SENSOR_FRAMESET);
+	if (hasComponent( setKey ))
+		getComponent( setKey )->frameSetCb(SENSOR_RGB, image, ts);
 }
 
 void FreenectModule::irCb(const ImageBuffer& image, void* cookie) {
+	Measurement::Timestamp ts = Measurement::now();
+	streamDelivered(SENSOR_IR, image);
+	publishSharedFrame(SENSOR_IR, image, ts);
 	const ComponentKey key(SENSOR_IR);
 	if (hasComponent( key )) {
-		getComponent( key )->imageCb(image);
+		getComponent( key )->imageCb(image, ts);
 	}
 }
 
 void FreenectModule::depthCb(const ImageBuffer& image, void* cookie) {
+	Measurement::Timestamp ts = Measurement::now();
+	streamDelivered(SENSOR_DEPTH, image);
+	publishSharedFrame(SENSOR_DEPTH, image, ts);
 	const ComponentKey key(SENSOR_DEPTH);
 	if (hasComponent( key )) {
-		getComponent( key )->imageCb(image);
+		getComponent( key )->imageCb(image, ts);
+	}
+	const ComponentKey cloudKey(SENSOR_COLORED_POINTCLOUD);
+	if (hasComponent( cloudKey )) {
+		getComponent( cloudKey )->imageCb(image, ts);
+	}
+	const ComponentKey setKey(SENSOR_FRAMESET);
+	if (hasComponent( setKey ))
+		getComponent( setKey )->frameSetCb(SENSOR_DEPTH, image, ts);
+
+	// poll the accelerometer right after a depth frame, so the control
+	// transfer happens in the gap before the next frame
+	if (accelEnabled() && ts - m_lastAccelPoll >= m_accelInterval) {
+		m_accelPollPending = true;
+		m_accelPollTime = ts;
 	}
 }
 
@@ -221,34 +1032,475 @@ boost::shared_ptr< FreenectModule::ComponentClass > FreenectModule::createCompon
 
 FreenectComponent::FreenectComponent( const std::string& name, boost::shared_ptr< Graph::UTQLSubgraph > subgraph, const FreenectComponentKey& componentKey, FreenectModule* pModule )
 	: FreenectModule::Component( name, componentKey, pModule )
+	, m_frameModeValid( false )
+	, m_frameLayoutValid( false )
+	, m_framePoolSize( 4 )
+	, m_yuvOutput( YUV_OUTPUT_RGB )
 	, m_outPort( "Output", *this )
+	, m_pullPort( "PullOutput", *this, boost::bind( &FreenectComponent::pullLatest, this, _1 ) )
+	, m_sequencePort( "SequenceNumber", *this )
+	, m_lastPull( 0 )
+	, m_gravityPort( "Gravity", *this )
+	, m_accelRate( 10.0 )
+	, m_frameSetDepthPort( "Depth", *this )
+	, m_frameSetColorPort( "Color", *this )
+	, m_frameSetGroup( "default" )
+	, m_frameSetTolerance( 16.0 )
+	, m_compressedPort( "Compressed", *this )
+	, m_markerPort( "Markers", *this )
+	, m_markerStatsPort( "MarkerStatistics", *this )
+	, m_markerImageOutput( true )
+	, m_markerInputValid( false )
+	, m_deliveryPolicy( DELIVER_SYNCHRONOUS )
+	, m_targetFrameRate( 0 )
+	, m_adaptiveDowngrade( false )
+	, m_saturationPeriod( 2000 )
+	, m_configuredFrameRate( 0 )
+	, m_rateReductions( 0 )
+	, m_resolutionReduced( false )
+	, m_calmPeriods( 0 )
+	, m_lastAccepted( 0 )
+	, m_changeHeartbeat( 1000 )
+	, m_lastEmitted( 0 )
+	, m_bytesSuppressed( 0 )
+	, m_changeGateTime( 0 )
+	, m_deliveryStop( false )
+	, m_pipelineStages( "convert,upload,send,compress,normals,pyramid,foreground,plane" )
+	, m_pipelineDepth( 3 )
+	, m_saturationWindowStart( 0 )
+	, m_windowFrames( 0 )
+	, m_windowSaturated( 0 )
+	, m_framesOffered( 0 )
+	, m_framesDelivered( 0 )
+	, m_framesSkippedRate( 0 )
+	, m_framesSkippedBusy( 0 )
+	, m_framesSuppressed( 0 )
+	, m_downgrades( 0 )
+	, m_normalsPort( "Normals", *this )
+	, m_pyramidPort( "Pyramid", *this )
+	, m_foregroundPort( "Foreground", *this )
+	, m_foregroundBoxesPort( "ForegroundBoxes", *this )
+	, m_backgroundControlPort( "BackgroundControl", *this, boost::bind( &FreenectComponent::receiveBackgroundControl, this, _1 ) )
+	, m_backgroundLearn( true )
+	, m_backgroundReset( false )
+	, m_backgroundLearnFrames( 0 )
+	, m_backgroundFrames( 0 )
+	, m_planeRemovedPort( "PlaneRemoved", *this )
+	, m_planePort( "Plane", *this )
+	, m_planeGravityPrior( false )
+	, m_planeFrames( 0 )
+	, m_planeFound( 0 )
+	, m_planeTracked( 0 )
+	, m_planeInlierSum( 0 )
+	, m_maxColorAge( 100 )
+	, m_colorAgeSum( 0 )
+	, m_colorAgeMax( 0 )
+	, m_cloudFrames( 0 )
+	, m_coloredFrames( 0 )
+	, m_staleColorFrames( 0 )
+	, m_compressedFrames( 0 )
+	, m_compressedBytesIn( 0 )
+	, m_compressedBytesOut( 0 )
+	, m_compressionTime( 0 )
 {
 	switch(componentKey.getSensorType()) {
 		case SENSOR_IR:
 			subgraph->m_DataflowAttributes.getAttributeData( "videoModeIR", m_stream_mode );
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "streamFormat" ) )
+				m_streamFormat = subgraph->m_DataflowAttributes.getAttributeString( "streamFormat" );
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "irMarkerThreshold" ) ) {
+				unsigned int threshold = 200;
+				unsigned int minArea = 2;
+				unsigned int maxArea = 1000;
+				subgraph->m_DataflowAttributes.getAttributeData( "irMarkerThreshold", threshold );
+				if ( subgraph->m_DataflowAttributes.hasAttribute( "irMarkerMinArea" ) )
+					subgraph->m_DataflowAttributes.getAttributeData( "irMarkerMinArea", minArea );
+				if ( subgraph->m_DataflowAttributes.hasAttribute( "irMarkerMaxArea" ) )
+					subgraph->m_DataflowAttributes.getAttributeData( "irMarkerMaxArea", maxArea );
+				m_markerDetector.setThreshold( threshold );
+				m_markerDetector.setAreaLimits( minArea, maxArea );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "irMarkerImageOutput" ) )
+				m_markerImageOutput = subgraph->m_DataflowAttributes.getAttributeString( "irMarkerImageOutput" ) == "true";
 			break;
 		case SENSOR_RGB:
 			subgraph->m_DataflowAttributes.getAttributeData( "videoModeRGB", m_stream_mode );
 			break;
 		case SENSOR_DEPTH:
 			subgraph->m_DataflowAttributes.getAttributeData( "videoModeDEPTH", m_stream_mode );
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "streamFormat" ) )
+				m_streamFormat = subgraph->m_DataflowAttributes.getAttributeString( "streamFormat" );
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "normalSmoothingSize" ) ) {
+				int radius = 5;
+				subgraph->m_DataflowAttributes.getAttributeData( "normalSmoothingSize", radius );
+				m_normalEstimator.setSmoothingRadius( radius );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "normalMaxDepthChange" ) ) {
+				double change = 0.02;
+				subgraph->m_DataflowAttributes.getAttributeData( "normalMaxDepthChange", change );
+				m_normalEstimator.setMaxDepthChange( static_cast< float >( change ) );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "pyramidLevels" ) ) {
+				int levels = 4;
+				subgraph->m_DataflowAttributes.getAttributeData( "pyramidLevels", levels );
+				m_pyramidBuilder.setLevels( levels );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "pyramidEdgeThreshold" ) ) {
+				double threshold = 0.05;
+				subgraph->m_DataflowAttributes.getAttributeData( "pyramidEdgeThreshold", threshold );
+				m_pyramidBuilder.setEdgeThreshold( static_cast< float >( threshold ) );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "backgroundMode" ) )
+				m_backgroundLearn = subgraph->m_DataflowAttributes.getAttributeString( "backgroundMode" ) != "freeze";
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "backgroundLearnFrames" ) )
+				subgraph->m_DataflowAttributes.getAttributeData( "backgroundLearnFrames", m_backgroundLearnFrames );
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "backgroundTolerance" ) ) {
+				unsigned int tolerance = 30;
+				subgraph->m_DataflowAttributes.getAttributeData( "backgroundTolerance", tolerance );
+				m_backgroundModel.setTolerance( tolerance );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "backgroundConfidence" ) ) {
+				unsigned int confidence = 10;
+				subgraph->m_DataflowAttributes.getAttributeData( "backgroundConfidence", confidence );
+				m_backgroundModel.setConfidence( confidence, 3 * confidence );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "foregroundMinPixels" ) ) {
+				unsigned int pixels = 64;
+				subgraph->m_DataflowAttributes.getAttributeData( "foregroundMinPixels", pixels );
+				m_backgroundModel.setMinBoxPixels( pixels );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "planeGridStep" ) ) {
+				int step = 8;
+				subgraph->m_DataflowAttributes.getAttributeData( "planeGridStep", step );
+				m_planeRemover.setGridStep( step );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "planeIterations" ) ) {
+				unsigned int iterations = 64;
+				subgraph->m_DataflowAttributes.getAttributeData( "planeIterations", iterations );
+				m_planeRemover.setIterations( iterations );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "planeThreshold" ) ) {
+				double threshold = 20.0;
+				subgraph->m_DataflowAttributes.getAttributeData( "planeThreshold", threshold );
+				m_planeRemover.setThreshold( threshold );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "planeMinInliers" ) ) {
+				double ratio = 0.1;
+				subgraph->m_DataflowAttributes.getAttributeData( "planeMinInliers", ratio );
+				m_planeRemover.setMinInlierRatio( ratio );
+			}
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "planeGravityPrior" ) )
+				m_planeGravityPrior = subgraph->m_DataflowAttributes.getAttributeString( "planeGravityPrior" ) == "true";
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "planeMaxTilt" ) ) {
+				double degrees = 20.0;
+				subgraph->m_DataflowAttributes.getAttributeData( "planeMaxTilt", degrees );
+				m_planeRemover.setMaxTilt( degrees );
+			}
+			break;
+		case SENSOR_ACCEL:
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "accelRate" ) )
+				subgraph->m_DataflowAttributes.getAttributeData( "accelRate", m_accelRate );
+			break;
+		case SENSOR_COLORED_POINTCLOUD:
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "maxColorAge" ) )
+				subgraph->m_DataflowAttributes.getAttributeData( "maxColorAge", m_maxColorAge );
+			break;
+		case SENSOR_FRAMESET:
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "frameSetGroup" ) )
+				m_frameSetGroup = subgraph->m_DataflowAttributes.getAttributeString( "frameSetGroup" );
+			if ( subgraph->m_DataflowAttributes.hasAttribute( "frameSetTolerance" ) )
+				subgraph->m_DataflowAttributes.getAttributeData( "frameSetTolerance", m_frameSetTolerance );
+			m_frameSetDepth.member = name + "/DEPTH";
+			m_frameSetColor.member = name + "/COLOR";
 			break;
 		default:
 			// never gets here ..
 			break;
 	}
+
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "yuvOutput" ) ) {
+		std::string sOutput = subgraph->m_DataflowAttributes.getAttributeString( "yuvOutput" );
+		if ( freenectYUVOutputMap.find( sOutput ) == freenectYUVOutputMap.end() )
+			UBITRACK_THROW( "unknown YUV output: \"" + sOutput + "\"" );
+		m_yuvOutput = freenectYUVOutputMap[ sOutput ];
+	}
+
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "deliveryPolicy" ) ) {
+		std::string sPolicy = subgraph->m_DataflowAttributes.getAttributeString( "deliveryPolicy" );
+		if ( freenectDeliveryPolicyMap.find( sPolicy ) == freenectDeliveryPolicyMap.end() )
+			UBITRACK_THROW( "unknown delivery policy: \"" + sPolicy + "\"" );
+		m_deliveryPolicy = freenectDeliveryPolicyMap[ sPolicy ];
+	}
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "pipelineStages" ) )
+		m_pipelineStages = subgraph->m_DataflowAttributes.getAttributeString( "pipelineStages" );
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "pipelineDepth" ) )
+		subgraph->m_DataflowAttributes.getAttributeData( "pipelineDepth", m_pipelineDepth );
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "framePoolSize" ) )
+		subgraph->m_DataflowAttributes.getAttributeData( "framePoolSize", m_framePoolSize );
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "workerCpus" ) ) {
+		std::string cpus = subgraph->m_DataflowAttributes.getAttributeString( "workerCpus" );
+		if ( !parseCpuList( cpus, m_workerPlacement.cpus ) )
+			LOG4CPP_WARN( logger, getName() << ": invalid workerCpus \"" << cpus << "\", the workers are not pinned" );
+	}
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "workerPriority" ) )
+		subgraph->m_DataflowAttributes.getAttributeData( "workerPriority", m_workerPlacement.priority );
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "targetFrameRate" ) )
+		subgraph->m_DataflowAttributes.getAttributeData( "targetFrameRate", m_targetFrameRate );
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "adaptiveDowngrade" ) )
+		m_adaptiveDowngrade = subgraph->m_DataflowAttributes.getAttributeString( "adaptiveDowngrade" ) == "true";
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "saturationPeriod" ) )
+		subgraph->m_DataflowAttributes.getAttributeData( "saturationPeriod", m_saturationPeriod );
+	if ( m_saturationPeriod == 0 )
+		UBITRACK_THROW( "saturationPeriod must be at least 1 ms" );
+	m_configuredFrameRate = m_targetFrameRate;
+
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "changeThreshold" ) ) {
+		double threshold = 0;
+		subgraph->m_DataflowAttributes.getAttributeData( "changeThreshold", threshold );
+		m_changeGate.setThreshold( threshold );
+		if ( subgraph->m_DataflowAttributes.hasAttribute( "changeHeartbeat" ) )
+			subgraph->m_DataflowAttributes.getAttributeData( "changeHeartbeat", m_changeHeartbeat );
+		if ( subgraph->m_DataflowAttributes.hasAttribute( "changeRowStep" ) ) {
+			int rowStep = 4;
+			subgraph->m_DataflowAttributes.getAttributeData( "changeRowStep", rowStep );
+			m_changeGate.setRowStep( rowStep );
+		}
+	}
+}
+
+FreenectComponent::~FreenectComponent() {
+	stopDeliveryThread();
+	m_pipeline.stop();
+}
+
+void FreenectComponent::start() {
+	buildPipeline();
+	if ( m_deliveryPolicy == DELIVER_PIPELINE && boost::thread::hardware_concurrency() < 2 ) {
+		// the flow graph only runs on TBB worker threads, there are none on a single core
+		LOG4CPP_WARN( logger, getName() << ": the pipeline delivery policy needs more than one core, delivering synchronously" );
+		m_deliveryPolicy = DELIVER_SYNCHRONOUS;
+	}
+	if ( m_deliveryPolicy == DELIVER_PIPELINE ) {
+		if ( !m_workerPlacement.empty() && !m_workerArena ) {
+			// one worker per placed CPU, the slot reserved for the capture thread only hands frames in
+			const int concurrency = m_workerPlacement.cpus.empty() ? int( tbb::task_arena::automatic )
+				: int( m_workerPlacement.cpus.size() ) + 1;
+			m_workerArena.reset( new tbb::task_arena( concurrency, 1 ) );
+			m_workerArena->initialize();
+			m_workerObserver.reset( new WorkerPlacementObserver( *m_workerArena, m_workerPlacement ) );
+			m_workerObserver->observe( true );
+		}
+		m_pipeline.start( m_pipelineDepth, m_workerArena.get() );
+	}
+	if ( m_deliveryPolicy == DELIVER_LATEST_ONLY && !m_deliveryThread ) {
+		m_deliveryStop = false;
+		m_deliveryThread.reset( new boost::thread( boost::bind( &FreenectComponent::DeliveryThreadProc, this ) ) );
+	}
+	if ( getKey().getSensorType() == SENSOR_FRAMESET ) {
+		const boost::uint64_t tolerance = boost::uint64_t( m_frameSetTolerance * 1e6 );
+		if ( m_frameSetDepthPort.isConnected() ) {
+			FreenectFrameSetHub::instance().join( m_frameSetGroup, m_frameSetDepth.member,
+				boost::bind( &FreenectComponent::deliverFrameSet, this, SENSOR_DEPTH, _1, _2, _3 ), tolerance );
+			m_frameSetDepth.joined = true;
+		}
+		if ( m_frameSetColorPort.isConnected() ) {
+			FreenectFrameSetHub::instance().join( m_frameSetGroup, m_frameSetColor.member,
+				boost::bind( &FreenectComponent::deliverFrameSet, this, SENSOR_RGB, _1, _2, _3 ), tolerance );
+			m_frameSetColor.joined = true;
+		}
+	}
+	FreenectModule::Component::start();
+}
+
+void FreenectComponent::stop() {
+	stopDeliveryThread();
+	m_pipeline.stop();
+	if ( m_workerObserver ) {
+		// idle workers leave the arena right away, and get their previous placement back
+		for ( int i = 0; i < WORKER_RESTORE_TIMEOUT && m_workerObserver->active() > 0; ++i )
+			boost::this_thread::sleep( boost::posix_time::milliseconds( 1 ) );
+		LOG4CPP_INFO( logger, getName() << ": placed pipeline workers " << m_workerObserver->placed() << " times, "
+			<< m_workerObserver->failed() << " only partly" );
+		if ( m_workerObserver->active() > 0 || m_workerObserver->restoreFailed() > 0 )
+			LOG4CPP_WARN( logger, getName() << ": " << m_workerObserver->active() << " pipeline workers still in the arena, "
+				<< m_workerObserver->restoreFailed() << " not restored, they keep the worker placement" );
+		m_workerObserver.reset();
+		m_workerArena.reset();
+	}
+	if ( m_frameSetDepth.joined ) {
+		m_frameSetDepth.joined = false;
+		FreenectFrameSetHub::instance().leave( m_frameSetGroup, m_frameSetDepth.member );
+	}
+	if ( m_frameSetColor.joined ) {
+		m_frameSetColor.joined = false;
+		FreenectFrameSetHub::instance().leave( m_frameSetGroup, m_frameSetColor.member );
+	}
+	FreenectModule::Component::stop();
+}
+
+void FreenectComponent::buildPipeline() {
+	m_pipeline.clear();
+
+	std::vector< std::string > names;
+	boost::split( names, m_pipelineStages, boost::is_any_of( ", " ), boost::token_compress_on );
+	for ( std::vector< std::string >::const_iterator it = names.begin(); it != names.end(); ++it ) {
+		if ( it->empty() )
+			continue;
+		FreenectProcessingStageMap::const_iterator stage = freenectProcessingStageMap.find( *it );
+		if ( stage == freenectProcessingStageMap.end() ) {
+			LOG4CPP_WARN( logger, getName() << ": unknown processing stage \"" << *it << "\" ignored" );
+			continue;
+		}
+		if ( !stageNeeded( stage->second ) )
+			continue;
+		// conversion and upload keep no state, several frames may be in them at once
+		bool parallel = stage->second == STAGE_CONVERT || stage->second == STAGE_UPLOAD;
+		m_pipeline.addStage( stage->first, boost::bind( &FreenectComponent::runStage, this, stage->second, _1 ), parallel );
+	}
+}
+
+bool FreenectComponent::stageNeeded( ProcessingStage stage ) {
+	const bool depth = getKey().getSensorType() == SENSOR_DEPTH;
+	switch ( stage ) {
+		case STAGE_CONVERT:
+			return getKey().getSensorType() == SENSOR_RGB && m_yuvOutput != YUV_OUTPUT_UYVY;
+		case STAGE_UPLOAD:
+			return getModule().autoGPUEnabled();
+		case STAGE_SEND:
+			return true;
+		case STAGE_COMPRESS:
+			return depth && m_compressedPort.isConnected();
+		case STAGE_NORMALS:
+			return depth && m_normalsPort.isConnected();
+		case STAGE_PYRAMID:
+			return depth && m_pyramidPort.isConnected();
+		case STAGE_FOREGROUND:
+			return depth && ( m_foregroundPort.isConnected() || m_foregroundBoxesPort.isConnected() );
+		case STAGE_PLANE:
+			return depth && ( m_planeRemovedPort.isConnected() || m_planePort.isConnected() );
+		default:
+			return false;
+	}
+}
+
+bool FreenectComponent::runStage( ProcessingStage stage, FreenectFrame& frame ) {
+	switch ( stage ) {
+		case STAGE_CONVERT:
+			// raw UYVY is captured as is and converted here, off the USB thread unless delivering synchronously
+			if ( frame.image->channels() == 2 )
+				frame.image = convertYUV( frame.image );
+			return true;
+		case STAGE_UPLOAD:
+			if ( Vision::OpenCLManager::singleton().isInitialized() ) {
+				//force upload to the GPU
+				frame.image->uMat();
+			}
+			return true;
+		case STAGE_SEND:
+			// undistortion should be added here ..
+			m_outPort.send( Measurement::ImageMeasurement( frame.ts, frame.image ) );
+			m_sequencePort.send( Measurement::Button( frame.ts, Math::Scalar< int >( static_cast< int >( frame.sequence ) ) ) );
+			if ( m_pullPort.isConnected() ) {
+				boost::shared_ptr< const Measurement::ImageMeasurement > pLatest( new Measurement::ImageMeasurement( frame.ts, frame.image ) );
+				boost::atomic_store( &m_latestFrame, pLatest );
+			}
+			++m_framesDelivered;
+			return true;
+		case STAGE_COMPRESS:
+			sendCompressedDepth( frame.ts, *frame.image );
+			return true;
+		case STAGE_NORMALS:
+			sendNormals( frame );
+			return true;
+		case STAGE_PYRAMID:
+			sendPyramid( frame.ts, *frame.image );
+			return true;
+		case STAGE_FOREGROUND:
+			sendForeground( frame );
+			return true;
+		case STAGE_PLANE:
+			sendPlane( frame );
+			return true;
+		default:
+			return true;
+	}
+}
+
+void FreenectComponent::stopDeliveryThread() {
+	if ( !m_deliveryThread )
+		return;
+	{
+		boost::mutex::scoped_lock lock( m_deliveryMutex );
+		m_deliveryStop = true;
+	}
+	m_deliveryCondition.notify_one();
+	m_deliveryThread->join();
+	m_deliveryThread.reset();
+	m_pendingFrame = FreenectFrame();
+}
+
+bool FreenectComponent::hasDemand( Measurement::Timestamp now ) {
+	if ( m_pullPort.isConnected() ) {
+		unsigned int timeout = getModule().getStreamIdleTimeout();
+		if ( timeout == 0 || now / 1000000 - m_lastPull < timeout )
+			return true;
+		// do not hand out a stale frame once the stream is paused
+		boost::atomic_store( &m_latestFrame, boost::shared_ptr< const Measurement::ImageMeasurement >() );
+	}
+
+	// push consumers cannot tell whether they still need frames
+	return m_outPort.isConnected() || m_sequencePort.isConnected() || m_compressedPort.isConnected() ||
+		m_markerPort.isConnected() || m_markerStatsPort.isConnected() ||
+		m_normalsPort.isConnected() || m_pyramidPort.isConnected() ||
+		m_foregroundPort.isConnected() || m_foregroundBoxesPort.isConnected() ||
+		m_planeRemovedPort.isConnected() || m_planePort.isConnected() ||
+		m_frameSetDepthPort.isConnected() || m_frameSetColorPort.isConnected();
 }
 
 void FreenectComponent::configureStream(const boost::shared_ptr<freenect_camera::FreenectDevice> &device) {
 	switch(getKey().getSensorType()) {
 		case SENSOR_IR:
-			// currently no settings, defaults to IR_8BIT
+			// defaults to IR_8BIT
+			if ( !m_streamFormat.empty() ) {
+				FreenectColorPixelFormatMap::const_iterator it = freenectColorPixelFormatMap.find( m_streamFormat );
+				if ( it != freenectColorPixelFormatMap.end() && ( it->second == FREENECT_VIDEO_IR_8BIT ||
+					it->second == FREENECT_VIDEO_IR_10BIT || it->second == FREENECT_VIDEO_IR_10BIT_PACKED ) ) {
+					device->setIRFormat( it->second );
+				} else {
+					LOG4CPP_WARN( logger, "Unsupported IR stream format \"" << m_streamFormat << "\", using IR_8BIT" );
+				}
+			}
 			break;
 		case SENSOR_RGB:
-			// currently no settings, defaults to RGB
+			if ( !m_stream_mode.empty() ) {
+				FreenectColorPixelFormatMap::const_iterator it = freenectColorPixelFormatMap.find( m_stream_mode );
+				if ( it != freenectColorPixelFormatMap.end() && it->second != FREENECT_VIDEO_IR_8BIT &&
+					it->second != FREENECT_VIDEO_IR_10BIT && it->second != FREENECT_VIDEO_IR_10BIT_PACKED ) {
+					device->setImageFormat( it->second );
+				} else {
+					LOG4CPP_WARN( logger, "Unsupported RGB video mode \"" << m_stream_mode << "\", using RGB" );
+				}
+			}
 			break;
 		case SENSOR_DEPTH:
-			// currently no settings, defaults to 11BIT
+			// defaults to MM
+			if ( !m_streamFormat.empty() ) {
+				FreenectDepthPixelFormatMap::const_iterator it = freenectDepthPixelFormatMap.find( m_streamFormat );
+				if ( it != freenectDepthPixelFormatMap.end() ) {
+					device->setDepthFormat( it->second );
+				} else {
+					LOG4CPP_WARN( logger, "Unsupported depth stream format \"" << m_streamFormat << "\", using MM" );
+				}
+			}
+			break;
+		case SENSOR_ACCEL:
+			// polled from the motor subdevice, no stream
+			break;
+		case SENSOR_COLORED_POINTCLOUD:
+			// uses the video format of the RGB sensor, needs RGB
+			break;
+		case SENSOR_FRAMESET:
+			// RGB and depth in millimeters, the defaults
 			break;
 		default:
 			// never gets here ..
@@ -256,96 +1508,784 @@ void FreenectComponent::configureStream(const boost::shared_ptr<freenect_camera:
 	}
 }
 
-void FreenectComponent::imageCb( const freenect_camera::ImageBuffer& image) {
+void FreenectComponent::imageCb( const freenect_camera::ImageBuffer& image, Measurement::Timestamp ts ) {
 
-	Ubitrack::Measurement::Timestamp ts = Ubitrack::Measurement::now();
 	boost::shared_ptr< Vision::Image > pImage;
 
 #ifdef ENABLE_EVENT_TRACING
 	TRACEPOINT_MEASUREMENT_CREATE(getEventDomain(), ts, getName().c_str(), "VideoCapture")
 #endif
 
+	if ( ++m_framesOffered % STATISTICS_INTERVAL == 0 )
+		logDeliveryStatistics();
+
+	// skip frames above the target rate before copying anything
+	if ( !acceptFrame( ts ) ) {
+		++m_framesSkippedRate;
+		return;
+	}
+
+	if ( !m_frameModeValid || !sameFrameMode( image.metadata, m_frameMode ) )
+		selectConversion( image.metadata );
+
+	// markers are found on the libfreenect buffer, without copying the frame
+	if ( getKey().getSensorType() == SENSOR_IR && ( m_markerPort.isConnected() || m_markerStatsPort.isConnected() ) ) {
+		detectMarkers( ts, image );
+		if ( !m_markerImageOutput || !( m_outPort.isConnected() || m_pullPort.isConnected() ) ) {
+			++m_framesDelivered;
+			return;
+		}
+	}
+
 	int width = image.metadata.width;
 	int height = image.metadata.height;
 
 	LOG4CPP_DEBUG( logger, "Image Callback Sensor: " << getKey().getSensorType() << " size: " << width << "x" << height);
 
-	bool new_image_data = false;
-	switch (getKey().getSensorType())
+	if ( m_frameLayoutValid ) {
+		const ImageLayout& layout = m_frameLayout;
+		// the gate looks at the driver buffer, which holds depth for the point cloud and packed bits for packed modes
+		const int sampleBytes = !m_frameKernel.function && ( layout.depth == IPL_DEPTH_16U ||
+			getKey().getSensorType() == SENSOR_COLORED_POINTCLOUD ) ? 2 : 1;
+		if ( m_changeGate.threshold() > 0 && !passChangeGate( ts, image, sampleBytes ) )
+			return;
+
+		pImage = newFrameImage( m_framePool.get(), width, height, layout );
+		pImage->set_origin(0);
+		pImage->set_pixelFormat(layout.pixelFormat);
+		if (layout.bitsPerPixel)
+			pImage->set_bitsPerPixel(layout.bitsPerPixel);
+		if ( getKey().getSensorType() == SENSOR_COLORED_POINTCLOUD ) {
+			// built straight from the driver buffer, the depth frame is not copied
+			if ( !fuseColoredPointCloud( ts, image, *pImage ) )
+				return;
+		} else if ( m_frameKernel.function ) {
+			m_frameKernel.function( static_cast< const boost::uint8_t* >( image.image_buffer.get() ),
+				reinterpret_cast< boost::uint16_t* >( pImage->Mat().data ), width * height );
+		} else {
+			memcpy(pImage->Mat().data, (unsigned char*)image.image_buffer.get(), image.metadata.bytes);
+		}
+		FreenectFrame frame;
+		frame.ts = ts;
+		frame.image = pImage;
+		frame.sequence = image.sequence;
+		if ( getKey().getSensorType() == SENSOR_DEPTH ) {
+			frame.focalLength = image.focal_length;
+			frame.metric = image.metadata.depth_format == FREENECT_DEPTH_MM ||
+				image.metadata.depth_format == FREENECT_DEPTH_REGISTERED;
+		}
+		deliverFrame( frame, image.metadata.framerate );
+	}
+}
+
+void FreenectComponent::selectConversion( const freenect_frame_mode& mode ) {
+	m_frameMode = mode;
+	m_frameModeValid = true;
+	m_frameLayoutValid = getImageLayout( getKey().getSensorType(), mode, m_frameLayout );
+	m_markerInputValid = false;
+	if ( !m_frameLayoutValid ) {
+		LOG4CPP_WARN( logger, "Unsupported " << getSensorTypeName( getKey().getSensorType() ) << " Videomode: " << mode.video_format );
+		m_frameKernel = freenect_camera::FrameKernel();
+		return;
+	}
+
+	if ( getModule().getFrameMemory() != FRAME_MEMORY_HEAP ) {
+		// the buffers are prefaulted now instead of on the first frames
+		if ( !m_framePool )
+			m_framePool = FramePool::create( getModule().getFrameMemory(), m_framePoolSize );
+		m_framePool->reset( frameImageBytes( mode, m_frameLayout ), m_framePoolSize );
+		LOG4CPP_INFO( logger, getName() << " frame pool memory: " << m_framePool->account().summary() );
+	}
+
+	const bool depth = getKey().getSensorType() == SENSOR_DEPTH || getKey().getSensorType() == SENSOR_COLORED_POINTCLOUD;
+	m_frameKernel = freenect_camera::FrameKernelRegistry::instance().select( mode, depth );
+	if ( m_frameKernel.function )
+		LOG4CPP_INFO( logger, getName() << ": unpacking " << mode.width << "x" << mode.height << " frames of " << int( m_frameKernel.bits )
+			<< " bit with the " << freenect_camera::KERNEL_VARIANT_NAMES[ m_frameKernel.variant ]
+			<< ( m_frameKernel.pixels ? " kernel specialized for the frame size" : " kernel" ) );
+
+	if ( getKey().getSensorType() == SENSOR_IR && ( m_markerPort.isConnected() || m_markerStatsPort.isConnected() ) ) {
+		// packed frames are unpacked by the kernel before detecting
+		m_markerInputValid = mode.video_format == FREENECT_VIDEO_IR_8BIT || mode.video_format == FREENECT_VIDEO_IR_10BIT ||
+			m_frameKernel.function;
+		if ( !m_markerInputValid )
+			LOG4CPP_WARN( logger, getName() << ": IR marker detection does not support Videomode " << mode.video_format << ", no markers are pushed" );
+	}
+}
+
+void FreenectComponent::detectMarkers( Measurement::Timestamp ts, const freenect_camera::ImageBuffer& image ) {
+	const int width = image.metadata.width;
+	const int height = image.metadata.height;
+	const void* data = image.image_buffer.get();
+
+	// unsupported modes were reported when the mode was selected
+	if ( !m_markerInputValid )
+		return;
+	if ( m_frameKernel.function ) {
+		m_markerPixels.resize( size_t( width ) * height );
+		m_frameKernel.function( static_cast< const boost::uint8_t* >( data ), &m_markerPixels[ 0 ], width * height );
+		m_markerDetector.detect( &m_markerPixels[ 0 ], width, height, m_markers );
+	} else if ( image.metadata.video_format == FREENECT_VIDEO_IR_8BIT ) {
+		m_markerDetector.detect( static_cast< const boost::uint8_t* >( data ), width, height, m_markers );
+	} else {
+		m_markerDetector.detect( static_cast< const boost::uint16_t* >( data ), width, height, m_markers );
+	}
+
+	boost::shared_ptr< std::vector< Math::Vector2d > > pCentroids( new std::vector< Math::Vector2d >() );
+	boost::shared_ptr< std::vector< Math::Vector3d > > pStatistics( new std::vector< Math::Vector3d >() );
+	pCentroids->reserve( m_markers.size() );
+	pStatistics->reserve( m_markers.size() );
+	for ( std::vector< IRMarker >::const_iterator it = m_markers.begin(); it != m_markers.end(); ++it ) {
+		pCentroids->push_back( Math::Vector2d( it->x, it->y ) );
+		pStatistics->push_back( Math::Vector3d( it->area, it->intensity, it->peak ) );
+	}
+
+	m_markerPort.send( Measurement::PositionList2( ts, pCentroids ) );
+	m_markerStatsPort.send( Measurement::PositionList( ts, pStatistics ) );
+}
+
+bool FreenectComponent::fuseColoredPointCloud( Measurement::Timestamp ts, const freenect_camera::ImageBuffer& depth, Vision::Image& cloud ) {
+	Measurement::Timestamp colorTime;
+	if ( !getModule().buildColoredPointCloud( depth, reinterpret_cast< float* >( cloud.Mat().data ), colorTime ) )
+		return false;
+
+	++m_cloudFrames;
+	if ( colorTime == 0 ) {
+		++m_staleColorFrames;
+		return true;
+	}
+	// the RGB frame may arrive after the depth frame
+	Measurement::Timestamp age = ts > colorTime ? ts - colorTime : colorTime - ts;
+	++m_coloredFrames;
+	m_colorAgeSum += age;
+	m_colorAgeMax = std::max( m_colorAgeMax, age );
+	if ( age > m_maxColorAge * 1000000ULL )
+		++m_staleColorFrames;
+	return true;
+}
+
+void FreenectComponent::sendAcceleration( Measurement::Timestamp ts, double x, double y, double z ) {
+	m_gravityPort.send( Measurement::Position( ts, Math::Vector3d( x, y, z ) ) );
+}
+
+bool FreenectComponent::usesGravityPrior() {
+	return getKey().getSensorType() == SENSOR_DEPTH && m_planeGravityPrior &&
+		( m_planeRemovedPort.isConnected() || m_planePort.isConnected() );
+}
+
+bool FreenectComponent::passChangeGate( Measurement::Timestamp ts, const freenect_camera::ImageBuffer& image, int sampleBytes ) {
+	Measurement::Timestamp start = Measurement::now();
+
+	// a heartbeat frame always passes and becomes the new reference
+	if ( m_changeHeartbeat && ts - m_lastEmitted >= m_changeHeartbeat * 1000000ULL )
+		m_changeGate.reset();
+
+	const int height = image.metadata.height;
+	bool changed = m_changeGate.check( image.image_buffer.get(), image.metadata.bytes / ( height * sampleBytes ), height, sampleBytes );
+
+	m_changeGateTime += Measurement::now() - start;
+	if ( changed ) {
+		m_lastEmitted = ts;
+		return true;
+	}
+	++m_framesSuppressed;
+	m_bytesSuppressed += image.metadata.bytes;
+	return false;
+}
+
+bool FreenectComponent::acceptFrame( Measurement::Timestamp ts ) {
+	if ( m_targetFrameRate <= 0 )
+		return true;
+	// allow some jitter, frames arrive with the camera rate
+	Measurement::Timestamp interval = static_cast< Measurement::Timestamp >( 0.9e9 / m_targetFrameRate );
+	if ( m_lastAccepted != 0 && ts - m_lastAccepted < interval )
+		return false;
+	m_lastAccepted = ts;
+	return true;
+}
+
+void FreenectComponent::deliverFrame( const FreenectFrame& frame, int frameRate ) {
+	if ( m_deliveryPolicy == DELIVER_PIPELINE ) {
+		// the graph is full, the stages do not keep up
+		bool busy = !m_pipeline.push( frame );
+		if ( busy )
+			++m_framesSkippedBusy;
+		updateSaturation( frame.ts, busy );
+		return;
+	}
+
+	if ( m_deliveryPolicy == DELIVER_SYNCHRONOUS ) {
+		Measurement::Timestamp start = Measurement::now();
+		processFrame( frame );
+		// saturated if pushing took longer than one frame period
+		bool saturated = frameRate > 0 && ( Measurement::now() - start ) * frameRate > 1000000000ULL;
+		updateSaturation( frame.ts, saturated );
+		return;
+	}
+
+	bool busy;
 	{
-		case SENSOR_IR:
-			if (image.metadata.video_format == FREENECT_VIDEO_IR_8BIT) {
-				pImage.reset(new Vision::Image(width, height, 1, IPL_DEPTH_8U));
-				pImage->set_origin(0);
-				pImage->set_pixelFormat(Vision::Image::LUMINANCE);
-				pImage->set_bitsPerPixel(8);
-//				freenect_camera::fill(image, pImage->imageData);
-				memcpy(pImage->Mat().data, (unsigned char*)image.image_buffer.get(), image.metadata.bytes);
-				new_image_data = true;
-
-			} else  if (image.metadata.video_format == FREENECT_VIDEO_IR_10BIT) {
-				pImage.reset(new Vision::Image(width, height, 1, IPL_DEPTH_16U));
-				pImage->set_origin(0);
-				pImage->set_pixelFormat(Vision::Image::LUMINANCE);
-				pImage->set_bitsPerPixel(16);
-//				freenect_camera::fill(image, pImage->imageData);
-				memcpy(pImage->Mat().data, (unsigned char *) image.image_buffer.get(), image.metadata.bytes);
-				new_image_data = true;
-
-			} else {
-				LOG4CPP_WARN( logger, "Unsupported IR Videomode: " << image.metadata.video_format );
-			}
+		boost::mutex::scoped_lock lock( m_deliveryMutex );
+		// the consumer did not take the previous frame yet, replace it
+		busy = m_pendingFrame.image.get() != NULL;
+		if ( busy )
+			++m_framesSkippedBusy;
+		m_pendingFrame = frame;
+	}
+	m_deliveryCondition.notify_one();
+	updateSaturation( frame.ts, busy );
+}
+
+void FreenectComponent::DeliveryThreadProc() {
+	LOG4CPP_DEBUG( logger, "Delivery thread of " << getName() << " started" );
+
+	if ( !m_workerPlacement.empty() ) {
+		std::string warnings;
+		std::string effective = applyThreadPlacement( m_workerPlacement, warnings );
+		if ( !warnings.empty() )
+			LOG4CPP_WARN( logger, "Delivery thread placement of " << getName() << " partly failed, continuing without: " << warnings );
+		LOG4CPP_INFO( logger, "Delivery thread of " << getName() << " runs on " << effective );
+	}
+
+	while ( true ) {
+		FreenectFrame frame;
+		{
+			boost::mutex::scoped_lock lock( m_deliveryMutex );
+			while ( !m_pendingFrame.image && !m_deliveryStop )
+				m_deliveryCondition.wait( lock );
+			if ( m_deliveryStop )
+				break;
+			std::swap( frame, m_pendingFrame );
+		}
+		processFrame( frame );
+	}
+
+	LOG4CPP_DEBUG( logger, "Delivery thread of " << getName() << " stopped" );
+}
+
+Measurement::ImageMeasurement FreenectComponent::pullLatest( Measurement::Timestamp t ) {
+	// keeps a paused stream running, see hasDemand
+	m_lastPull = Measurement::now() / 1000000;
+
+	boost::shared_ptr< const Measurement::ImageMeasurement > pLatest( boost::atomic_load( &m_latestFrame ) );
+	if ( !pLatest )
+		UBITRACK_THROW( "No frame available yet" );
+	return Measurement::ImageMeasurement( t, *pLatest );
+}
+
+boost::shared_ptr< Vision::Image > FreenectComponent::convertYUV( boost::shared_ptr< Vision::Image > pImage ) {
+	const int width = pImage->width();
+	const int height = pImage->height();
+	const unsigned char* src = pImage->Mat().data;
+
+	boost::shared_ptr< Vision::Image > pConverted;
+	switch ( m_yuvOutput ) {
+		case YUV_OUTPUT_GRAY:
+			pConverted.reset( new Vision::Image( width, height, 1, IPL_DEPTH_8U ) );
+			pConverted->set_pixelFormat( Vision::Image::LUMINANCE );
+			pConverted->set_bitsPerPixel( 8 );
+			convertUYVYToGray( src, pConverted->Mat().data, width * height );
 			break;
-		case SENSOR_RGB:
-			if (image.metadata.video_format == FREENECT_VIDEO_RGB) {
-				pImage.reset(new Vision::Image(width, height, 3, IPL_DEPTH_8U));
-				pImage->set_origin(0);
-				pImage->set_pixelFormat(Vision::Image::RGB);
-				pImage->set_bitsPerPixel(24);
-//				freenect_camera::fill(image, pImage->imageData);
-				memcpy(pImage->Mat().data, (unsigned char*)image.image_buffer.get(), image.metadata.bytes);
-				new_image_data = true;
-
-			} else {
-				LOG4CPP_WARN( logger, "Unsupported RGB Videomode: " << image.metadata.video_format );
-			}
+		case YUV_OUTPUT_RGB:
+			pConverted.reset( new Vision::Image( width, height, 3, IPL_DEPTH_8U ) );
+			pConverted->set_pixelFormat( Vision::Image::RGB );
+			pConverted->set_bitsPerPixel( 24 );
+			convertUYVYToRGB( src, pConverted->Mat().data, width * height );
 			break;
+		default:
+			return pImage;
+	}
+	pConverted->set_origin( 0 );
+	return pConverted;
+}
 
-		case SENSOR_DEPTH:
-			if ((image.metadata.depth_format == FREENECT_DEPTH_11BIT) || (image.metadata.depth_format == FREENECT_DEPTH_MM)) {
-				pImage.reset(new Vision::Image(width, height, 1, IPL_DEPTH_16U));
-				pImage->set_origin(0);
-				pImage->set_pixelFormat(Vision::Image::DEPTH);
-//				freenect_camera::fill(image, pImage->imageData);
-				memcpy(pImage->Mat().data, (unsigned char*)image.image_buffer.get(), image.metadata.bytes);
-				new_image_data = true;
-
-			} else {
-				LOG4CPP_WARN( logger, "Unsupported DEPTH Videomode: " << image.metadata.video_format );
-			}
-			break;
+void FreenectComponent::processFrame( FreenectFrame frame ) {
+	m_pipeline.run( frame );
+}
+
+void FreenectComponent::updateSaturation( Measurement::Timestamp ts, bool saturated ) {
+	if ( m_saturationWindowStart == 0 )
+		m_saturationWindowStart = ts;
+	++m_windowFrames;
+	if ( saturated )
+		++m_windowSaturated;
+
+	if ( ts - m_saturationWindowStart < m_saturationPeriod * 1000000ULL )
+		return;
+
+	// a period saturated for less than a quarter counts towards the recovery
+	m_calmPeriods = m_windowSaturated * 4 <= m_windowFrames ? m_calmPeriods + 1 : 0;
+
+	// saturated for most of the period?
+	if ( m_adaptiveDowngrade && m_windowSaturated * 2 > m_windowFrames ) {
+		++m_downgrades;
+		if ( getModule().reduceResolution( getKey().getSensorType() ) ) {
+			m_resolutionReduced = true;
+			LOG4CPP_WARN( logger, getName() << " output saturated, switching to a lower resolution" );
+		} else if ( m_targetFrameRate <= 0 || m_targetFrameRate > 1.0 ) {
+			// no lower resolution available, halve the output rate instead
+			double rate = m_targetFrameRate > 0 ? m_targetFrameRate : m_windowFrames * 1e9 / ( ts - m_saturationWindowStart );
+			m_targetFrameRate = std::max( 1.0, rate / 2 );
+			++m_rateReductions;
+			LOG4CPP_WARN( logger, getName() << " output saturated, reducing target frame rate to " << m_targetFrameRate << " Hz" );
+		}
+	} else if ( ( m_rateReductions || m_resolutionReduced ) && m_calmPeriods >= SATURATION_RECOVERY_PERIODS ) {
+		// undo the downgrades one step at a time, the rate first as it was reduced last
+		m_calmPeriods = 0;
+		if ( m_rateReductions ) {
+			m_targetFrameRate = --m_rateReductions ? m_targetFrameRate * 2 : m_configuredFrameRate;
+			if ( m_targetFrameRate > 0 )
+				LOG4CPP_INFO( logger, getName() << " output recovered, raising target frame rate to " << m_targetFrameRate << " Hz" );
+			else
+				LOG4CPP_INFO( logger, getName() << " output recovered, frame rate no longer limited" );
+		} else {
+			m_resolutionReduced = false;
+			if ( getModule().restoreResolution( getKey().getSensorType() ) )
+				LOG4CPP_INFO( logger, getName() << " output recovered, switching back to the high resolution" );
+		}
+	}
+
+	m_saturationWindowStart = ts;
+	m_windowFrames = 0;
+	m_windowSaturated = 0;
+}
+
+bool FreenectComponent::frameSetUses( SensorType type ) {
+	return type == SENSOR_DEPTH ? m_frameSetDepthPort.isConnected() : type == SENSOR_RGB && m_frameSetColorPort.isConnected();
+}
+
+void FreenectComponent::frameSetCb( SensorType type, const freenect_camera::ImageBuffer& image, Measurement::Timestamp ts ) {
+	FreenectFrameSetStream& stream = type == SENSOR_DEPTH ? m_frameSetDepth : m_frameSetColor;
+	if ( !stream.joined )
+		return;
+	const Measurement::Timestamp time = frameSetTime( stream, image, ts );
+
+	if ( !stream.modeValid || !sameFrameMode( image.metadata, stream.mode ) ) {
+		stream.mode = image.metadata;
+		stream.modeValid = true;
+		stream.layoutValid = getImageLayout( type, stream.mode, stream.layout );
+		if ( !stream.layoutValid ) {
+			LOG4CPP_WARN( logger, getName() << ": unsupported " << getSensorTypeName( type ) << " mode for the frame set" );
+			return;
+		}
+		stream.kernel = freenect_camera::FrameKernelRegistry::instance().select( stream.mode, type == SENSOR_DEPTH );
+		// the set only moves frame handles, the frames themselves are recycled
+		if ( !stream.pool )
+			stream.pool = FramePool::create( getModule().getFrameMemory(), m_framePoolSize + FreenectFrameSetHub::QUEUE_LENGTH + FreenectFrameSetHub::PENDING_SETS );
+		stream.pool->reset( frameImageBytes( stream.mode, stream.layout ), m_framePoolSize + FreenectFrameSetHub::QUEUE_LENGTH + FreenectFrameSetHub::PENDING_SETS );
+	}
+	if ( !stream.layoutValid )
+		return;
+
+	boost::shared_ptr< Vision::Image > pImage( newFrameImage( stream.pool.get(), image.metadata.width, image.metadata.height, stream.layout ) );
+	pImage->set_origin( 0 );
+	pImage->set_pixelFormat( stream.layout.pixelFormat );
+	if ( stream.layout.bitsPerPixel )
+		pImage->set_bitsPerPixel( stream.layout.bitsPerPixel );
+	if ( stream.kernel.function )
+		stream.kernel.function( static_cast< const boost::uint8_t* >( image.image_buffer.get() ),
+			reinterpret_cast< boost::uint16_t* >( pImage->Mat().data ), image.metadata.width * image.metadata.height );
+	else
+		memcpy( pImage->Mat().data, image.image_buffer.get(), image.metadata.bytes );
+
+	++stream.posted;
+	FreenectFrameSetHub::instance().post( m_frameSetGroup, stream.member, time, pImage );
+}
+
+Measurement::Timestamp FreenectComponent::frameSetTime( FreenectFrameSetStream& stream, const freenect_camera::ImageBuffer& image, Measurement::Timestamp ts ) {
+	// a second without frames is a stream restart, the device clock starts anew
+	if ( ts - stream.lastArrival > 1000000000ULL ) {
+		stream.clock.restart();
+		stream.sync.reset();
+	}
+	stream.lastArrival = ts;
+	stream.clock.update( image.timestamp );
+	const boost::uint32_t interval = stream.clock.interval();
+	if ( interval == 0 || image.metadata.framerate <= 0 ) {
+		stream.lastTimestamp = image.timestamp;
+		return ts;
+	}
+
+	// the device clock in seconds, TimestampSync follows its offset and drift against the host clock
+	if ( !stream.sync ) {
+		stream.sync.reset( new Measurement::TimestampSync() );
+		stream.ticks = 0;
+	} else
+		stream.ticks += boost::uint32_t( image.timestamp - stream.lastTimestamp );
+	stream.lastTimestamp = image.timestamp;
+	return stream.sync->convertNativeToLocal( double( stream.ticks ) / ( double( interval ) * image.metadata.framerate ), ts );
+}
+
+void FreenectComponent::deliverFrameSet( SensorType type, boost::uint64_t time, const boost::shared_ptr< Vision::Image >& pImage, boost::int64_t skew ) {
+	FreenectFrameSetStream& stream = type == SENSOR_DEPTH ? m_frameSetDepth : m_frameSetColor;
+	( type == SENSOR_DEPTH ? m_frameSetDepthPort : m_frameSetColorPort ).send( Measurement::ImageMeasurement( Measurement::Timestamp( time ), pImage ) );
+
+	const boost::uint64_t absSkew = boost::uint64_t( skew < 0 ? -skew : skew );
+	stream.skewSum += absSkew;
+	stream.skewMax = std::max( stream.skewMax, absSkew );
+	const unsigned long sets = ++stream.sets;
+	if ( sets % STATISTICS_INTERVAL == 0 ) {
+		LOG4CPP_INFO( logger, stream.member << " frame sets: " << sets << " sets, " << stream.posted - sets
+			<< " frames without a set, skew " << stream.skewSum * 1e-6 / sets << " ms mean, " << stream.skewMax * 1e-6 << " ms max, "
+			<< FreenectFrameSetHub::instance().dropped() << " sets dropped behind slow consumers" );
+		stream.skewMax = 0;
+	}
+}
+
+void FreenectComponent::logDeliveryStatistics() {
+	LOG4CPP_INFO( logger, getName() << " frames: " << m_framesOffered << " received, "
+		<< m_framesDelivered << " delivered, " << m_framesSkippedRate << " skipped by rate limit, "
+		<< m_framesSkippedBusy << " skipped while consumer busy, " << m_downgrades << " downgrades" );
+	if ( m_changeGate.threshold() > 0 )
+		LOG4CPP_INFO( logger, getName() << " change gate: " << m_framesSuppressed << " unchanged frames suppressed, "
+			<< m_bytesSuppressed / ( 1024 * 1024 ) << " MB not copied or pushed, "
+			<< m_changeGateTime * 1e-6 / m_framesOffered << " ms/frame spent in the gate" );
+	if ( getKey().getSensorType() == SENSOR_COLORED_POINTCLOUD && m_cloudFrames ) {
+		LOG4CPP_INFO( logger, getName() << " color age: " << ( m_coloredFrames ? m_colorAgeSum * 1e-6 / m_coloredFrames : 0.0 )
+			<< " ms mean, " << m_colorAgeMax * 1e-6 << " ms max, " << m_staleColorFrames << " of " << m_cloudFrames
+			<< " clouds without color or with color older than " << m_maxColorAge << " ms" );
+		m_colorAgeMax = 0;
+	}
+	std::vector< freenect_camera::FramePipeline< FreenectFrame >::StageStatistics > stages( m_pipeline.statistics() );
+	if ( !stages.empty() ) {
+		std::ostringstream timing;
+		for ( size_t i = 0; i < stages.size(); ++i ) {
+			timing << ( i ? ", " : "" ) << stages[ i ].name << " " << ( stages[ i ].frames ? stages[ i ].time * 1e-6 / stages[ i ].frames : 0.0 )
+				<< "/" << stages[ i ].max_time * 1e-6 << " ms";
+			if ( stages[ i ].errors )
+				timing << " (" << stages[ i ].errors << " errors)";
+		}
+		LOG4CPP_INFO( logger, getName() << " stage mean/max time: " << timing.str() );
+		m_pipeline.resetMaxTimes();
+	}
+	// frames lost before they reached the host, as opposed to the skips above
+	freenect_camera::FrameSequencer sequence;
+	if ( getModule().getStreamSequence( getKey().getSensorType(), sequence ) )
+		LOG4CPP_INFO( logger, getName() << " stream: " << sequence.expected() << " frames sent by the device, "
+			<< sequence.received() << " received, " << sequence.lost() << " lost on the USB, "
+			<< sequence.irregular() << " irregular intervals" );
+	if ( m_planeFrames ) {
+		LOG4CPP_INFO( logger, getName() << " plane: found in " << m_planeFound << " of " << m_planeFrames << " frames, "
+			<< m_planeTracked << " tracked from the previous frame, "
+			<< ( m_planeFound ? 100.0 * m_planeInlierSum / m_planeFound : 0.0 ) << "% of the grid points on it" );
+		m_planeFrames = m_planeFound = m_planeTracked = 0;
+		m_planeInlierSum = 0;
+	}
+	if ( m_framePool )
+		LOG4CPP_INFO( logger, getName() << " frame pool: " << m_framePool->account().summary() << ", "
+			<< m_framePool->misses() << " frames allocated outside the pool" );
+}
+
+void FreenectComponent::sendCompressedDepth( Measurement::Timestamp ts, Vision::Image& image ) {
+	Measurement::Timestamp start = Measurement::now();
+
+	const int width = image.width();
+	const int height = image.height();
+	size_t size = m_depthEncoder.encode( reinterpret_cast< const boost::uint16_t* >( image.Mat().data ),
+		width, height );
+
+	// the compressed frame is transported as a single row of bytes
+	boost::shared_ptr< Vision::Image > pCompressed( new Vision::Image( static_cast< int >( size ), 1, 1, IPL_DEPTH_8U ) );
+	pCompressed->set_origin( 0 );
+	pCompressed->set_pixelFormat( Vision::Image::LUMINANCE );
+	pCompressed->set_bitsPerPixel( 8 );
+	m_depthEncoder.write( pCompressed->Mat().data );
+
+	m_compressionTime += Measurement::now() - start;
+	m_compressedBytesIn += static_cast< unsigned long long >( width ) * height * sizeof( boost::uint16_t );
+	m_compressedBytesOut += size;
+
+	if ( ++m_compressedFrames % STATISTICS_INTERVAL == 0 ) {
+		double seconds = m_compressionTime * 1e-9;
+		LOG4CPP_INFO( logger, "Depth compression: ratio " << double( m_compressedBytesIn ) / m_compressedBytesOut
+			<< ", " << ( seconds > 0 ? m_compressedBytesIn / seconds / ( 1024.0 * 1024.0 ) : 0.0 ) << " MB/s"
+			<< ", latency " << seconds * 1e3 / m_compressedFrames << " ms/frame" );
+	}
+
+	m_compressedPort.send( Measurement::ImageMeasurement( ts, pCompressed ) );
+}
+
+void FreenectComponent::sendNormals( const FreenectFrame& frame ) {
+	Vision::Image& image = *frame.image;
+	if ( !frame.metric ) {
+		LOG4CPP_WARN( logger, "Normals require depth in mm, raw depth frames are not supported" );
+		return;
+	}
+
+	boost::shared_ptr< Vision::Image > pNormals( new Vision::Image( image.width(), image.height(), 3, IPL_DEPTH_32F ) );
+	pNormals->set_origin( 0 );
+	m_normalEstimator.compute( reinterpret_cast< const boost::uint16_t* >( image.Mat().data ),
+		image.width(), image.height(), frame.focalLength, reinterpret_cast< float* >( pNormals->Mat().data ) );
+
+	m_normalsPort.send( Measurement::ImageMeasurement( frame.ts, pNormals ) );
+}
+
+void FreenectComponent::sendPyramid( Measurement::Timestamp ts, Vision::Image& image ) {
+	int width, height;
+	DepthPyramidBuilder::packedSize( image.width(), image.height(), width, height );
+
+	// all levels share one allocation, see DepthPyramidBuilder for the layout
+	boost::shared_ptr< Vision::Image > pPyramid( new Vision::Image( width, height, 1, IPL_DEPTH_16U ) );
+	pPyramid->set_origin( 0 );
+	pPyramid->set_pixelFormat( Vision::Image::DEPTH );
+	m_pyramidBuilder.build( reinterpret_cast< const boost::uint16_t* >( image.Mat().data ), image.width(), image.height(),
+		reinterpret_cast< boost::uint16_t* >( pPyramid->Mat().data ), pPyramid->Mat().step / sizeof( boost::uint16_t ) );
+
+	m_pyramidPort.send( Measurement::ImageMeasurement( ts, pPyramid ) );
+}
 
+void FreenectComponent::receiveBackgroundControl( const Measurement::Button& event ) {
+	switch ( *event ) {
+		case 'l':
+			LOG4CPP_INFO( logger, getName() << " learning the background" );
+			m_backgroundLearn = true;
+			break;
+		case 'f':
+			LOG4CPP_INFO( logger, getName() << " background frozen" );
+			m_backgroundLearn = false;
+			break;
+		case 'r':
+			LOG4CPP_INFO( logger, getName() << " relearning the background" );
+			m_backgroundReset = true;
+			m_backgroundLearn = true;
+			break;
 		default:
-			// should never get here ..
 			break;
 	}
+}
 
-	if (new_image_data) {
+void FreenectComponent::sendForeground( const FreenectFrame& frame ) {
+	Vision::Image& image = *frame.image;
+	if ( !frame.metric ) {
+		LOG4CPP_WARN( logger, "Background model requires depth in mm, raw depth frames are not supported" );
+		return;
+	}
 
-		if (getModule().autoGPUEnabled()){
-			Vision::OpenCLManager& oclManager = Vision::OpenCLManager::singleton();
-			if (oclManager.isInitialized()) {
-				//force upload to the GPU
-				pImage->uMat();
+	if ( m_backgroundReset.exchange( false ) ) {
+		m_backgroundModel.reset();
+		m_backgroundFrames = 0;
+	}
+
+	bool learn = m_backgroundLearn;
+	if ( learn && m_backgroundLearnFrames && ++m_backgroundFrames >= m_backgroundLearnFrames ) {
+		LOG4CPP_INFO( logger, getName() << " background learned from " << m_backgroundFrames << " frames, freezing it" );
+		m_backgroundLearn = false;
+	}
+
+	boost::shared_ptr< Vision::Image > pMask( new Vision::Image( image.width(), image.height(), 1, IPL_DEPTH_8U ) );
+	pMask->set_origin( 0 );
+	pMask->set_pixelFormat( Vision::Image::LUMINANCE );
+	pMask->set_bitsPerPixel( 8 );
+	m_backgroundModel.apply( reinterpret_cast< const boost::uint16_t* >( image.Mat().data ), image.width(), image.height(),
+		learn, pMask->Mat().data, m_foregroundBoxes );
+
+	// every box is sent as its upper left and lower right corner
+	boost::shared_ptr< std::vector< Math::Vector2d > > pBoxes( new std::vector< Math::Vector2d >() );
+	pBoxes->reserve( 2 * m_foregroundBoxes.size() );
+	for ( std::vector< ForegroundBox >::const_iterator it = m_foregroundBoxes.begin(); it != m_foregroundBoxes.end(); ++it ) {
+		pBoxes->push_back( Math::Vector2d( it->min_x, it->min_y ) );
+		pBoxes->push_back( Math::Vector2d( it->max_x, it->max_y ) );
+	}
+
+	m_foregroundPort.send( Measurement::ImageMeasurement( frame.ts, pMask ) );
+	m_foregroundBoxesPort.send( Measurement::PositionList2( frame.ts, pBoxes ) );
+}
+
+void FreenectComponent::sendPlane( const FreenectFrame& frame ) {
+	Vision::Image& image = *frame.image;
+	if ( !frame.metric ) {
+		LOG4CPP_WARN( logger, "Plane removal requires depth in mm, raw depth frames are not supported" );
+		return;
+	}
+
+	// the accelerometer measures the reaction to gravity, its axes are taken as those of the depth camera
+	double gravity[ 3 ];
+	const bool prior = m_planeGravityPrior && getModule().getGravity( gravity[ 0 ], gravity[ 1 ], gravity[ 2 ] );
+
+	boost::shared_ptr< Vision::Image > pRemoved( new Vision::Image( image.width(), image.height(), 1, IPL_DEPTH_16U ) );
+	pRemoved->set_origin( 0 );
+	pRemoved->set_pixelFormat( Vision::Image::DEPTH );
+	double plane[ 4 ];
+	const bool found = m_planeRemover.apply( reinterpret_cast< const boost::uint16_t* >( image.Mat().data ),
+		image.width(), image.height(), frame.focalLength, prior ? gravity : NULL,
+		reinterpret_cast< boost::uint16_t* >( pRemoved->Mat().data ), plane );
+
+	++m_planeFrames;
+	if ( found ) {
+		++m_planeFound;
+		if ( m_planeRemover.tracked() )
+			++m_planeTracked;
+		m_planeInlierSum += m_planeRemover.inlierRatio();
+	}
+
+	// without a plane the depth passes unchanged and no plane is pushed
+	m_planeRemovedPort.send( Measurement::ImageMeasurement( frame.ts, pRemoved ) );
+	if ( found )
+		m_planePort.send( Measurement::Vector4D( frame.ts, Math::Vector4d( plane[ 0 ], plane[ 1 ], plane[ 2 ], plane[ 3 ] ) ) );
+}
+
+FreenectDepthDecoder::FreenectDepthDecoder( const std::string& name, boost::shared_ptr< Graph::UTQLSubgraph > )
+	: Dataflow::Component( name )
+	, m_inPort( "Input", *this, boost::bind( &FreenectDepthDecoder::receiveCompressed, this, _1 ) )
+	, m_outPort( "Output", *this )
+{
+}
+
+void FreenectDepthDecoder::receiveCompressed( const Measurement::ImageMeasurement& m ) {
+	const unsigned char* data = m->Mat().data;
+	size_t size = static_cast< size_t >( m->width() ) * m->height();
+
+	int width, height;
+	if ( !readDepthCodecHeader( data, size, width, height ) ) {
+		LOG4CPP_WARN( logger, "Received data is not a compressed depth frame" );
+		return;
+	}
+
+	boost::shared_ptr< Vision::Image > pImage( new Vision::Image( width, height, 1, IPL_DEPTH_16U ) );
+	pImage->set_origin( 0 );
+	pImage->set_pixelFormat( Vision::Image::DEPTH );
+	if ( !m_decoder.decode( data, size, reinterpret_cast< boost::uint16_t* >( pImage->Mat().data ) ) ) {
+		LOG4CPP_WARN( logger, "Corrupt compressed depth frame dropped" );
+		return;
+	}
+
+	m_outPort.send( Measurement::ImageMeasurement( m.time(), pImage ) );
+}
+
+FreenectSharedMemoryFrameGrabber::FreenectSharedMemoryFrameGrabber( const std::string& name, boost::shared_ptr< Graph::UTQLSubgraph > subgraph )
+	: Dataflow::Component( name )
+	, m_bStop( false )
+	, m_zeroCopy( false )
+	, m_zeroCopyMisses( 0 )
+	, m_outPort( "Output", *this )
+{
+	std::string serial = subgraph->m_DataflowAttributes.getAttributeString( "deviceSerial" );
+	if ( serial.empty() )
+		UBITRACK_THROW( "Shared memory frame grabber requires a device serial" );
+
+	std::string sSensorType = subgraph->m_DataflowAttributes.getAttributeString( "sensorType" );
+	if ( freenectSensorMap.find( sSensorType ) == freenectSensorMap.end() )
+		UBITRACK_THROW( "unknown sensor type: \"" + sSensorType + "\"" );
+	m_sensorType = freenectSensorMap[ sSensorType ];
+
+	if ( subgraph->m_DataflowAttributes.hasAttribute( "zeroCopy" ) )
+		m_zeroCopy = subgraph->m_DataflowAttributes.getAttributeString( "zeroCopy" ) == "true";
+
+	m_reader.reset( new SharedFrameReader( sharedFrameRingName( serial, sSensorType ) ) );
+}
+
+void FreenectSharedMemoryFrameGrabber::start() {
+	if ( !m_running ) {
+		m_running = true;
+		m_bStop = false;
+		m_Thread.reset( new boost::thread( boost::bind( &FreenectSharedMemoryFrameGrabber::ThreadProc, this ) ) );
+	}
+	Component::start();
+}
+
+void FreenectSharedMemoryFrameGrabber::stop() {
+	if ( m_running ) {
+		m_running = false;
+		m_bStop = true;
+		if ( m_Thread ) {
+			m_Thread->join();
+			m_Thread.reset();
+		}
+	}
+	Component::stop();
+}
+
+void FreenectSharedMemoryFrameGrabber::ThreadProc() {
+	LOG4CPP_DEBUG( logger, "Freenect shared memory thread started" );
+
+	boost::uint32_t lastCount = 0;
+	Measurement::Timestamp lastFrame = Measurement::now();
+	bool warned = false;
+	freenect_frame_mode mode;
+	bool modeValid = false;
+	ImageLayout layout;
+	bool layoutValid = false;
+	FrameKernel kernel;
+
+	while ( !m_bStop ) {
+		if ( !m_reader->isAttached() ) {
+			if ( !m_reader->attach() ) {
+				if ( !warned ) {
+					LOG4CPP_WARN( logger, "Waiting for shared memory frame ring of " << getName() );
+					warned = true;
+				}
+				Util::sleep( 500 );
+				continue;
 			}
+			LOG4CPP_INFO( logger, "Attached to shared memory frame ring" );
+			lastCount = 0;
+			lastFrame = Measurement::now();
+			warned = false;
 		}
 
-		// undistortion should be added here ..
+		m_reader->heartbeat( boost::uint32_t( Measurement::now() / 1000000 ) );
 
-		m_outPort.send( Measurement::ImageMeasurement( ts, pImage ) );
+		SharedFrameInfo info;
+		const unsigned char* data;
+		boost::uint32_t sequence;
+		if ( !m_reader->peekLatest( lastCount, info, data, sequence ) ) {
+			// the producer may have been restarted, map the new ring. Paused
+			// streams restart within the idle timeout, so wait a bit longer
+			if ( Measurement::now() - lastFrame > 5000000000ULL )
+				m_reader->detach();
+			Util::sleep( 1 );
+			continue;
+		}
+		lastCount = info.frame_count;
+		lastFrame = Measurement::now();
+
+		// the conversion is chosen when the mode changes
+		if ( !modeValid || !sameFrameMode( info.mode, mode ) ) {
+			mode = info.mode;
+			modeValid = true;
+			layoutValid = getImageLayout( m_sensorType, mode, layout );
+			if ( !layoutValid )
+				LOG4CPP_WARN( logger, "Unsupported " << getSensorTypeName( m_sensorType ) << " Videomode: " << info.mode.video_format );
+			kernel = FrameKernelRegistry::instance().select( mode, m_sensorType == SENSOR_DEPTH );
+		}
+		if ( !layoutValid )
+			continue;
+
+		boost::shared_ptr< Vision::Image > pImage;
+		if ( m_zeroCopy && !kernel.function ) {
+			// the image refers to the slot, the lease keeps the producer from overwriting it. Half
+			// of the slots stay free for the producer, beyond that all readers together copy
+			boost::shared_ptr< SharedFrameLease > lease( m_reader->lease( info, sequence ) );
+			if ( lease )
+				pImage.reset( new Vision::Image( info.mode.width, info.mode.height, layout.channels,
+					const_cast< unsigned char* >( data ), layout.depth, 0 ), SharedFrameImageRelease( lease ) );
+			else
+				++m_zeroCopyMisses;
+		}
+		if ( !pImage ) {
+			pImage.reset( new Vision::Image( info.mode.width, info.mode.height, layout.channels, layout.depth ) );
+			if ( kernel.function )
+				kernel.function( data, reinterpret_cast< boost::uint16_t* >( pImage->Mat().data ), info.mode.width * info.mode.height );
+			else
+				memcpy( pImage->Mat().data, data, info.mode.bytes );
+			if ( !m_reader->verify( info, sequence ) ) {
+				LOG4CPP_DEBUG( logger, "Shared memory frame was overwritten while reading, dropped" );
+				continue;
+			}
+		}
+		pImage->set_origin( 0 );
+		pImage->set_pixelFormat( layout.pixelFormat );
+		if ( layout.bitsPerPixel )
+			pImage->set_bitsPerPixel( layout.bitsPerPixel );
 
+		m_outPort.send( Measurement::ImageMeasurement( Measurement::Timestamp( info.host_timestamp ), pImage ) );
 	}
 
+	if ( m_zeroCopyMisses )
+		LOG4CPP_INFO( logger, getName() << ": " << m_zeroCopyMisses << " frames copied as their slot could not be leased" );
+	// frames still used in place keep the ring mapped
+	m_reader->detach();
+	LOG4CPP_DEBUG( logger, "Freenect shared memory thread stopped" );
 }
 
 std::ostream& operator<<( std::ostream& s, const FreenectComponentKey& k )
@@ -356,6 +2296,8 @@ std::ostream& operator<<( std::ostream& s, const FreenectComponentKey& k )
 
 UBITRACK_REGISTER_COMPONENT( Dataflow::ComponentFactory* const cf ) {
 	cf->registerModule< FreenectModule > ( "FreenectFrameGrabber" );
+	cf->registerComponent< FreenectDepthDecoder > ( "FreenectDepthDecoder" );
+	cf->registerComponent< FreenectSharedMemoryFrameGrabber > ( "FreenectSharedMemoryFrameGrabber" );
 }
 
 } } // namespace Ubitrack::Drivers
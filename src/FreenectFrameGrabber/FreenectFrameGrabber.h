@@ -47,9 +47,12 @@
 #include <boost/utility.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/function.hpp>
+#include <boost/atomic.hpp>
+#include <boost/thread/condition_variable.hpp>
 
 #include <utDataflow/PushSupplier.h>
 #include <utDataflow/PushConsumer.h>
+#include <utDataflow/PullSupplier.h>
 #include <utDataflow/Component.h>
 #include <utDataflow/Module.h>
 #include <utMeasurement/Measurement.h>
@@ -60,18 +63,71 @@
 #include <utVision/OpenCLManager.h>
 
 #include "freenect_device.hpp"
+#include "depth_codec.hpp"
+#include "shared_frame_ring.hpp"
+#include "yuv_convert.hpp"
+#include "ir_marker_detector.hpp"
+#include "depth_normals.hpp"
+#include "depth_pyramid.hpp"
+#include "depth_background.hpp"
+#include "depth_plane.hpp"
+#include "change_gate.hpp"
+#include "registration_cache.hpp"
+#include "stream_scheduler.hpp"
+#include "colored_point_cloud.hpp"
+#include "frame_pipeline.hpp"
+#include "frame_kernels.hpp"
+#include "thread_placement.hpp"
+#include "frame_memory.hpp"
+#include "frame_set.hpp"
 
 
 
+namespace Ubitrack { namespace Drivers {
+using namespace Dataflow;
+
+typedef enum  {
+	SENSOR_IR = 0,
+	SENSOR_RGB = 1,
+	SENSOR_DEPTH = 2,
+	SENSOR_ACCEL = 3,
+	SENSOR_COLORED_POINTCLOUD = 4,
+	SENSOR_FRAMESET = 5,
+} SensorType;
+
+typedef enum {
+	DELIVER_SYNCHRONOUS = 0,
+	DELIVER_LATEST_ONLY = 1,
+	DELIVER_PIPELINE = 2,
+} DeliveryPolicy;
+
+typedef enum {
+	STAGE_CONVERT = 0,
+	STAGE_UPLOAD = 1,
+	STAGE_SEND = 2,
+	STAGE_COMPRESS = 3,
+	STAGE_NORMALS = 4,
+	STAGE_PYRAMID = 5,
+	STAGE_FOREGROUND = 6,
+	STAGE_PLANE = 7,
+} ProcessingStage;
+
+typedef enum {
+	YUV_OUTPUT_RGB = 0,
+	YUV_OUTPUT_GRAY = 1,
+	YUV_OUTPUT_UYVY = 2,
+} YUVOutput;
+
+/** layout of the image created for a frame */
+struct ImageLayout {
+	int channels;
+	int depth;
+	Ubitrack::Vision::Image::PixelFormat pixelFormat;
+	int bitsPerPixel;
+};
+
 namespace {
-	
-	typedef enum  {
-		SENSOR_IR = 0,
-		SENSOR_RGB = 1,
-		SENSOR_DEPTH = 2,
-	} SensorType;
-	
-	
+
 	class FreenectSensorMap
 		: public std::map< std::string, SensorType>
 	{
@@ -82,6 +138,9 @@ namespace {
 			(*this)[ "IR" ] = SENSOR_IR;
 			(*this)[ "COLOR" ] = SENSOR_RGB;
 			(*this)[ "DEPTH" ] = SENSOR_DEPTH;
+			(*this)[ "ACCEL" ] = SENSOR_ACCEL;
+			(*this)[ "COLORED_POINTCLOUD" ] = SENSOR_COLORED_POINTCLOUD;
+			(*this)[ "FRAMESET" ] = SENSOR_FRAMESET;
 		}
 	};
 	static FreenectSensorMap freenectSensorMap;
@@ -121,11 +180,6 @@ namespace {
 
 } // anonymous namespace
 
-
-
-namespace Ubitrack { namespace Drivers {
-using namespace Dataflow;
-
 // forward declaration
 class FreenectComponent;
 
@@ -192,6 +246,42 @@ public:
 		return m_autoGPUUpload;
 	}
 
+	/** idle timeout of pull and shared memory consumers in ms (0 = never idle) */
+	unsigned int getStreamIdleTimeout() const {
+		return m_streamIdleTimeout;
+	}
+
+	/** registration tables of the device, NULL if the calibration cache is disabled or not ready */
+	boost::shared_ptr< const freenect_camera::RegistrationCache > getRegistrationCache() {
+		return boost::atomic_load( &m_registrationCache );
+	}
+
+	/** is the accelerometer polled, for the ACCEL sensor or as gravity prior? */
+	bool accelEnabled();
+
+	/** latest accelerometer reading in m/s^2, false if there is none */
+	bool getGravity( double& x, double& y, double& z );
+
+	/** switch a stream to a lower resolution, returns false if there is none */
+	bool reduceResolution( SensorType type );
+
+	/** switch a stream reduced by reduceResolution() back, returns false if it was not reduced */
+	bool restoreResolution( SensorType type );
+
+	/** frame accounting of the stream feeding a sensor, false if there is none */
+	bool getStreamSequence( SensorType type, freenect_camera::FrameSequencer& sequence );
+
+	/** backing of the driver buffers and the frame pools */
+	freenect_camera::FrameMemoryMode getFrameMemory() const {
+		return m_frameMemory;
+	}
+
+	/**
+	 * Fuse a depth frame with the latest RGB frame into an XYZRGB cloud, called
+	 * on the freenect thread. colorTime is 0 if there is no RGB frame yet.
+	 */
+	bool buildColoredPointCloud( const freenect_camera::ImageBuffer& depth, float* out, Measurement::Timestamp& colorTime );
+
 protected:
 
 	// thread main loop
@@ -208,6 +298,80 @@ protected:
 	// automatic upload to GPU?
 	bool m_autoGPUUpload;
 
+	// export frames to shared memory?
+	bool m_sharedMemoryExport;
+	unsigned int m_sharedMemorySlots;
+
+	typedef std::map< SensorType, boost::shared_ptr< freenect_camera::SharedFrameWriter > > SharedFrameWriterMap;
+	SharedFrameWriterMap m_sharedFrameWriters;
+
+	// pause streams whose pull/shared memory consumers did not ask for frames for this many ms (0 = never)
+	unsigned int m_streamIdleTimeout;
+
+	// directory of the calibration cache files (empty = disabled)
+	std::string m_calibrationCacheDir;
+	boost::shared_ptr< const freenect_camera::RegistrationCache > m_registrationCache;
+	bool m_registrationCacheHit;
+	boost::scoped_ptr< boost::thread > m_cacheThread;
+
+	// time-to-first-frame
+	Measurement::Timestamp m_startTime;
+	bool m_firstFrameReported;
+
+	// startup: attempts to open the device and minimum time between stream starts of all devices (ms)
+	unsigned int m_deviceOpenRetries;
+	unsigned int m_streamStartStagger;
+
+	// CPUs and real-time priority of the freenect event thread, and how late its frames arrive
+	freenect_camera::ThreadPlacement m_eventThreadPlacement;
+	freenect_camera::ArrivalLateness m_videoLateness;
+	freenect_camera::ArrivalLateness m_depthLateness;
+
+	// backing of the libfreenect target buffers and the output frames
+	freenect_camera::FrameMemoryMode m_frameMemory;
+
+	// fault recovery: a running stream without frames for this many ms is stalled (0 = no watchdog)
+	unsigned int m_streamTimeout;
+	Measurement::Timestamp m_lastVideoFrame;
+	Measurement::Timestamp m_lastDepthFrame;
+	bool m_recovering;
+	Measurement::Timestamp m_faultTime;
+	unsigned long m_usbErrors;
+	unsigned long m_stalls;
+	unsigned long m_faults;
+	unsigned long m_recoveries;
+	Measurement::Timestamp m_recoveryTime;
+
+	// latest RGB frame and tables for the colored point cloud, only used on the freenect thread
+	std::vector< boost::uint8_t > m_cloudColor;
+	Measurement::Timestamp m_cloudColorTime;
+	bool m_cloudColorWarned;
+	freenect_camera::ColoredPointCloudBuilder m_cloudBuilder;
+	boost::shared_ptr< const freenect_camera::RegistrationCache > m_cloudTables;
+
+	// stream start granted by the scheduler and not yet executed
+	bool m_streamStarting;
+	SensorType m_streamStartingType;
+	Measurement::Timestamp m_streamStartingTime;
+
+	// last time the stream demand was evaluated
+	Measurement::Timestamp m_lastDemandUpdate;
+
+	// accelerometer polling
+	Measurement::Timestamp m_accelInterval;
+	Measurement::Timestamp m_lastAccelPoll;
+	bool m_accelPollPending;
+	Measurement::Timestamp m_accelPollTime;
+	bool m_accelFailed;
+	// latest reading, read by the plane stage on the delivery threads
+	boost::mutex m_gravityMutex;
+	double m_gravity[3];
+	bool m_gravityValid;
+
+	// streams which were started but did not deliver a frame yet
+	typedef std::map< SensorType, Measurement::Timestamp > StreamRequestMap;
+	StreamRequestMap m_streamRequested;
+
 	/** the device **/
 	freenect_context* m_driver;
 	std::vector<std::string> m_device_serials;
@@ -219,6 +383,48 @@ protected:
 
 
 private:
+	/** create the libfreenect context */
+	void initDriver();
+
+	/** enumerate, open and configure the device, runs in the module thread */
+	bool openDevice();
+
+	/** apply the component settings to the device and register the callbacks */
+	void configureDevice();
+
+	/** name of a running stream which did not deliver frames in time, NULL if all are fine */
+	const char* stalledStream(Measurement::Timestamp now);
+
+	/** close and reopen the device after a fault and restore its streams, false if stopped meanwhile */
+	bool recoverDevice(const std::string& reason);
+
+	/** start and stop streams depending on connected consumers */
+	void updateStreamDemand();
+	/** queue a stream start with the scheduler, returns true if it may start now */
+	bool scheduleStreamStart(SensorType type, Measurement::Timestamp now);
+	/** report the outcome of a granted stream start to the scheduler */
+	void finishStreamStart(bool ok);
+	/** name and USB bandwidth (bytes/s) of the endpoint carrying a stream */
+	std::string streamEndpoint(SensorType type) const;
+	boost::uint64_t streamBandwidth(SensorType type) const;
+	bool hasStreamDemand(SensorType type, Measurement::Timestamp now);
+	void requestStream(SensorType type, Measurement::Timestamp now);
+	void streamDelivered(SensorType type, const freenect_camera::ImageBuffer& image);
+
+	void publishSharedFrame(SensorType type, const freenect_camera::ImageBuffer& image, Measurement::Timestamp ts);
+
+	/** map the calibration cache of the device, before it is opened */
+	void loadRegistrationCache();
+
+	/** compare the cache with the device and rewrite it if needed, runs in a background thread */
+	void refreshRegistrationCache();
+
+	/** keep a copy of an RGB frame for the colored point cloud */
+	void storeCloudColor( const freenect_camera::ImageBuffer& image, Measurement::Timestamp ts );
+
+	/** poll the accelerometer if due, called between event loop iterations */
+	void pollAccelerometer();
+
 	void rgbCb(const freenect_camera::ImageBuffer& image, void* cookie);
 	void depthCb(const freenect_camera::ImageBuffer& depth_image, void* cookie);
 	void irCb(const freenect_camera::ImageBuffer&_image, void* cookie);
@@ -227,6 +433,59 @@ private:
 
 std::ostream& operator<<( std::ostream& s, const FreenectComponentKey& k );
 
+/**
+ * A captured frame on its way through the processing stages.
+ */
+struct FreenectFrame {
+	FreenectFrame()
+		: ts( 0 ), sequence( 0 ), focalLength( 0 ), metric( false ) {}
+
+	Measurement::Timestamp ts;
+	boost::shared_ptr< Vision::Image > image;
+	boost::uint32_t sequence;
+	// of the depth mode the frame was captured in, the stages run after a mode change
+	float focalLength;
+	bool metric;
+};
+
+/** frames of the devices in the process, collected into sets of the same time */
+typedef freenect_camera::FrameSetHub< boost::shared_ptr< Vision::Image > > FreenectFrameSetHub;
+
+/**
+ * A stream of a device taking part in a cross-device frame set.
+ */
+struct FreenectFrameSetStream {
+	FreenectFrameSetStream()
+		: joined( false ), modeValid( false ), layoutValid( false ), lastTimestamp( 0 ), ticks( 0 ), lastArrival( 0 )
+		, posted( 0 ), sets( 0 ), skewSum( 0 ), skewMax( 0 ) {}
+
+	// name in the frame set group, serial and stream
+	std::string member;
+	bool joined;
+
+	// conversion of the current frame mode into pooled frames
+	freenect_frame_mode mode;
+	bool modeValid;
+	ImageLayout layout;
+	bool layoutValid;
+	freenect_camera::FrameKernel kernel;
+	boost::shared_ptr< freenect_camera::FramePool > pool;
+
+	// device clock: learned frame interval, unwrapped ticks and their mapping to host time
+	freenect_camera::FrameSequencer clock;
+	boost::uint32_t lastTimestamp;
+	boost::uint64_t ticks;
+	Measurement::Timestamp lastArrival;
+	boost::scoped_ptr< Measurement::TimestampSync > sync;
+
+	// frames handed to the hub on the device thread, and sets delivered on the hub thread
+	// with the skew of this stream (ns)
+	boost::atomic< unsigned long > posted;
+	boost::atomic< unsigned long > sets;
+	boost::uint64_t skewSum;
+	boost::uint64_t skewMax;
+};
+
 /**
  * Component for Freenect tracker.
  */
@@ -236,18 +495,319 @@ public:
 	FreenectComponent( const std::string& name, boost::shared_ptr< Graph::UTQLSubgraph > subgraph, const FreenectComponentKey& componentKey, FreenectModule* pModule );
 
 	void configureStream(const boost::shared_ptr<freenect_camera::FreenectDevice>& device);
-	void imageCb( const freenect_camera::ImageBuffer& image);
+
+	/** does any consumer currently need frames from this component? */
+	bool hasDemand( Measurement::Timestamp now );
+
+	void imageCb( const freenect_camera::ImageBuffer& image, Measurement::Timestamp ts );
+
+	/** accelerometer poll rate of the ACCEL sensor in Hz */
+	double getAccelRate() const {
+		return m_accelRate;
+	}
+
+	/** push an accelerometer reading */
+	void sendAcceleration( Measurement::Timestamp ts, double x, double y, double z );
+
+	/** does the plane stage need the accelerometer as gravity prior? */
+	bool usesGravityPrior();
+
+	/** does the frame set need the stream of this sensor (SENSOR_RGB or SENSOR_DEPTH)? */
+	bool frameSetUses( SensorType type );
+
+	/** convert a frame of the device and hand it to the frame set hub */
+	void frameSetCb( SensorType type, const freenect_camera::ImageBuffer& image, Measurement::Timestamp ts );
 
 	/** destructor */
-	~FreenectComponent() {};
+	~FreenectComponent();
 
+	virtual void start();
+
+	virtual void stop();
 
 protected:
 
+	/** rate limit, returns false if the frame should be skipped */
+	bool acceptFrame( Measurement::Timestamp ts );
+
+	/** returns false if the frame hardly differs from the last one pushed */
+	bool passChangeGate( Measurement::Timestamp ts, const freenect_camera::ImageBuffer& image, int sampleBytes );
+
+	/** choose image layout and conversion kernel for a new frame mode */
+	void selectConversion( const freenect_frame_mode& mode );
+
+	/** hand a captured frame over according to the delivery policy */
+	void deliverFrame( const FreenectFrame& frame, int frameRate );
+
+	/** pull handler, returns the newest frame */
+	Measurement::ImageMeasurement pullLatest( Measurement::Timestamp t );
+
+	/** convert a raw UYVY frame to the configured output */
+	boost::shared_ptr< Vision::Image > convertYUV( boost::shared_ptr< Vision::Image > pImage );
+
+	/** push a frame and everything derived from it, runs the stages on the calling thread */
+	void processFrame( FreenectFrame frame );
+
+	/** set up the configured stages which have a connected consumer */
+	void buildPipeline();
+
+	/** does the stage have anything to do for this sensor and the connected ports? */
+	bool stageNeeded( ProcessingStage stage );
+
+	/** run one processing stage on a frame, false drops the frame for the later stages */
+	bool runStage( ProcessingStage stage, FreenectFrame& frame );
+
+	/** find bright markers in a raw IR frame and push them */
+	void detectMarkers( Measurement::Timestamp ts, const freenect_camera::ImageBuffer& image );
+
+	/** encode a depth frame and push it on the compressed port */
+	void sendCompressedDepth( Measurement::Timestamp ts, Vision::Image& image );
+
+	/** fuse a depth frame with the latest color into the cloud image, false if not possible */
+	bool fuseColoredPointCloud( Measurement::Timestamp ts, const freenect_camera::ImageBuffer& depth, Vision::Image& cloud );
+
+	/** compute the normal map of a depth frame and push it on the normals port */
+	void sendNormals( const FreenectFrame& frame );
+
+	/** build the depth pyramid of a frame and push it on the pyramid port */
+	void sendPyramid( Measurement::Timestamp ts, Vision::Image& image );
+
+	/** compare a depth frame with the background model and push the foreground */
+	void sendForeground( const FreenectFrame& frame );
+
+	/** remove the dominant plane of a depth frame and push the rest and the plane */
+	void sendPlane( const FreenectFrame& frame );
+
+	/** learn ('l'), freeze ('f') or reset ('r') the background model */
+	void receiveBackgroundControl( const Measurement::Button& event );
+
+	/** track output saturation and reduce the load if it persists */
+	void updateSaturation( Measurement::Timestamp ts, bool saturated );
+
+	void logDeliveryStatistics();
+
+	/** host time of a frame set frame from the device clock, the arrival time until the clock is learned */
+	Measurement::Timestamp frameSetTime( FreenectFrameSetStream& stream, const freenect_camera::ImageBuffer& image, Measurement::Timestamp ts );
+
+	/** push the frame of this device in a completed set, called by the hub */
+	void deliverFrameSet( SensorType type, boost::uint64_t time, const boost::shared_ptr< Vision::Image >& pImage, boost::int64_t skew );
+
+	// delivery thread for the latest-only policy
+	void DeliveryThreadProc();
+	void stopDeliveryThread();
+
 	std::string m_stream_mode;
+	// format requested from the device for IR and depth, empty for the default
+	std::string m_streamFormat;
+
+	// conversion of the current frame mode, chosen when the mode changes
+	freenect_frame_mode m_frameMode;
+	bool m_frameModeValid;
+	ImageLayout m_frameLayout;
+	bool m_frameLayoutValid;
+	freenect_camera::FrameKernel m_frameKernel;
+
+	// output frames recycled with locked or huge page memory, NULL on the heap
+	boost::shared_ptr< freenect_camera::FramePool > m_framePool;
+	unsigned int m_framePoolSize;
+
+	// output of the YUV_RAW video mode
+	YUVOutput m_yuvOutput;
 
 	// the port
 	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_outPort;
+
+	// newest frame for pull consumers, swapped atomically
+	Dataflow::PullSupplier< Measurement::ImageMeasurement > m_pullPort;
+
+	// device sequence number of every pushed frame, gaps are frames lost on the USB
+	Dataflow::PushSupplier< Measurement::Button > m_sequencePort;
+	boost::shared_ptr< const Measurement::ImageMeasurement > m_latestFrame;
+	// host time in ms of the last pull
+	boost::atomic< unsigned long long > m_lastPull;
+
+	// accelerometer reading in m/s^2 of the ACCEL sensor
+	Dataflow::PushSupplier< Measurement::Position > m_gravityPort;
+	double m_accelRate;
+
+	// depth and RGB frames of this device in cross-device frame sets, all with the set time
+	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_frameSetDepthPort;
+	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_frameSetColorPort;
+	std::string m_frameSetGroup;
+	// frames further apart than this many ms do not form a set
+	double m_frameSetTolerance;
+	FreenectFrameSetStream m_frameSetDepth;
+	FreenectFrameSetStream m_frameSetColor;
+
+	// losslessly compressed depth (optional)
+	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_compressedPort;
+
+	// IR marker centroids and their area, mean and peak intensity (optional)
+	Dataflow::PushSupplier< Measurement::PositionList2 > m_markerPort;
+	Dataflow::PushSupplier< Measurement::PositionList > m_markerStatsPort;
+	freenect_camera::IRMarkerDetector m_markerDetector;
+	std::vector< freenect_camera::IRMarker > m_markers;
+	// push the IR image in addition to the markers?
+	bool m_markerImageOutput;
+	// can markers be detected in the current frame mode?
+	bool m_markerInputValid;
+	// packed frames unpacked for the detection
+	std::vector< boost::uint16_t > m_markerPixels;
+
+	// delivery policy
+	DeliveryPolicy m_deliveryPolicy;
+	double m_targetFrameRate;
+	bool m_adaptiveDowngrade;
+	unsigned int m_saturationPeriod;
+	// targetFrameRate as configured, restored once the output recovers
+	double m_configuredFrameRate;
+	// downgrades still in effect
+	unsigned int m_rateReductions;
+	bool m_resolutionReduced;
+	// consecutive saturation periods without saturation
+	unsigned int m_calmPeriods;
+	Measurement::Timestamp m_lastAccepted;
+
+	// suppression of unchanged frames
+	freenect_camera::ChangeGate m_changeGate;
+	// push a frame at least every this many ms, even without changes
+	unsigned int m_changeHeartbeat;
+	Measurement::Timestamp m_lastEmitted;
+	unsigned long long m_bytesSuppressed;
+	Measurement::Timestamp m_changeGateTime;
+
+	// latest-only delivery slot and thread
+	boost::scoped_ptr< boost::thread > m_deliveryThread;
+	boost::mutex m_deliveryMutex;
+	boost::condition_variable m_deliveryCondition;
+	bool m_deliveryStop;
+	// no image while the slot is empty
+	FreenectFrame m_pendingFrame;
+
+	// processing stages, a flow graph with the pipeline policy
+	freenect_camera::FramePipeline< FreenectFrame > m_pipeline;
+	std::string m_pipelineStages;
+	// frames in the flow graph at most
+	unsigned int m_pipelineDepth;
+
+	// CPUs and real-time priority of the delivery thread and the TBB workers of the pipeline
+	freenect_camera::ThreadPlacement m_workerPlacement;
+	// the pipeline runs in its own arena when placed, other TBB work keeps its workers
+	boost::scoped_ptr< tbb::task_arena > m_workerArena;
+	boost::scoped_ptr< freenect_camera::WorkerPlacementObserver > m_workerObserver;
+
+	// saturation window
+	Measurement::Timestamp m_saturationWindowStart;
+	unsigned long m_windowFrames;
+	unsigned long m_windowSaturated;
+
+	// delivery counters
+	boost::atomic< unsigned long > m_framesOffered;
+	boost::atomic< unsigned long > m_framesDelivered;
+	boost::atomic< unsigned long > m_framesSkippedRate;
+	boost::atomic< unsigned long > m_framesSkippedBusy;
+	boost::atomic< unsigned long > m_framesSuppressed;
+	boost::atomic< unsigned long > m_downgrades;
+
+	// depth compression state and statistics
+	freenect_camera::DepthEncoder m_depthEncoder;
+
+	// organized normal map of the depth frames (optional)
+	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_normalsPort;
+	freenect_camera::DepthNormalEstimator m_normalEstimator;
+	// depth pyramid packed into one image (optional)
+	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_pyramidPort;
+	freenect_camera::DepthPyramidBuilder m_pyramidBuilder;
+
+	// background model, foreground mask and boxes (optional)
+	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_foregroundPort;
+	Dataflow::PushSupplier< Measurement::PositionList2 > m_foregroundBoxesPort;
+	Dataflow::PushConsumer< Measurement::Button > m_backgroundControlPort;
+	freenect_camera::DepthBackgroundModel m_backgroundModel;
+	std::vector< freenect_camera::ForegroundBox > m_foregroundBoxes;
+	boost::atomic< bool > m_backgroundLearn;
+	boost::atomic< bool > m_backgroundReset;
+	// freeze the model after this many frames (0 = keep learning)
+	unsigned int m_backgroundLearnFrames;
+	unsigned long m_backgroundFrames;
+
+	// depth without the dominant plane and the plane (nx, ny, nz, d in m) (optional)
+	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_planeRemovedPort;
+	Dataflow::PushSupplier< Measurement::Vector4D > m_planePort;
+	freenect_camera::DepthPlaneRemover m_planeRemover;
+	bool m_planeGravityPrior;
+	unsigned long m_planeFrames;
+	unsigned long m_planeFound;
+	unsigned long m_planeTracked;
+	double m_planeInlierSum;
+
+	// age of the color fused into the colored point cloud
+	unsigned int m_maxColorAge;
+	Measurement::Timestamp m_colorAgeSum;
+	Measurement::Timestamp m_colorAgeMax;
+	unsigned long m_cloudFrames;
+	unsigned long m_coloredFrames;
+	unsigned long m_staleColorFrames;
+
+	unsigned long m_compressedFrames;
+	unsigned long long m_compressedBytesIn;
+	unsigned long long m_compressedBytesOut;
+	Measurement::Timestamp m_compressionTime;
+};
+
+/**
+ * Decoder for the compressed depth output of the Freenect depth component.
+ * Runs on the receiving side, e.g. after a network source.
+ */
+class FreenectDepthDecoder : public Dataflow::Component {
+public:
+	/** constructor */
+	FreenectDepthDecoder( const std::string& name, boost::shared_ptr< Graph::UTQLSubgraph > subgraph );
+
+protected:
+
+	void receiveCompressed( const Measurement::ImageMeasurement& m );
+
+	Dataflow::PushConsumer< Measurement::ImageMeasurement > m_inPort;
+	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_outPort;
+
+	freenect_camera::DepthDecoder m_decoder;
+};
+
+/**
+ * Frame grabber attaching to the shared memory frame ring exported by a
+ * FreenectModule in another process.
+ */
+class FreenectSharedMemoryFrameGrabber : public Dataflow::Component {
+public:
+	/** constructor */
+	FreenectSharedMemoryFrameGrabber( const std::string& name, boost::shared_ptr< Graph::UTQLSubgraph > subgraph );
+
+	virtual void start();
+
+	virtual void stop();
+
+protected:
+
+	// thread main loop
+	void ThreadProc();
+
+	// the thread
+	boost::scoped_ptr< boost::thread > m_Thread;
+
+	// stop the thread?
+	volatile bool m_bStop;
+
+	SensorType m_sensorType;
+
+	// push images referring to leased slots of the shared memory instead of copies?
+	bool m_zeroCopy;
+	// frames copied although zero copy was requested
+	unsigned long m_zeroCopyMisses;
+
+	boost::scoped_ptr< freenect_camera::SharedFrameReader > m_reader;
+
+	Dataflow::PushSupplier< Measurement::ImageMeasurement > m_outPort;
 };
 
 } } // namespace Ubitrack::Drivers
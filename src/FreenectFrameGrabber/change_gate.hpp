@@ -0,0 +1,149 @@
+#ifndef CHANGE_GATE_T3KD9WQM
+#define CHANGE_GATE_T3KD9WQM
+
+#include <vector>
+#include <cstring>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FREENECT_HAVE_SSE2
+#endif
+
+namespace freenect_camera {
+
+  /**
+   * \class ChangeGate
+   *
+   * \brief Decides whether a frame differs enough from the last emitted one.
+   *
+   * Only every n-th row is compared against the same rows of the last
+   * emitted frame. The sums of absolute differences are collected on a grid
+   * of blocks, a frame passes if the mean difference of any block exceeds
+   * the threshold, so small local changes are not averaged away. 8 bit
+   * samples (any number of channels) and 16 bit samples are supported.
+   */
+  class ChangeGate {
+    public:
+
+      static const int BLOCKS_X = 16;
+      static const int BLOCKS_Y = 12;
+
+      ChangeGate()
+        : threshold_(0), row_step_(4), width_(0), height_(0), sample_bytes_(0) {}
+
+      /** mean absolute difference per sample a block must exceed (0 disables the gate) */
+      void setThreshold(double threshold) { threshold_ = threshold; }
+      double threshold() const { return threshold_; }
+
+      /** compare every row_step-th row */
+      void setRowStep(int row_step) { row_step_ = std::max(1, row_step); }
+
+      /** forget the reference, the next frame passes */
+      void reset() { reference_.clear(); }
+
+      /**
+       * Check a frame of height rows with width samples of sample_bytes (1 or
+       * 2) each. Returns true if the frame changed, it then becomes the new
+       * reference.
+       */
+      bool check(const void* data, int width, int height, int sample_bytes) {
+        const boost::uint8_t* frame = static_cast<const boost::uint8_t*>(data);
+        const size_t row_bytes = size_t(width) * sample_bytes;
+        const int rows = (height + row_step_ - 1) / row_step_;
+
+        if (reference_.empty() || width != width_ || height != height_ || sample_bytes != sample_bytes_) {
+          width_ = width;
+          height_ = height;
+          sample_bytes_ = sample_bytes;
+          reference_.resize(row_bytes * rows);
+          storeReference(frame, row_bytes, rows);
+          return true;
+        }
+
+        std::fill(block_sums_, block_sums_ + BLOCKS_X * BLOCKS_Y, 0.0);
+        std::fill(block_counts_, block_counts_ + BLOCKS_X * BLOCKS_Y, 0u);
+        // blocks are split at 16 byte boundaries, the vector width. A
+        // shorter row tail is not compared.
+        const size_t chunks = row_bytes / 16;
+        for (int r = 0; r < rows; ++r) {
+          const boost::uint8_t* cur = frame + size_t(r) * row_step_ * row_bytes;
+          const boost::uint8_t* ref = &reference_[size_t(r) * row_bytes];
+          const int by = (r * BLOCKS_Y) / rows;
+          double* sums = block_sums_ + by * BLOCKS_X;
+          unsigned* counts = block_counts_ + by * BLOCKS_X;
+          for (size_t c = 0; c < chunks; ++c) {
+            const int bx = int((c * BLOCKS_X) / chunks);
+            sums[bx] += sample_bytes == 1 ? sad8(cur + 16 * c, ref + 16 * c) : sad16(cur + 16 * c, ref + 16 * c);
+            counts[bx] += 16 / sample_bytes;
+          }
+        }
+
+        bool changed = false;
+        for (int b = 0; b < BLOCKS_X * BLOCKS_Y && !changed; ++b)
+          changed = block_counts_[b] && block_sums_[b] > threshold_ * block_counts_[b];
+        if (changed)
+          storeReference(frame, row_bytes, rows);
+        return changed;
+      }
+
+      /** bytes read by one check, to compare against the bytes of a suppressed frame */
+      size_t bytesCompared() const { return reference_.size() * 2; }
+
+    private:
+
+      void storeReference(const boost::uint8_t* frame, size_t row_bytes, int rows) {
+        for (int r = 0; r < rows; ++r)
+          memcpy(&reference_[size_t(r) * row_bytes], frame + size_t(r) * row_step_ * row_bytes, row_bytes);
+      }
+
+      static unsigned sad8(const boost::uint8_t* a, const boost::uint8_t* b) {
+#ifdef FREENECT_HAVE_SSE2
+        const __m128i sad = _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(a)),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(b)));
+        return unsigned(_mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4));
+#else
+        unsigned sum = 0;
+        for (int i = 0; i < 16; ++i)
+          sum += a[i] > b[i] ? a[i] - b[i] : b[i] - a[i];
+        return sum;
+#endif
+      }
+
+      static unsigned sad16(const boost::uint8_t* a, const boost::uint8_t* b) {
+#ifdef FREENECT_HAVE_SSE2
+        const __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a));
+        const __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b));
+        const __m128i diff = _mm_or_si128(_mm_subs_epu16(va, vb), _mm_subs_epu16(vb, va));
+        const __m128i zero = _mm_setzero_si128();
+        __m128i sum = _mm_add_epi32(_mm_unpacklo_epi16(diff, zero), _mm_unpackhi_epi16(diff, zero));
+        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 8));
+        sum = _mm_add_epi32(sum, _mm_srli_si128(sum, 4));
+        return unsigned(_mm_cvtsi128_si32(sum));
+#else
+        boost::uint16_t va[8], vb[8];
+        memcpy(va, a, 16);
+        memcpy(vb, b, 16);
+        unsigned sum = 0;
+        for (int i = 0; i < 8; ++i)
+          sum += va[i] > vb[i] ? va[i] - vb[i] : vb[i] - va[i];
+        return sum;
+#endif
+      }
+
+      double threshold_;
+      int row_step_;
+
+      int width_;
+      int height_;
+      int sample_bytes_;
+      std::vector<boost::uint8_t> reference_;
+
+      double block_sums_[BLOCKS_X * BLOCKS_Y];
+      unsigned block_counts_[BLOCKS_X * BLOCKS_Y];
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: CHANGE_GATE_T3KD9WQM */
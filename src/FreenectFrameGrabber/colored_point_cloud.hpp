@@ -0,0 +1,169 @@
+#ifndef COLORED_POINT_CLOUD_H4VQ8MTE
+#define COLORED_POINT_CLOUD_H4VQ8MTE
+
+#include <vector>
+#include <limits>
+#include <cstring>
+#include <boost/cstdint.hpp>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#include <libfreenect.h>
+#include <libfreenect_registration.h>
+#include "registration_cache.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FREENECT_HAVE_SSE2
+#endif
+
+namespace freenect_camera {
+
+  /**
+   * \class ColoredPointCloudBuilder
+   *
+   * \brief Turns a depth frame in mm and the latest RGB frame into an
+   * organized XYZRGB cloud.
+   *
+   * Every depth pixel becomes four floats: X, Y, Z in meters and the color
+   * packed as 0x00RRGGBB into the bits of the fourth float. Pixels without
+   * depth get NaN coordinates, pixels without color get 0. The color of a
+   * pixel is looked up through the registration table and the depth
+   * dependent shift of libfreenect, the coordinates come from a ray table,
+   * so a row is produced in a single pass. Both frames must be 640x480.
+   */
+  class ColoredPointCloudBuilder {
+    public:
+
+      ColoredPointCloudBuilder()
+        : registration_table_(NULL), depth_to_rgb_shift_(NULL), rays_(NULL) {}
+
+      bool ready() const { return rays_ != NULL; }
+
+      /** forget the tables, e.g. when the device was reopened */
+      void reset() {
+        registration_table_ = NULL;
+        depth_to_rgb_shift_ = NULL;
+        rays_ = NULL;
+        own_rays_.clear();
+      }
+
+      /** use tables owned by someone else, e.g. a RegistrationCache */
+      void setTables(const boost::int32_t (*registration_table)[2],
+          const boost::int32_t* depth_to_rgb_shift, const float* rays) {
+        registration_table_ = registration_table;
+        depth_to_rgb_shift_ = depth_to_rgb_shift;
+        rays_ = rays;
+      }
+
+      /** use the tables of a device registration, the ray table is computed here */
+      void setRegistration(const freenect_registration& registration, float focal_length) {
+        own_rays_.resize(REGISTRATION_WIDTH * REGISTRATION_HEIGHT * 2);
+        computeDepthRays(focal_length, &own_rays_[0]);
+        setTables(registration.registration_table, registration.depth_to_rgb_shift, &own_rays_[0]);
+      }
+
+      /**
+       * Build the cloud into out (4 floats per pixel). color is a packed RGB
+       * frame or NULL if there is none.
+       */
+      void build(const boost::uint16_t* depth, const boost::uint8_t* color, float* out) const {
+        tbb::parallel_for(tbb::blocked_range<int>(0, REGISTRATION_HEIGHT), RowBody(*this, depth, color, out));
+      }
+
+    private:
+
+      // x positions in the registration table are scaled by this
+      static const int REG_X_SCALE = 256;
+
+      boost::uint32_t lookupColor(int index, unsigned depth, const boost::uint8_t* color) const {
+        if (!color || depth == 0 || depth >= FREENECT_DEPTH_MM_MAX_VALUE)
+          return 0;
+        const int cx = (registration_table_[index][0] + depth_to_rgb_shift_[depth]) / REG_X_SCALE;
+        const int cy = registration_table_[index][1];
+        if (unsigned(cx) >= unsigned(REGISTRATION_WIDTH) || unsigned(cy) >= unsigned(REGISTRATION_HEIGHT))
+          return 0;
+        const boost::uint8_t* p = color + 3 * (cy * REGISTRATION_WIDTH + cx);
+        return (boost::uint32_t(p[0]) << 16) | (boost::uint32_t(p[1]) << 8) | p[2];
+      }
+
+      void buildRow(int y, const boost::uint16_t* depth, const boost::uint8_t* color, float* out) const {
+        const int row = y * REGISTRATION_WIDTH;
+        const boost::uint16_t* d = depth + row;
+        const float* ray = rays_ + 2 * row;
+        float* o = out + 4 * row;
+        int x = 0;
+#ifdef FREENECT_HAVE_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 scale = _mm_set1_ps(0.001f);
+        const __m128 nan = _mm_set1_ps(std::numeric_limits<float>::quiet_NaN());
+        // the width is a multiple of 4, the vector loop leaves no tail
+        for (; x + 4 <= REGISTRATION_WIDTH; x += 4) {
+          const __m128i d32 = _mm_unpacklo_epi16(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(d + x)), zero);
+          const __m128 invalid = _mm_castsi128_ps(_mm_cmpeq_epi32(d32, zero));
+          const __m128 z = _mm_mul_ps(_mm_cvtepi32_ps(d32), scale);
+          // rays are interleaved x0 y0 x1 y1 ...
+          const __m128 r01 = _mm_loadu_ps(ray + 2 * x);
+          const __m128 r23 = _mm_loadu_ps(ray + 2 * x + 4);
+          __m128 px = _mm_mul_ps(_mm_shuffle_ps(r01, r23, _MM_SHUFFLE(2, 0, 2, 0)), z);
+          __m128 py = _mm_mul_ps(_mm_shuffle_ps(r01, r23, _MM_SHUFFLE(3, 1, 3, 1)), z);
+          __m128 pz = z;
+          px = _mm_or_ps(_mm_and_ps(invalid, nan), _mm_andnot_ps(invalid, px));
+          py = _mm_or_ps(_mm_and_ps(invalid, nan), _mm_andnot_ps(invalid, py));
+          pz = _mm_or_ps(_mm_and_ps(invalid, nan), _mm_andnot_ps(invalid, pz));
+
+          boost::uint32_t c[4];
+          for (int i = 0; i < 4; ++i)
+            c[i] = lookupColor(row + x + i, d[x + i], color);
+          __m128 pc = _mm_castsi128_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(c)));
+
+          // four columns of x, y, z, rgb to four interleaved points
+          _MM_TRANSPOSE4_PS(px, py, pz, pc);
+          _mm_storeu_ps(o + 4 * x, px);
+          _mm_storeu_ps(o + 4 * x + 4, py);
+          _mm_storeu_ps(o + 4 * x + 8, pz);
+          _mm_storeu_ps(o + 4 * x + 12, pc);
+        }
+#else
+        for (; x < REGISTRATION_WIDTH; ++x) {
+          float* p = o + 4 * x;
+          if (d[x] == 0) {
+            p[0] = p[1] = p[2] = std::numeric_limits<float>::quiet_NaN();
+          } else {
+            const float z = d[x] * 0.001f;
+            p[0] = ray[2 * x] * z;
+            p[1] = ray[2 * x + 1] * z;
+            p[2] = z;
+          }
+          const boost::uint32_t c = lookupColor(row + x, d[x], color);
+          memcpy(p + 3, &c, sizeof(c));
+        }
+#endif
+      }
+
+      struct RowBody {
+        RowBody(const ColoredPointCloudBuilder& builder, const boost::uint16_t* depth,
+            const boost::uint8_t* color, float* out)
+          : builder_(builder), depth_(depth), color_(color), out_(out) {}
+
+        void operator()(const tbb::blocked_range<int>& range) const {
+          for (int y = range.begin(); y != range.end(); ++y)
+            builder_.buildRow(y, depth_, color_, out_);
+        }
+
+        const ColoredPointCloudBuilder& builder_;
+        const boost::uint16_t* depth_;
+        const boost::uint8_t* color_;
+        float* out_;
+      };
+
+      const boost::int32_t (*registration_table_)[2];
+      const boost::int32_t* depth_to_rgb_shift_;
+      const float* rays_;
+      std::vector<float> own_rays_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: COLORED_POINT_CLOUD_H4VQ8MTE */
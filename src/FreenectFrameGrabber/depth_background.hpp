@@ -0,0 +1,307 @@
+#ifndef DEPTH_BACKGROUND_H4NC7PLX
+#define DEPTH_BACKGROUND_H4NC7PLX
+
+#include <vector>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FREENECT_HAVE_SSE2
+#endif
+
+namespace freenect_camera {
+
+  /**
+   * Bounding box of a foreground region, max is inclusive.
+   */
+  struct ForegroundBox {
+    int min_x;
+    int min_y;
+    int max_x;
+    int max_y;
+    unsigned pixels;
+  };
+
+  /**
+   * \class DepthBackgroundModel
+   *
+   * \brief Per pixel background depth with a confidence, learned
+   * incrementally.
+   *
+   * A pixel matching the model (within the tolerance) pulls the background
+   * towards it and raises the confidence, a pixel which does not match
+   * lowers it. Once the confidence is used up the new depth replaces the
+   * background, so the model follows the most frequent depth of every pixel.
+   * Pixels closer than a confident background by more than the tolerance are
+   * foreground. The model can be frozen, then it is only compared against.
+   *
+   * The update is done for 8 pixels at once, foreground pixels are
+   * collected on a grid of 16x16 pixel cells with tight extents, connected
+   * cells are merged into bounding boxes.
+   */
+  class DepthBackgroundModel {
+    public:
+
+      static const int CELL_SIZE = 16;
+
+      DepthBackgroundModel()
+        : width_(0), height_(0), tolerance_(30), max_confidence_(30)
+        , min_confidence_(10), min_cell_pixels_(8), min_box_pixels_(64) {}
+
+      /** absolute depth tolerance in mm, 1/32 of the depth is added to it */
+      void setTolerance(unsigned mm) { tolerance_ = mm; }
+
+      /**
+       * Number of matching frames needed before a pixel can have foreground,
+       * and the number of mismatching frames before a learned background is
+       * replaced.
+       */
+      void setConfidence(unsigned min_confidence, unsigned max_confidence) {
+        max_confidence_ = std::max(1u, std::min(max_confidence, 0x7FFFu));
+        min_confidence_ = std::min(min_confidence, max_confidence_);
+      }
+
+      /** minimum number of foreground pixels of a box */
+      void setMinBoxPixels(unsigned pixels) { min_box_pixels_ = pixels; }
+
+      /** forget the background */
+      void reset() {
+        width_ = height_ = 0;
+      }
+
+      /**
+       * Compare a frame (depth in mm, 0 = missing) with the model and
+       * optionally learn it. mask receives 255 for foreground pixels and
+       * must hold width * height bytes.
+       */
+      void apply(const boost::uint16_t* depth, int width, int height, bool learn,
+          boost::uint8_t* mask, std::vector<ForegroundBox>& boxes) {
+        if (width != width_ || height != height_) {
+          width_ = width;
+          height_ = height;
+          background_.assign(size_t(width) * height, 0);
+          confidence_.assign(size_t(width) * height, 0);
+        }
+        cells_x_ = (width + CELL_SIZE - 1) / CELL_SIZE;
+        cells_y_ = (height + CELL_SIZE - 1) / CELL_SIZE;
+        cells_.resize(size_t(cells_x_) * cells_y_);
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, cells_y_),
+            UpdateBody(*this, depth, learn, mask));
+
+        collectBoxes(boxes);
+      }
+
+    private:
+
+      struct Cell {
+        unsigned pixels;
+        int min_x;
+        int min_y;
+        int max_x;
+        int max_y;
+      };
+
+      /** scalar version of the update, for the row tails */
+      bool updatePixel(size_t i, unsigned d, bool learn) {
+        unsigned bg = background_[i];
+        unsigned conf = confidence_[i];
+        if (d == 0)
+          return false;
+        const unsigned tol = (bg >> 5) + tolerance_;
+        const unsigned diff = d > bg ? d - bg : bg - d;
+        const bool foreground = conf >= min_confidence_ && bg > d && bg - d > tol;
+        if (learn) {
+          if (diff <= tol) {
+            const unsigned half = (bg + d + 1) >> 1;
+            background_[i] = boost::uint16_t((bg + half + 1) >> 1);
+            confidence_[i] = boost::uint16_t(std::min(conf + 1, max_confidence_));
+          } else if (conf > 1) {
+            confidence_[i] = boost::uint16_t(conf - 1);
+          } else {
+            background_[i] = boost::uint16_t(d);
+            confidence_[i] = 1;
+          }
+        }
+        return foreground;
+      }
+
+      void updateRow(const boost::uint16_t* depth, int y, bool learn, boost::uint8_t* mask) {
+        const size_t row = size_t(y) * width_;
+        boost::uint16_t* bg = &background_[row];
+        boost::uint16_t* conf = &confidence_[row];
+        const boost::uint16_t* d = depth + row;
+        boost::uint8_t* m = mask + row;
+        int x = 0;
+#ifdef FREENECT_HAVE_SSE2
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i one = _mm_set1_epi16(1);
+        const __m128i tol_abs = _mm_set1_epi16(short(tolerance_));
+        const __m128i min_conf = _mm_set1_epi16(short(min_confidence_));
+        const __m128i max_conf = _mm_set1_epi16(short(max_confidence_));
+        for (; x + 16 <= width_; x += 16) {
+          __m128i fg[2];
+          for (int k = 0; k < 2; ++k) {
+            const int o = x + 8 * k;
+            const __m128i vd = _mm_loadu_si128(reinterpret_cast<const __m128i*>(d + o));
+            const __m128i vbg = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bg + o));
+            const __m128i vconf = _mm_loadu_si128(reinterpret_cast<const __m128i*>(conf + o));
+
+            const __m128i tol = _mm_adds_epu16(_mm_srli_epi16(vbg, 5), tol_abs);
+            const __m128i valid = _mm_xor_si128(_mm_cmpeq_epi16(vd, zero), _mm_set1_epi16(-1));
+            const __m128i closer = _mm_subs_epu16(vbg, vd);
+            const __m128i diff = _mm_or_si128(closer, _mm_subs_epu16(vd, vbg));
+            // a <= b  <=>  saturate(a - b) == 0
+            const __m128i match = _mm_and_si128(valid, _mm_cmpeq_epi16(_mm_subs_epu16(diff, tol), zero));
+            const __m128i confident = _mm_cmpeq_epi16(_mm_subs_epu16(min_conf, vconf), zero);
+            fg[k] = _mm_andnot_si128(_mm_cmpeq_epi16(_mm_subs_epu16(closer, tol), zero),
+                _mm_and_si128(valid, confident));
+
+            if (learn) {
+              // matching: background moves a quarter towards the depth, confidence rises
+              const __m128i blended = _mm_avg_epu16(vbg, _mm_avg_epu16(vbg, vd));
+              const __m128i raised = _mm_min_epi16(_mm_adds_epu16(vconf, one), max_conf);
+              // not matching: confidence drops, at zero the depth replaces the background
+              const __m128i lowered = _mm_subs_epu16(vconf, one);
+              const __m128i replace = _mm_andnot_si128(match,
+                  _mm_and_si128(valid, _mm_cmpeq_epi16(lowered, zero)));
+              const __m128i drop = _mm_andnot_si128(match, valid);
+
+              __m128i nbg = _mm_or_si128(_mm_and_si128(match, blended), _mm_andnot_si128(match, vbg));
+              nbg = _mm_or_si128(_mm_and_si128(replace, vd), _mm_andnot_si128(replace, nbg));
+              __m128i nconf = _mm_or_si128(_mm_and_si128(match, raised), _mm_andnot_si128(match, vconf));
+              nconf = _mm_or_si128(_mm_and_si128(drop, lowered), _mm_andnot_si128(drop, nconf));
+              nconf = _mm_or_si128(_mm_and_si128(replace, one), _mm_andnot_si128(replace, nconf));
+              _mm_storeu_si128(reinterpret_cast<__m128i*>(bg + o), nbg);
+              _mm_storeu_si128(reinterpret_cast<__m128i*>(conf + o), nconf);
+            }
+          }
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(m + x), _mm_packs_epi16(fg[0], fg[1]));
+        }
+#endif
+        for (; x < width_; ++x)
+          m[x] = updatePixel(row + x, d[x], learn) ? 255 : 0;
+      }
+
+      /** add the foreground pixels of a mask row to the cells */
+      void countRow(const boost::uint8_t* m, int y, Cell* cells) {
+        for (int cx = 0; cx < cells_x_; ++cx) {
+          const int x0 = cx * CELL_SIZE;
+          const int x1 = std::min(x0 + CELL_SIZE, width_);
+          unsigned bits = 0;
+          if (x1 - x0 == CELL_SIZE) {
+#ifdef FREENECT_HAVE_SSE2
+            bits = unsigned(_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(m + x0))));
+#else
+            for (int x = x0; x < x1; ++x)
+              if (m[x])
+                bits |= 1u << (x - x0);
+#endif
+          } else {
+            for (int x = x0; x < x1; ++x)
+              if (m[x])
+                bits |= 1u << (x - x0);
+          }
+          if (!bits)
+            continue;
+          Cell& cell = cells[cx];
+          int first = 0;
+          while (!(bits & (1u << first)))
+            ++first;
+          int last = CELL_SIZE - 1;
+          while (!(bits & (1u << last)))
+            --last;
+          for (unsigned b = bits; b; b &= b - 1)
+            ++cell.pixels;
+          cell.min_x = std::min(cell.min_x, x0 + first);
+          cell.max_x = std::max(cell.max_x, x0 + last);
+          cell.min_y = std::min(cell.min_y, y);
+          cell.max_y = std::max(cell.max_y, y);
+        }
+      }
+
+      struct UpdateBody {
+        UpdateBody(DepthBackgroundModel& model, const boost::uint16_t* depth, bool learn, boost::uint8_t* mask)
+          : model_(model), depth_(depth), learn_(learn), mask_(mask) {}
+
+        void operator()(const tbb::blocked_range<int>& range) const {
+          for (int cy = range.begin(); cy != range.end(); ++cy) {
+            Cell* cells = &model_.cells_[size_t(cy) * model_.cells_x_];
+            for (int cx = 0; cx < model_.cells_x_; ++cx) {
+              Cell empty = { 0, model_.width_, model_.height_, -1, -1 };
+              cells[cx] = empty;
+            }
+            const int y1 = std::min((cy + 1) * CELL_SIZE, model_.height_);
+            for (int y = cy * CELL_SIZE; y < y1; ++y) {
+              model_.updateRow(depth_, y, learn_, mask_);
+              model_.countRow(mask_ + size_t(y) * model_.width_, y, cells);
+            }
+          }
+        }
+
+        DepthBackgroundModel& model_;
+        const boost::uint16_t* depth_;
+        bool learn_;
+        boost::uint8_t* mask_;
+      };
+
+      /** merge 8-connected occupied cells into boxes */
+      void collectBoxes(std::vector<ForegroundBox>& boxes) {
+        boxes.clear();
+        visited_.assign(cells_.size(), 0);
+        for (size_t start = 0; start < cells_.size(); ++start) {
+          if (visited_[start] || cells_[start].pixels < min_cell_pixels_)
+            continue;
+          ForegroundBox box = { width_, height_, -1, -1, 0 };
+          stack_.assign(1, int(start));
+          visited_[start] = 1;
+          while (!stack_.empty()) {
+            const int c = stack_.back();
+            stack_.pop_back();
+            const Cell& cell = cells_[c];
+            box.min_x = std::min(box.min_x, cell.min_x);
+            box.min_y = std::min(box.min_y, cell.min_y);
+            box.max_x = std::max(box.max_x, cell.max_x);
+            box.max_y = std::max(box.max_y, cell.max_y);
+            box.pixels += cell.pixels;
+            const int cx = c % cells_x_;
+            const int cy = c / cells_x_;
+            for (int ny = std::max(cy - 1, 0); ny <= std::min(cy + 1, cells_y_ - 1); ++ny)
+              for (int nx = std::max(cx - 1, 0); nx <= std::min(cx + 1, cells_x_ - 1); ++nx) {
+                const int n = ny * cells_x_ + nx;
+                if (!visited_[n] && cells_[n].pixels >= min_cell_pixels_) {
+                  visited_[n] = 1;
+                  stack_.push_back(n);
+                }
+              }
+          }
+          if (box.pixels >= min_box_pixels_)
+            boxes.push_back(box);
+        }
+      }
+
+      int width_;
+      int height_;
+      unsigned tolerance_;
+      unsigned max_confidence_;
+      unsigned min_confidence_;
+      unsigned min_cell_pixels_;
+      unsigned min_box_pixels_;
+
+      std::vector<boost::uint16_t> background_;
+      std::vector<boost::uint16_t> confidence_;
+
+      int cells_x_;
+      int cells_y_;
+      std::vector<Cell> cells_;
+      std::vector<unsigned char> visited_;
+      std::vector<int> stack_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: DEPTH_BACKGROUND_H4NC7PLX */
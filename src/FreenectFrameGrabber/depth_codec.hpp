@@ -0,0 +1,318 @@
+#ifndef DEPTH_CODEC_K3WQ8ZP1
+#define DEPTH_CODEC_K3WQ8ZP1
+
+#include <vector>
+#include <algorithm>
+#include <cstring>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+namespace freenect_camera {
+
+  /**
+   * Lossless codec for 16 bit depth frames.
+   *
+   * The frame is split into horizontal bands which are coded independently
+   * (and in parallel). Every pixel is predicted from its left neighbour (the
+   * first pixel of a row from the pixel above), the zigzag mapped residual is
+   * then written as a byte oriented token:
+   *
+   *   0x00..0x3F  run of 1..64 zero residuals (may span rows)
+   *   0x40..0x7F  single residual 1..64
+   *   0x80..0xFE  two byte residual up to 0x7EFF
+   *   0xFF        escape, followed by the absolute 16 bit pixel value
+   *
+   * Kinect depth is piecewise smooth with large invalid areas, so most pixels
+   * end up in runs or single byte tokens.
+   */
+
+  static const boost::uint32_t DEPTH_CODEC_MAGIC = 0x43444e46; // "FNDC"
+  static const boost::uint16_t DEPTH_CODEC_VERSION = 1;
+  static const int DEPTH_CODEC_BAND_ROWS = 16;
+
+  struct DepthCodecHeader {
+    boost::uint32_t magic;
+    boost::uint16_t version;
+    boost::uint16_t band_count;
+    boost::uint16_t width;
+    boost::uint16_t height;
+  };
+
+  namespace detail {
+
+    inline unsigned char* putResidualRun(unsigned char* out, unsigned run) {
+      while (run > 0) {
+        unsigned n = (run > 64) ? 64 : run;
+        *out++ = (unsigned char)(n - 1);
+        run -= n;
+      }
+      return out;
+    }
+
+    /** encode rows [row_begin, row_end) into out, returns end pointer */
+    inline unsigned char* encodeBand(const boost::uint16_t* depth, int width,
+        int row_begin, int row_end, unsigned char* out) {
+      unsigned run = 0;
+      for (int y = row_begin; y < row_end; ++y) {
+        const boost::uint16_t* row = depth + y * width;
+        for (int x = 0; x < width; ++x) {
+          int pred;
+          if (x > 0)
+            pred = row[x - 1];
+          else if (y > row_begin)
+            pred = row[x - width];
+          else
+            pred = 0;
+
+          int r = int(row[x]) - pred;
+          unsigned z = (r >= 0) ? (unsigned(r) << 1) : ((unsigned(-r) << 1) - 1);
+          if (z == 0) {
+            ++run;
+            continue;
+          }
+          if (run) {
+            out = putResidualRun(out, run);
+            run = 0;
+          }
+          if (z <= 64) {
+            *out++ = (unsigned char)(0x3F + z);
+          } else if (z <= 0x7EFF) {
+            *out++ = (unsigned char)(0x80 + (z >> 8));
+            *out++ = (unsigned char)(z & 0xFF);
+          } else {
+            *out++ = 0xFF;
+            *out++ = (unsigned char)(row[x] & 0xFF);
+            *out++ = (unsigned char)(row[x] >> 8);
+          }
+        }
+      }
+      return putResidualRun(out, run);
+    }
+
+    /** decode rows [row_begin, row_end), returns false on corrupt input */
+    inline bool decodeBand(const unsigned char* in, const unsigned char* in_end,
+        int width, int row_begin, int row_end, boost::uint16_t* depth) {
+      boost::uint16_t* dst = depth + row_begin * width;
+      const int count = (row_end - row_begin) * width;
+      int i = 0;
+      while (i < count) {
+        if (in >= in_end)
+          return false;
+        unsigned b = *in++;
+        unsigned run = 1;
+        unsigned z = 0;
+        bool absolute = false;
+        if (b < 0x40) {
+          run = b + 1;
+        } else if (b < 0x80) {
+          z = b - 0x3F;
+        } else if (b < 0xFF) {
+          if (in >= in_end)
+            return false;
+          z = ((b - 0x80) << 8) | *in++;
+        } else {
+          if (in_end - in < 2)
+            return false;
+          z = in[0] | (unsigned(in[1]) << 8);
+          in += 2;
+          absolute = true;
+        }
+        if (i + int(run) > count)
+          return false;
+        for (unsigned k = 0; k < run; ++k, ++i) {
+          const int x = i % width;
+          int pred;
+          if (x > 0)
+            pred = dst[i - 1];
+          else if (i >= width)
+            pred = dst[i - width];
+          else
+            pred = 0;
+          if (absolute) {
+            dst[i] = (boost::uint16_t)z;
+          } else {
+            int r = (z & 1) ? -int((z + 1) >> 1) : int(z >> 1);
+            dst[i] = (boost::uint16_t)(pred + r);
+          }
+        }
+      }
+      return in == in_end;
+    }
+
+  } // namespace detail
+
+  /**
+   * \class DepthEncoder
+   *
+   * \brief Encodes depth frames band-parallel. Scratch memory is kept
+   * between frames, so steady state encoding does not allocate.
+   */
+  class DepthEncoder {
+    public:
+
+      /**
+       * Encode a frame into the internal scratch buffer.
+       * Returns the size of the complete compressed frame, which must then
+       * be copied out using write().
+       */
+      size_t encode(const boost::uint16_t* depth, int width, int height) {
+        width_ = width;
+        height_ = height;
+        const int bands = (height + DEPTH_CODEC_BAND_ROWS - 1) / DEPTH_CODEC_BAND_ROWS;
+        band_stride_ = size_t(DEPTH_CODEC_BAND_ROWS) * width * 3;
+        scratch_.resize(band_stride_ * bands);
+        band_sizes_.resize(bands);
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, bands),
+            EncodeBody(*this, depth));
+
+        size_t total = sizeof(DepthCodecHeader) + (bands + 1) * sizeof(boost::uint32_t);
+        for (int b = 0; b < bands; ++b)
+          total += band_sizes_[b];
+        return total;
+      }
+
+      /** write the frame produced by the last encode() call to dst */
+      void write(unsigned char* dst) const {
+        const int bands = int(band_sizes_.size());
+        DepthCodecHeader header;
+        header.magic = DEPTH_CODEC_MAGIC;
+        header.version = DEPTH_CODEC_VERSION;
+        header.band_count = (boost::uint16_t)bands;
+        header.width = (boost::uint16_t)width_;
+        header.height = (boost::uint16_t)height_;
+        memcpy(dst, &header, sizeof(header));
+        dst += sizeof(header);
+
+        boost::uint32_t offset = 0;
+        for (int b = 0; b <= bands; ++b) {
+          memcpy(dst, &offset, sizeof(offset));
+          dst += sizeof(offset);
+          if (b < bands)
+            offset += boost::uint32_t(band_sizes_[b]);
+        }
+        for (int b = 0; b < bands; ++b) {
+          memcpy(dst, &scratch_[b * band_stride_], band_sizes_[b]);
+          dst += band_sizes_[b];
+        }
+      }
+
+    private:
+
+      struct EncodeBody {
+        EncodeBody(DepthEncoder& encoder, const boost::uint16_t* depth)
+          : encoder_(encoder), depth_(depth) {}
+
+        void operator()(const tbb::blocked_range<int>& range) const {
+          for (int b = range.begin(); b != range.end(); ++b) {
+            const int row_begin = b * DEPTH_CODEC_BAND_ROWS;
+            const int row_end = std::min(row_begin + DEPTH_CODEC_BAND_ROWS, encoder_.height_);
+            unsigned char* out = &encoder_.scratch_[b * encoder_.band_stride_];
+            unsigned char* end = detail::encodeBand(depth_, encoder_.width_,
+                row_begin, row_end, out);
+            encoder_.band_sizes_[b] = size_t(end - out);
+          }
+        }
+
+        DepthEncoder& encoder_;
+        const boost::uint16_t* depth_;
+      };
+
+      int width_;
+      int height_;
+      size_t band_stride_;
+      std::vector<unsigned char> scratch_;
+      std::vector<size_t> band_sizes_;
+  };
+
+  /**
+   * Read the frame dimensions of a compressed depth frame.
+   */
+  inline bool readDepthCodecHeader(const unsigned char* src, size_t size,
+      int& width, int& height) {
+    if (size < sizeof(DepthCodecHeader))
+      return false;
+    DepthCodecHeader header;
+    memcpy(&header, src, sizeof(header));
+    if (header.magic != DEPTH_CODEC_MAGIC || header.version != DEPTH_CODEC_VERSION)
+      return false;
+    width = header.width;
+    height = header.height;
+    return true;
+  }
+
+  /**
+   * \class DepthDecoder
+   *
+   * \brief Decodes frames produced by DepthEncoder, band-parallel.
+   */
+  class DepthDecoder {
+    public:
+
+      /**
+       * Decode a compressed frame into dst, which must hold width * height
+       * pixels as reported by readDepthCodecHeader(). Returns false if the
+       * input is truncated or corrupt.
+       */
+      bool decode(const unsigned char* src, size_t size, boost::uint16_t* dst) {
+        int width, height;
+        if (!readDepthCodecHeader(src, size, width, height))
+          return false;
+        DepthCodecHeader header;
+        memcpy(&header, src, sizeof(header));
+
+        const int bands = header.band_count;
+        if (bands != (height + DEPTH_CODEC_BAND_ROWS - 1) / DEPTH_CODEC_BAND_ROWS)
+          return false;
+        const size_t table = sizeof(header) + (bands + 1) * sizeof(boost::uint32_t);
+        if (size < table)
+          return false;
+
+        offsets_.resize(bands + 1);
+        memcpy(&offsets_[0], src + sizeof(header), (bands + 1) * sizeof(boost::uint32_t));
+        if (offsets_[bands] != size - table)
+          return false;
+        for (int b = 0; b < bands; ++b)
+          if (offsets_[b] > offsets_[b + 1])
+            return false;
+
+        failed_ = false;
+        tbb::parallel_for(tbb::blocked_range<int>(0, bands),
+            DecodeBody(*this, src + table, width, height, dst));
+        return !failed_;
+      }
+
+    private:
+
+      struct DecodeBody {
+        DecodeBody(DepthDecoder& decoder, const unsigned char* payload,
+            int width, int height, boost::uint16_t* dst)
+          : decoder_(decoder), payload_(payload), width_(width), height_(height), dst_(dst) {}
+
+        void operator()(const tbb::blocked_range<int>& range) const {
+          for (int b = range.begin(); b != range.end(); ++b) {
+            const int row_begin = b * DEPTH_CODEC_BAND_ROWS;
+            const int row_end = std::min(row_begin + DEPTH_CODEC_BAND_ROWS, height_);
+            if (!detail::decodeBand(payload_ + decoder_.offsets_[b],
+                  payload_ + decoder_.offsets_[b + 1], width_, row_begin, row_end, dst_))
+              decoder_.failed_ = true;
+          }
+        }
+
+        DepthDecoder& decoder_;
+        const unsigned char* payload_;
+        int width_;
+        int height_;
+        boost::uint16_t* dst_;
+      };
+
+      std::vector<boost::uint32_t> offsets_;
+      boost::atomic<bool> failed_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: DEPTH_CODEC_K3WQ8ZP1 */
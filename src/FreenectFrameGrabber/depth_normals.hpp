@@ -0,0 +1,214 @@
+#ifndef DEPTH_NORMALS_Q8VM3KTD
+#define DEPTH_NORMALS_Q8VM3KTD
+
+#include <vector>
+#include <cmath>
+#include <limits>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+namespace freenect_camera {
+
+  /**
+   * \class DepthNormalEstimator
+   *
+   * \brief Organized surface normals of a depth frame in millimetres.
+   *
+   * Every pixel is back-projected and summed up in an integral image, so the
+   * mean 3D point of any window costs four lookups. The horizontal tangent
+   * is the difference of the mean points right and left of a pixel, the
+   * vertical tangent the one below and above it, the normal their cross
+   * product. The cost per pixel does not depend on the window size.
+   *
+   * Pixels without depth, with too few valid neighbours or next to a depth
+   * discontinuity get the normal (0, 0, 0). Normals point towards the camera.
+   */
+  class DepthNormalEstimator {
+    public:
+
+      DepthNormalEstimator()
+        : radius_(5), max_depth_change_(0.02f) {}
+
+      /** half size of the smoothing window in pixels */
+      void setSmoothingRadius(int radius) { radius_ = std::max(1, radius); }
+
+      /**
+       * Maximum depth change between neighbouring pixels relative to the
+       * depth, larger changes are treated as discontinuities.
+       */
+      void setMaxDepthChange(float relative) { max_depth_change_ = relative; }
+
+      /**
+       * Compute the normals of a frame, normals must hold 3 floats per pixel.
+       * Depth is in millimetres, 0 marks missing values.
+       */
+      void compute(const boost::uint16_t* depth, int width, int height,
+          float focal_length, float* normals) {
+        width_ = width;
+        height_ = height;
+        inv_focal_ = 1.0 / focal_length;
+        integral_.resize(size_t(width + 1) * (height + 1));
+        // the first row and column stay zero
+        std::fill(integral_.begin(), integral_.begin() + width + 1, Sum());
+
+        tbb::parallel_for(tbb::blocked_range<int>(0, height),
+            RowSumBody(*this, depth));
+        tbb::parallel_for(tbb::blocked_range<int>(1, width + 1, 64),
+            ColumnSumBody(*this));
+        tbb::parallel_for(tbb::blocked_range<int>(0, height),
+            NormalBody(*this, depth, normals));
+      }
+
+    private:
+
+      struct Sum {
+        Sum() : x(0), y(0), z(0), n(0) {}
+        double x;
+        double y;
+        double z;
+        double n;
+      };
+
+      Sum& at(int x, int y) {
+        return integral_[size_t(y) * (width_ + 1) + x];
+      }
+
+      /** mean point of the pixels in [x0, x1) x [y0, y1), clipped to the image */
+      bool boxMean(int x0, int y0, int x1, int y1, double* mean) {
+        x0 = std::max(x0, 0);
+        y0 = std::max(y0, 0);
+        x1 = std::min(x1, width_);
+        y1 = std::min(y1, height_);
+        if (x0 >= x1 || y0 >= y1)
+          return false;
+        const Sum& a = at(x0, y0);
+        const Sum& b = at(x1, y0);
+        const Sum& c = at(x0, y1);
+        const Sum& d = at(x1, y1);
+        const double n = d.n - b.n - c.n + a.n;
+        // require half of the window to be valid
+        if (2 * n < double(x1 - x0) * (y1 - y0))
+          return false;
+        mean[0] = (d.x - b.x - c.x + a.x) / n;
+        mean[1] = (d.y - b.y - c.y + a.y) / n;
+        mean[2] = (d.z - b.z - c.z + a.z) / n;
+        return true;
+      }
+
+      struct RowSumBody {
+        RowSumBody(DepthNormalEstimator& est, const boost::uint16_t* depth)
+          : est_(est), depth_(depth) {}
+
+        void operator()(const tbb::blocked_range<int>& range) const {
+          const double cx = 0.5 * (est_.width_ - 1);
+          const double cy = 0.5 * (est_.height_ - 1);
+          for (int y = range.begin(); y != range.end(); ++y) {
+            const boost::uint16_t* row = depth_ + y * est_.width_;
+            Sum* out = &est_.at(0, y + 1);
+            Sum acc;
+            out[0] = acc;
+            const double fy = (y - cy) * est_.inv_focal_;
+            for (int x = 0; x < est_.width_; ++x) {
+              if (row[x]) {
+                const double z = row[x] * 0.001;
+                acc.x += (x - cx) * est_.inv_focal_ * z;
+                acc.y += fy * z;
+                acc.z += z;
+                acc.n += 1;
+              }
+              out[x + 1] = acc;
+            }
+          }
+        }
+
+        DepthNormalEstimator& est_;
+        const boost::uint16_t* depth_;
+      };
+
+      struct ColumnSumBody {
+        explicit ColumnSumBody(DepthNormalEstimator& est) : est_(est) {}
+
+        void operator()(const tbb::blocked_range<int>& range) const {
+          for (int y = 2; y <= est_.height_; ++y) {
+            Sum* prev = &est_.at(0, y - 1);
+            Sum* cur = &est_.at(0, y);
+            for (int x = range.begin(); x != range.end(); ++x) {
+              cur[x].x += prev[x].x;
+              cur[x].y += prev[x].y;
+              cur[x].z += prev[x].z;
+              cur[x].n += prev[x].n;
+            }
+          }
+        }
+
+        DepthNormalEstimator& est_;
+      };
+
+      struct NormalBody {
+        NormalBody(DepthNormalEstimator& est, const boost::uint16_t* depth, float* normals)
+          : est_(est), depth_(depth), normals_(normals) {}
+
+        void operator()(const tbb::blocked_range<int>& range) const {
+          const int r = est_.radius_;
+          // the half windows are centered (r + 1) / 2 pixels away
+          const double max_change = est_.max_depth_change_ * 0.5 * (r + 1);
+          const double cx = 0.5 * (est_.width_ - 1);
+          const double cy = 0.5 * (est_.height_ - 1);
+          for (int y = range.begin(); y != range.end(); ++y) {
+            const boost::uint16_t* row = depth_ + y * est_.width_;
+            float* out = normals_ + size_t(y) * est_.width_ * 3;
+            for (int x = 0; x < est_.width_; ++x, out += 3) {
+              out[0] = out[1] = out[2] = 0.0f;
+              if (!row[x])
+                continue;
+              const double z = row[x] * 0.001;
+              double left[3], right[3], top[3], bottom[3];
+              if (!est_.boxMean(x - r, y - r, x, y + r + 1, left) ||
+                  !est_.boxMean(x + 1, y - r, x + r + 1, y + r + 1, right) ||
+                  !est_.boxMean(x - r, y - r, x + r + 1, y, top) ||
+                  !est_.boxMean(x - r, y + 1, x + r + 1, y + r + 1, bottom))
+                continue;
+
+              const double limit = max_change * z;
+              if (std::fabs(left[2] - z) > limit || std::fabs(right[2] - z) > limit ||
+                  std::fabs(top[2] - z) > limit || std::fabs(bottom[2] - z) > limit)
+                continue;
+
+              const double tx[3] = { right[0] - left[0], right[1] - left[1], right[2] - left[2] };
+              const double ty[3] = { bottom[0] - top[0], bottom[1] - top[1], bottom[2] - top[2] };
+              double n[3] = {
+                tx[1] * ty[2] - tx[2] * ty[1],
+                tx[2] * ty[0] - tx[0] * ty[2],
+                tx[0] * ty[1] - tx[1] * ty[0] };
+              const double norm = std::sqrt(n[0] * n[0] + n[1] * n[1] + n[2] * n[2]);
+              if (norm < std::numeric_limits<double>::epsilon())
+                continue;
+              // flip normals facing away from the camera
+              const double facing = n[0] * (x - cx) * est_.inv_focal_ + n[1] * (y - cy) * est_.inv_focal_ + n[2];
+              const double s = (facing > 0 ? -1.0 : 1.0) / norm;
+              out[0] = float(n[0] * s);
+              out[1] = float(n[1] * s);
+              out[2] = float(n[2] * s);
+            }
+          }
+        }
+
+        DepthNormalEstimator& est_;
+        const boost::uint16_t* depth_;
+        float* normals_;
+      };
+
+      int radius_;
+      float max_depth_change_;
+      int width_;
+      int height_;
+      double inv_focal_;
+      std::vector<Sum> integral_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: DEPTH_NORMALS_Q8VM3KTD */
@@ -0,0 +1,353 @@
+#ifndef DEPTH_PLANE_T6WR2KJA
+#define DEPTH_PLANE_T6WR2KJA
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+namespace freenect_camera {
+
+  /**
+   * \class DepthPlaneRemover
+   *
+   * \brief Finds the dominant plane of a depth frame in millimetres, like a
+   * floor or a table, and removes its pixels.
+   *
+   * The plane is estimated on a decimated grid of back-projected points. The
+   * plane of the previous frame is refitted to its inliers first, then a
+   * fixed number of RANSAC hypotheses from three random grid points compete
+   * with it, so the cost per frame does not depend on the scene. The best
+   * plane is refined by least squares on its inliers. With a gravity
+   * direction, hypotheses tilted further from the horizontal than the
+   * maximum tilt are rejected.
+   *
+   * Planes are (nx, ny, nz, d) with n.p + d = 0 for points p on the plane in
+   * metres, in camera coordinates (x right, y down, z forward). The normal
+   * points towards the camera, so d > 0.
+   */
+  class DepthPlaneRemover {
+    public:
+
+      DepthPlaneRemover()
+        : grid_step_(8), iterations_(64), threshold_(0.02), min_inlier_ratio_(0.1)
+        , cos_max_tilt_(std::cos(radians(20.0))), valid_(false), seed_(0x9E3779B9u) {
+        plane_[0] = plane_[1] = plane_[2] = plane_[3] = 0.0;
+      }
+
+      /** distance of the grid points in pixels */
+      void setGridStep(int step) { grid_step_ = std::max(1, step); }
+
+      /** RANSAC hypotheses per frame */
+      void setIterations(unsigned iterations) { iterations_ = iterations; }
+
+      /** maximum distance of a pixel from the plane in mm */
+      void setThreshold(double mm) { threshold_ = std::max(0.001, mm * 0.001); }
+
+      /** fraction of the valid grid points the plane must hold */
+      void setMinInlierRatio(double ratio) { min_inlier_ratio_ = ratio; }
+
+      /** maximum angle between the plane normal and gravity in degrees */
+      void setMaxTilt(double degrees) { cos_max_tilt_ = std::cos(radians(degrees)); }
+
+      /** forget the plane of the previous frame */
+      void reset() { valid_ = false; }
+
+      /**
+       * Estimate the plane of a frame (depth in mm, 0 = missing) and copy
+       * the frame to out with the plane pixels set to 0. gravity is a vector
+       * along gravity in camera coordinates or NULL, its sign and length do
+       * not matter. Returns false if no plane was found, then out is a copy
+       * of depth and plane is left unchanged.
+       */
+      bool apply(const boost::uint16_t* depth, int width, int height, float focal_length,
+          const double* gravity, boost::uint16_t* out, double* plane) {
+        width_ = width;
+        height_ = height;
+        inv_focal_ = 1.0 / focal_length;
+        samplePoints(depth);
+
+        gravity_valid_ = false;
+        if (gravity) {
+          const double norm = std::sqrt(gravity[0] * gravity[0] + gravity[1] * gravity[1] + gravity[2] * gravity[2]);
+          if (norm > 0) {
+            for (int i = 0; i < 3; ++i)
+              gravity_[i] = gravity[i] / norm;
+            gravity_valid_ = true;
+          }
+        }
+
+        const size_t min_inliers = std::max< size_t >(3, size_t(min_inlier_ratio_ * points_.size()));
+        double best[4];
+        size_t best_inliers = 0;
+        tracked_ = false;
+        if (valid_ && points_.size() >= 3 && upright(plane_)) {
+          double refined[4];
+          if (fit(plane_, refined) && upright(refined)) {
+            best_inliers = countInliers(refined);
+            std::copy(refined, refined + 4, best);
+            tracked_ = best_inliers >= min_inliers;
+          }
+        }
+
+        for (unsigned i = 0; i < iterations_ && points_.size() >= 3; ++i) {
+          double hypothesis[4];
+          if (!sample(hypothesis) || !upright(hypothesis))
+            continue;
+          const size_t inliers = countInliers(hypothesis);
+          if (inliers > best_inliers) {
+            best_inliers = inliers;
+            std::copy(hypothesis, hypothesis + 4, best);
+            tracked_ = false;
+          }
+        }
+
+        if (best_inliers >= min_inliers) {
+          // two rounds, the first fit may still include points near the plane
+          for (int round = 0; round < 2; ++round) {
+            double refined[4];
+            if (fit(best, refined) && upright(refined))
+              std::copy(refined, refined + 4, best);
+          }
+          best_inliers = countInliers(best);
+        }
+        inlier_ratio_ = points_.empty() ? 0.0 : double(best_inliers) / points_.size();
+
+        valid_ = best_inliers >= min_inliers;
+        if (!valid_) {
+          std::copy(depth, depth + size_t(width) * height, out);
+          return false;
+        }
+
+        std::copy(best, best + 4, plane_);
+        std::copy(best, best + 4, plane);
+        tbb::parallel_for(tbb::blocked_range<int>(0, height), MaskBody(*this, depth, out));
+        return true;
+      }
+
+      /** was the plane of the last frame tracked from the frame before? */
+      bool tracked() const { return tracked_; }
+
+      /** fraction of the grid points on the plane of the last frame */
+      double inlierRatio() const { return inlier_ratio_; }
+
+    private:
+
+      static double radians(double degrees) {
+        return degrees * 3.14159265358979323846 / 180.0;
+      }
+
+      struct Point {
+        double x;
+        double y;
+        double z;
+      };
+
+      void samplePoints(const boost::uint16_t* depth) {
+        points_.clear();
+        const double cx = 0.5 * (width_ - 1);
+        const double cy = 0.5 * (height_ - 1);
+        for (int y = grid_step_ / 2; y < height_; y += grid_step_) {
+          const boost::uint16_t* row = depth + size_t(y) * width_;
+          for (int x = grid_step_ / 2; x < width_; x += grid_step_) {
+            if (!row[x])
+              continue;
+            Point p;
+            p.z = row[x] * 0.001;
+            p.x = (x - cx) * inv_focal_ * p.z;
+            p.y = (y - cy) * inv_focal_ * p.z;
+            points_.push_back(p);
+          }
+        }
+      }
+
+      /** xorshift, deterministic so the same frames give the same planes */
+      boost::uint32_t random() {
+        seed_ ^= seed_ << 13;
+        seed_ ^= seed_ >> 17;
+        seed_ ^= seed_ << 5;
+        return seed_;
+      }
+
+      /** plane through three random grid points */
+      bool sample(double* plane) {
+        const size_t n = points_.size();
+        const Point& a = points_[random() % n];
+        const Point& b = points_[random() % n];
+        const Point& c = points_[random() % n];
+        const double u[3] = { b.x - a.x, b.y - a.y, b.z - a.z };
+        const double v[3] = { c.x - a.x, c.y - a.y, c.z - a.z };
+        plane[0] = u[1] * v[2] - u[2] * v[1];
+        plane[1] = u[2] * v[0] - u[0] * v[2];
+        plane[2] = u[0] * v[1] - u[1] * v[0];
+        // also rejects repeated and collinear points
+        const double norm = std::sqrt(plane[0] * plane[0] + plane[1] * plane[1] + plane[2] * plane[2]);
+        if (norm < 1e-9)
+          return false;
+        for (int i = 0; i < 3; ++i)
+          plane[i] /= norm;
+        plane[3] = -(plane[0] * a.x + plane[1] * a.y + plane[2] * a.z);
+        orient(plane);
+        return true;
+      }
+
+      /** the normal points towards the camera */
+      static void orient(double* plane) {
+        if (plane[3] < 0)
+          for (int i = 0; i < 4; ++i)
+            plane[i] = -plane[i];
+      }
+
+      /** is the plane horizontal enough, always true without gravity */
+      bool upright(const double* plane) const {
+        if (!gravity_valid_)
+          return true;
+        return std::fabs(plane[0] * gravity_[0] + plane[1] * gravity_[1] + plane[2] * gravity_[2]) >= cos_max_tilt_;
+      }
+
+      size_t countInliers(const double* plane) const {
+        size_t inliers = 0;
+        for (std::vector<Point>::const_iterator p = points_.begin(); p != points_.end(); ++p)
+          if (std::fabs(plane[0] * p->x + plane[1] * p->y + plane[2] * p->z + plane[3]) < threshold_)
+            ++inliers;
+        return inliers;
+      }
+
+      /** least squares plane of the inliers of plane */
+      bool fit(const double* plane, double* refined) const {
+        double sum[3] = { 0, 0, 0 };
+        double products[6] = { 0, 0, 0, 0, 0, 0 };
+        size_t n = 0;
+        for (std::vector<Point>::const_iterator p = points_.begin(); p != points_.end(); ++p) {
+          if (std::fabs(plane[0] * p->x + plane[1] * p->y + plane[2] * p->z + plane[3]) >= threshold_)
+            continue;
+          sum[0] += p->x;
+          sum[1] += p->y;
+          sum[2] += p->z;
+          products[0] += p->x * p->x;
+          products[1] += p->x * p->y;
+          products[2] += p->x * p->z;
+          products[3] += p->y * p->y;
+          products[4] += p->y * p->z;
+          products[5] += p->z * p->z;
+          ++n;
+        }
+        if (n < 3)
+          return false;
+
+        const double mean[3] = { sum[0] / n, sum[1] / n, sum[2] / n };
+        double covariance[3][3];
+        covariance[0][0] = products[0] / n - mean[0] * mean[0];
+        covariance[0][1] = covariance[1][0] = products[1] / n - mean[0] * mean[1];
+        covariance[0][2] = covariance[2][0] = products[2] / n - mean[0] * mean[2];
+        covariance[1][1] = products[3] / n - mean[1] * mean[1];
+        covariance[1][2] = covariance[2][1] = products[4] / n - mean[1] * mean[2];
+        covariance[2][2] = products[5] / n - mean[2] * mean[2];
+
+        smallestEigenvector(covariance, refined);
+        refined[3] = -(refined[0] * mean[0] + refined[1] * mean[1] + refined[2] * mean[2]);
+        orient(refined);
+        return true;
+      }
+
+      /** eigenvector of the smallest eigenvalue of a symmetric matrix, Jacobi rotations */
+      static void smallestEigenvector(double a[3][3], double* vector) {
+        double v[3][3] = { { 1, 0, 0 }, { 0, 1, 0 }, { 0, 0, 1 } };
+        for (int sweep = 0; sweep < 16; ++sweep) {
+          const double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+          if (off < 1e-30)
+            break;
+          for (int p = 0; p < 2; ++p) {
+            for (int q = p + 1; q < 3; ++q) {
+              if (a[p][q] == 0)
+                continue;
+              const double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+              const double t = (theta >= 0 ? 1.0 : -1.0) / (std::fabs(theta) + std::sqrt(theta * theta + 1));
+              const double c = 1 / std::sqrt(t * t + 1);
+              const double s = t * c;
+              for (int k = 0; k < 3; ++k) {
+                const double akp = a[k][p];
+                const double akq = a[k][q];
+                a[k][p] = c * akp - s * akq;
+                a[k][q] = s * akp + c * akq;
+              }
+              for (int k = 0; k < 3; ++k) {
+                const double apk = a[p][k];
+                const double aqk = a[q][k];
+                a[p][k] = c * apk - s * aqk;
+                a[q][k] = s * apk + c * aqk;
+              }
+              for (int k = 0; k < 3; ++k) {
+                const double vkp = v[k][p];
+                const double vkq = v[k][q];
+                v[k][p] = c * vkp - s * vkq;
+                v[k][q] = s * vkp + c * vkq;
+              }
+            }
+          }
+        }
+        int smallest = 0;
+        for (int i = 1; i < 3; ++i)
+          if (a[i][i] < a[smallest][smallest])
+            smallest = i;
+        for (int k = 0; k < 3; ++k)
+          vector[k] = v[k][smallest];
+      }
+
+      struct MaskBody {
+        MaskBody(const DepthPlaneRemover& remover, const boost::uint16_t* depth, boost::uint16_t* out)
+          : remover_(remover), depth_(depth), out_(out) {}
+
+        void operator()(const tbb::blocked_range<int>& range) const {
+          const double* plane = remover_.plane_;
+          const int width = remover_.width_;
+          const double inv_focal = remover_.inv_focal_;
+          const double cx = 0.5 * (width - 1);
+          const double cy = 0.5 * (remover_.height_ - 1);
+          // the distance of a pixel is z * (nx * (x - cx) / f + ny * (y - cy) / f + nz) + d,
+          // the term in brackets grows linearly along a row; z is in mm
+          const double step = plane[0] * inv_focal * 0.001;
+          const double threshold = remover_.threshold_;
+          for (int y = range.begin(); y != range.end(); ++y) {
+            const boost::uint16_t* row = depth_ + size_t(y) * width;
+            boost::uint16_t* out = out_ + size_t(y) * width;
+            double slope = (plane[1] * (y - cy) * inv_focal + plane[2]) * 0.001 - cx * step;
+            for (int x = 0; x < width; ++x, slope += step) {
+              const boost::uint16_t z = row[x];
+              out[x] = z && std::fabs(z * slope + plane[3]) < threshold ? 0 : z;
+            }
+          }
+        }
+
+        const DepthPlaneRemover& remover_;
+        const boost::uint16_t* depth_;
+        boost::uint16_t* out_;
+      };
+
+      int grid_step_;
+      unsigned iterations_;
+      // m
+      double threshold_;
+      double min_inlier_ratio_;
+      double cos_max_tilt_;
+
+      bool valid_;
+      bool tracked_;
+      double inlier_ratio_;
+      double plane_[4];
+      boost::uint32_t seed_;
+
+      int width_;
+      int height_;
+      double inv_focal_;
+      bool gravity_valid_;
+      double gravity_[3];
+      std::vector<Point> points_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: DEPTH_PLANE_T6WR2KJA */
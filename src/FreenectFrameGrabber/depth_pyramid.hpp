@@ -0,0 +1,156 @@
+#ifndef DEPTH_PYRAMID_B6RZ2HWN
+#define DEPTH_PYRAMID_B6RZ2HWN
+
+#include <algorithm>
+#include <cstring>
+#include <boost/cstdint.hpp>
+
+#include <tbb/parallel_for.h>
+#include <tbb/blocked_range.h>
+
+namespace freenect_camera {
+
+  /**
+   * \class DepthPyramidBuilder
+   *
+   * \brief Builds a depth pyramid packed into a single image.
+   *
+   * The packed image is one and a half times as wide as the frame. Level 0
+   * (the frame) is on the left, the levels 1, 2, ... are stacked top to
+   * bottom on the right:
+   *
+   *   +--------+----+
+   *   |        | 1  |
+   *   |   0    +--+-+
+   *   |        |2 |
+   *   |        +-++
+   *   |        |3|
+   *   +--------+-+
+   *
+   * Every pixel of a level is built from 2x2 pixels of the level above.
+   * Missing depth (0) is ignored, and only the samples within the edge
+   * threshold of the nearest sample are averaged, so foreground and
+   * background are never mixed. The frame is processed in horizontal strips
+   * which produce all levels at once while the rows are still in cache.
+   */
+  class DepthPyramidBuilder {
+    public:
+
+      static const int MAX_LEVELS = 4;
+
+      DepthPyramidBuilder()
+        : levels_(4), edge_threshold_(0.05f) {}
+
+      /** number of levels including the frame itself, 2 to MAX_LEVELS */
+      void setLevels(int levels) { levels_ = std::max(2, std::min(levels, int(MAX_LEVELS))); }
+      int levels() const { return levels_; }
+
+      /** depth differences above this fraction of the depth are edges */
+      void setEdgeThreshold(float relative) { edge_threshold_ = relative; }
+
+      /** size of the packed image for a frame */
+      static void packedSize(int width, int height, int& packed_width, int& packed_height) {
+        packed_width = width + width / 2;
+        packed_height = height;
+      }
+
+      /** position and size of a level in the packed image */
+      static void levelRect(int level, int width, int height, int& x, int& y, int& w, int& h) {
+        x = level == 0 ? 0 : width;
+        y = 0;
+        w = width;
+        h = height;
+        for (int l = 1; l <= level; ++l) {
+          if (l > 1)
+            y += h;
+          w /= 2;
+          h /= 2;
+        }
+      }
+
+      /**
+       * Build the pyramid of a frame into dst, which must have the packed
+       * size. stride is the row length of dst in pixels.
+       */
+      void build(const boost::uint16_t* depth, int width, int height,
+          boost::uint16_t* dst, size_t stride) {
+        for (int l = 0; l < levels_; ++l) {
+          levelRect(l, width, height, level_x_[l], level_y_[l], level_w_[l], level_h_[l]);
+          level_data_[l] = dst + level_y_[l] * stride + level_x_[l];
+        }
+        stride_ = stride;
+
+        // level 0 and the unused area
+        for (int y = 0; y < height; ++y) {
+          memcpy(dst + y * stride, depth + y * width, width * sizeof(boost::uint16_t));
+          memset(dst + y * stride + width, 0, (width / 2) * sizeof(boost::uint16_t));
+        }
+
+        // every strip produces one row of the coarsest level
+        const int top = levels_ - 1;
+        tbb::parallel_for(tbb::blocked_range<int>(0, level_h_[top]), StripBody(*this));
+
+        // rows left over when the height is not divisible by 2^top
+        for (int l = 1; l < levels_; ++l)
+          for (int r = level_h_[top] << (top - l); r < level_h_[l]; ++r)
+            downsampleRow(l, r);
+      }
+
+    private:
+
+      void downsampleRow(int level, int row) const {
+        const boost::uint16_t* a = level_data_[level - 1] + 2 * row * stride_;
+        const boost::uint16_t* b = a + stride_;
+        boost::uint16_t* out = level_data_[level] + row * stride_;
+        for (int x = 0; x < level_w_[level]; ++x)
+          out[x] = downsample(a[2 * x], a[2 * x + 1], b[2 * x], b[2 * x + 1]);
+      }
+
+      boost::uint16_t downsample(unsigned d0, unsigned d1, unsigned d2, unsigned d3) const {
+        // nearest valid sample
+        unsigned ref = 0xFFFF;
+        if (d0 && d0 < ref) ref = d0;
+        if (d1 && d1 < ref) ref = d1;
+        if (d2 && d2 < ref) ref = d2;
+        if (d3 && d3 < ref) ref = d3;
+        if (ref == 0xFFFF)
+          return 0;
+        const unsigned limit = ref + unsigned(ref * edge_threshold_);
+        unsigned sum = 0, n = 0;
+        if (d0 && d0 <= limit) { sum += d0; ++n; }
+        if (d1 && d1 <= limit) { sum += d1; ++n; }
+        if (d2 && d2 <= limit) { sum += d2; ++n; }
+        if (d3 && d3 <= limit) { sum += d3; ++n; }
+        return boost::uint16_t((sum + n / 2) / n);
+      }
+
+      struct StripBody {
+        explicit StripBody(const DepthPyramidBuilder& builder) : builder_(builder) {}
+
+        void operator()(const tbb::blocked_range<int>& range) const {
+          const int top = builder_.levels_ - 1;
+          for (int s = range.begin(); s != range.end(); ++s)
+            for (int l = 1; l <= top; ++l) {
+              const int rows = 1 << (top - l);
+              for (int r = s * rows; r < (s + 1) * rows; ++r)
+                builder_.downsampleRow(l, r);
+            }
+        }
+
+        const DepthPyramidBuilder& builder_;
+      };
+
+      int levels_;
+      float edge_threshold_;
+
+      size_t stride_;
+      boost::uint16_t* level_data_[MAX_LEVELS];
+      int level_x_[MAX_LEVELS];
+      int level_y_[MAX_LEVELS];
+      int level_w_[MAX_LEVELS];
+      int level_h_[MAX_LEVELS];
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: DEPTH_PYRAMID_B6RZ2HWN */
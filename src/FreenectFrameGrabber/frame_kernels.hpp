@@ -0,0 +1,367 @@
+#ifndef FRAME_KERNELS_W5HC2NRB
+#define FRAME_KERNELS_W5HC2NRB
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <boost/cstdint.hpp>
+#include <boost/array.hpp>
+#include <boost/noncopyable.hpp>
+
+#include <libfreenect.h>
+
+// vector variants are compiled for their instruction set only and chosen by
+// CPUID at run time, so the plugin runs on any x86
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define FREENECT_KERNEL_DISPATCH
+#define FREENECT_TARGET_SSE4 __attribute__((target("sse4.1")))
+#define FREENECT_TARGET_AVX2 __attribute__((target("avx2")))
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#include <immintrin.h>
+#define FREENECT_KERNEL_DISPATCH
+#define FREENECT_TARGET_SSE4
+#define FREENECT_TARGET_AVX2
+#endif
+
+namespace freenect_camera {
+
+  typedef enum {
+    KERNEL_SCALAR = 0,
+    KERNEL_SSE4 = 1,
+    KERNEL_AVX2 = 2,
+  } KernelVariant;
+
+  static const char* const KERNEL_VARIANT_NAMES[] = { "scalar", "SSE4", "AVX2" };
+
+  /** best variant the CPU and the operating system support */
+  inline KernelVariant detectKernelVariant() {
+#if defined(FREENECT_KERNEL_DISPATCH) && defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 0);
+    const int max_leaf = info[0];
+    __cpuid(info, 1);
+    const bool sse41 = (info[2] & (1 << 19)) != 0;
+    // AVX needs the OS to save the ymm registers
+    const bool avx = (info[2] & (1 << 27)) && (info[2] & (1 << 28)) && (_xgetbv(0) & 6) == 6;
+    bool avx2 = false;
+    if (avx && max_leaf >= 7) {
+      __cpuidex(info, 7, 0);
+      avx2 = (info[1] & (1 << 5)) != 0;
+    }
+    return avx2 ? KERNEL_AVX2 : (sse41 ? KERNEL_SSE4 : KERNEL_SCALAR);
+#elif defined(FREENECT_KERNEL_DISPATCH)
+    // CPUID, including the OS support check for AVX
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+      return KERNEL_AVX2;
+    if (__builtin_cpu_supports("sse4.1"))
+      return KERNEL_SSE4;
+    return KERNEL_SCALAR;
+#else
+    return KERNEL_SCALAR;
+#endif
+  }
+
+  /**
+   * Unpacking of the bit packed streams (FREENECT_VIDEO_IR_10BIT_PACKED,
+   * FREENECT_DEPTH_11BIT_PACKED and FREENECT_DEPTH_10BIT_PACKED) into 16 bit
+   * pixels. The device packs the pixels MSB first without padding, so 8
+   * pixels always take Bits bytes.
+   */
+  namespace detail {
+
+    template< int Bits >
+    inline void unpackScalar(const boost::uint8_t* src, boost::uint16_t* dst, int pixels) {
+      const boost::uint32_t mask = (1u << Bits) - 1;
+      boost::uint32_t buffer = 0;
+      int bits = 0;
+      for (int i = 0; i < pixels; ++i) {
+        while (bits < Bits) {
+          buffer = (buffer << 8) | *src++;
+          bits += 8;
+        }
+        bits -= Bits;
+        dst[i] = boost::uint16_t((buffer >> bits) & mask);
+      }
+    }
+
+    /** pixels of a group of 8 the vector loops can do without reading past the buffer */
+    template< int Bits >
+    inline int vectorPixels(int pixels, int groups_per_step) {
+      const int bytes = (pixels * Bits + 7) / 8;
+      if (bytes < 16)
+        return 0;
+      // every group is read with a 16 byte load
+      int groups = (bytes - 16) / Bits + 1;
+      groups -= groups % groups_per_step;
+      return groups * 8;
+    }
+
+#ifdef FREENECT_KERNEL_DISPATCH
+
+// the three bytes holding pixel i of a group, MSB first, in a 32 bit lane
+#define FREENECT_UNPACK_LANE(i) \
+    char((Bits * (i)) / 8 + 2), char((Bits * (i)) / 8 + 1), char((Bits * (i)) / 8), char(0x80)
+// left shift which moves the first bit of pixel i to bit 31 of the lane
+#define FREENECT_UNPACK_SHIFT(i) (8 + (Bits * (i)) % 8)
+
+    template< int Bits, int Pixels >
+    FREENECT_TARGET_SSE4 void unpackSSE4(const boost::uint8_t* src, boost::uint16_t* dst, int pixels) {
+      const int n = Pixels ? Pixels : pixels;
+      const int vector_pixels = vectorPixels< Bits >(n, 1);
+      const __m128i shuffle_lo = _mm_setr_epi8(FREENECT_UNPACK_LANE(0), FREENECT_UNPACK_LANE(1),
+          FREENECT_UNPACK_LANE(2), FREENECT_UNPACK_LANE(3));
+      const __m128i shuffle_hi = _mm_setr_epi8(FREENECT_UNPACK_LANE(4), FREENECT_UNPACK_LANE(5),
+          FREENECT_UNPACK_LANE(6), FREENECT_UNPACK_LANE(7));
+      // SSE has no per lane shift, multiply by powers of two instead
+      const __m128i scale_lo = _mm_setr_epi32(1 << FREENECT_UNPACK_SHIFT(0), 1 << FREENECT_UNPACK_SHIFT(1),
+          1 << FREENECT_UNPACK_SHIFT(2), 1 << FREENECT_UNPACK_SHIFT(3));
+      const __m128i scale_hi = _mm_setr_epi32(1 << FREENECT_UNPACK_SHIFT(4), 1 << FREENECT_UNPACK_SHIFT(5),
+          1 << FREENECT_UNPACK_SHIFT(6), 1 << FREENECT_UNPACK_SHIFT(7));
+      const boost::uint8_t* s = src;
+      for (int i = 0; i < vector_pixels; i += 8, s += Bits) {
+        const __m128i in = _mm_loadu_si128(reinterpret_cast< const __m128i* >(s));
+        __m128i lo = _mm_mullo_epi32(_mm_shuffle_epi8(in, shuffle_lo), scale_lo);
+        __m128i hi = _mm_mullo_epi32(_mm_shuffle_epi8(in, shuffle_hi), scale_hi);
+        lo = _mm_srli_epi32(lo, 32 - Bits);
+        hi = _mm_srli_epi32(hi, 32 - Bits);
+        _mm_storeu_si128(reinterpret_cast< __m128i* >(dst + i), _mm_packus_epi32(lo, hi));
+      }
+      unpackScalar< Bits >(s, dst + vector_pixels, n - vector_pixels);
+    }
+
+    template< int Bits, int Pixels >
+    FREENECT_TARGET_AVX2 void unpackAVX2(const boost::uint8_t* src, boost::uint16_t* dst, int pixels) {
+      const int n = Pixels ? Pixels : pixels;
+      const int vector_pixels = vectorPixels< Bits >(n, 2);
+      // every 128 bit lane unpacks one group
+      const __m256i shuffle_lo = _mm256_setr_epi8(FREENECT_UNPACK_LANE(0), FREENECT_UNPACK_LANE(1),
+          FREENECT_UNPACK_LANE(2), FREENECT_UNPACK_LANE(3), FREENECT_UNPACK_LANE(0), FREENECT_UNPACK_LANE(1),
+          FREENECT_UNPACK_LANE(2), FREENECT_UNPACK_LANE(3));
+      const __m256i shuffle_hi = _mm256_setr_epi8(FREENECT_UNPACK_LANE(4), FREENECT_UNPACK_LANE(5),
+          FREENECT_UNPACK_LANE(6), FREENECT_UNPACK_LANE(7), FREENECT_UNPACK_LANE(4), FREENECT_UNPACK_LANE(5),
+          FREENECT_UNPACK_LANE(6), FREENECT_UNPACK_LANE(7));
+      const __m256i shift_lo = _mm256_setr_epi32(FREENECT_UNPACK_SHIFT(0), FREENECT_UNPACK_SHIFT(1),
+          FREENECT_UNPACK_SHIFT(2), FREENECT_UNPACK_SHIFT(3), FREENECT_UNPACK_SHIFT(0), FREENECT_UNPACK_SHIFT(1),
+          FREENECT_UNPACK_SHIFT(2), FREENECT_UNPACK_SHIFT(3));
+      const __m256i shift_hi = _mm256_setr_epi32(FREENECT_UNPACK_SHIFT(4), FREENECT_UNPACK_SHIFT(5),
+          FREENECT_UNPACK_SHIFT(6), FREENECT_UNPACK_SHIFT(7), FREENECT_UNPACK_SHIFT(4), FREENECT_UNPACK_SHIFT(5),
+          FREENECT_UNPACK_SHIFT(6), FREENECT_UNPACK_SHIFT(7));
+      const boost::uint8_t* s = src;
+      for (int i = 0; i < vector_pixels; i += 16, s += 2 * Bits) {
+        const __m256i in = _mm256_inserti128_si256(_mm256_castsi128_si256(
+            _mm_loadu_si128(reinterpret_cast< const __m128i* >(s))),
+            _mm_loadu_si128(reinterpret_cast< const __m128i* >(s + Bits)), 1);
+        __m256i lo = _mm256_sllv_epi32(_mm256_shuffle_epi8(in, shuffle_lo), shift_lo);
+        __m256i hi = _mm256_sllv_epi32(_mm256_shuffle_epi8(in, shuffle_hi), shift_hi);
+        lo = _mm256_srli_epi32(lo, 32 - Bits);
+        hi = _mm256_srli_epi32(hi, 32 - Bits);
+        // packs within the lanes, which keeps the pixels of each group together
+        _mm256_storeu_si256(reinterpret_cast< __m256i* >(dst + i), _mm256_packus_epi32(lo, hi));
+      }
+      unpackScalar< Bits >(s, dst + vector_pixels, n - vector_pixels);
+    }
+
+#undef FREENECT_UNPACK_LANE
+#undef FREENECT_UNPACK_SHIFT
+
+#endif // FREENECT_KERNEL_DISPATCH
+
+  } // namespace detail
+
+  typedef void (*FrameKernelFunction)(const boost::uint8_t* src, boost::uint16_t* dst, int pixels);
+
+  /**
+   * Unpacks Bits bit pixels. Pixels is the frame size the kernel is
+   * specialized for, so the loop bounds are compile time constants, 0 takes
+   * the count passed at run time.
+   */
+  template< int Bits, int Pixels, KernelVariant Variant >
+  struct UnpackKernel {
+    static void run(const boost::uint8_t* src, boost::uint16_t* dst, int pixels) {
+      detail::unpackScalar< Bits >(src, dst, Pixels ? Pixels : pixels);
+    }
+  };
+
+#ifdef FREENECT_KERNEL_DISPATCH
+  template< int Bits, int Pixels >
+  struct UnpackKernel< Bits, Pixels, KERNEL_SSE4 > {
+    static void run(const boost::uint8_t* src, boost::uint16_t* dst, int pixels) {
+      detail::unpackSSE4< Bits, Pixels >(src, dst, pixels);
+    }
+  };
+
+  template< int Bits, int Pixels >
+  struct UnpackKernel< Bits, Pixels, KERNEL_AVX2 > {
+    static void run(const boost::uint8_t* src, boost::uint16_t* dst, int pixels) {
+      detail::unpackAVX2< Bits, Pixels >(src, dst, pixels);
+    }
+  };
+#endif
+
+  /** the conversion selected for a frame mode */
+  struct FrameKernel {
+    FrameKernel() : function(NULL), variant(KERNEL_SCALAR), pixels(0), bits(0) {}
+
+    /** NULL if the frame is copied as it is */
+    FrameKernelFunction function;
+    KernelVariant variant;
+    // frame size the kernel is specialized for, 0 for any
+    int pixels;
+    // significant bits of an unpacked pixel
+    int bits;
+  };
+
+  /**
+   * \class FrameKernelRegistry
+   *
+   * \brief Conversion kernels per input format and resolution.
+   *
+   * The kernels are looked up when the frame mode changes, not per frame.
+   * On first use the CPU is asked for the best instruction set. compare()
+   * checks the vector variants against the scalar kernel, the kernel test
+   * runs it on fixed and random frames.
+   */
+  class FrameKernelRegistry : public boost::noncopyable {
+    public:
+
+      static const FrameKernelRegistry& instance() {
+        static FrameKernelRegistry registry;
+        return registry;
+      }
+
+      /** instruction set the vector kernels use */
+      KernelVariant variant() const { return variant_; }
+
+      /**
+       * Run every registered vector variant the CPU supports on a frame
+       * filled with pattern, repeated as needed, and compare the result with
+       * the scalar kernel. Kernels for any frame size get generic_pixels.
+       * Returns the variants which differ.
+       */
+      std::vector< std::string > compare(const std::vector< boost::uint8_t >& pattern, int generic_pixels) const {
+        std::vector< std::string > failures;
+        if (pattern.empty())
+          return failures;
+        for (EntryMap::const_iterator it = entries_.begin(); it != entries_.end(); ++it) {
+          const int pixels = it->first.pixels ? it->first.pixels : generic_pixels;
+          const int bits = it->second[KERNEL_SCALAR].bits;
+          // the vector loops may read a 16 byte block up to the last byte
+          std::vector< boost::uint8_t > packed((pixels * bits + 7) / 8);
+          for (size_t i = 0; i < packed.size(); ++i)
+            packed[i] = pattern[i % pattern.size()];
+          const boost::uint8_t* src = packed.empty() ? NULL : &packed[0];
+          std::vector< boost::uint16_t > reference(pixels + 1, 0xFFFF), result(pixels + 1);
+          it->second[KERNEL_SCALAR].function(src, &reference[0], pixels);
+
+          for (int v = KERNEL_SCALAR + 1; v <= variant_; ++v) {
+            if (!it->second[v].function)
+              continue;
+            // the sentinel behind the frame catches writes past the end
+            std::fill(result.begin(), result.end(), 0xFFFF);
+            it->second[v].function(src, &result[0], pixels);
+            if (result != reference)
+              failures.push_back(describe(it->first, KernelVariant(v)));
+          }
+        }
+        return failures;
+      }
+
+      /**
+       * Kernel for frames of a mode, depth tells whether the mode is a depth
+       * mode. Formats which are not registered are copied.
+       */
+      FrameKernel select(const freenect_frame_mode& mode, bool depth) const {
+        FrameKernel kernel;
+        const int format = depth ? int(mode.depth_format) : int(mode.video_format);
+        const int pixels = mode.width * mode.height;
+        // the kernel specialized for the frame size, else the generic one
+        EntryMap::const_iterator it = entries_.find(key(depth, format, pixels));
+        if (it == entries_.end())
+          it = entries_.find(key(depth, format, 0));
+        if (it == entries_.end())
+          return kernel;
+        for (int v = variant_; v >= KERNEL_SCALAR; --v) {
+          if (it->second[v].function) {
+            kernel.function = it->second[v].function;
+            kernel.variant = KernelVariant(v);
+            kernel.pixels = it->first.pixels;
+            kernel.bits = it->second[v].bits;
+            break;
+          }
+        }
+        return kernel;
+      }
+
+    private:
+
+      struct Key {
+        bool depth;
+        int format;
+        int pixels;
+        bool operator<(const Key& other) const {
+          if (depth != other.depth)
+            return depth < other.depth;
+          if (format != other.format)
+            return format < other.format;
+          return pixels < other.pixels;
+        }
+      };
+
+      struct Entry {
+        Entry() : function(NULL), bits(0) {}
+        FrameKernelFunction function;
+        int bits;
+      };
+
+      typedef std::map< Key, boost::array< Entry, 3 > > EntryMap;
+
+      static Key key(bool depth, int format, int pixels) {
+        Key k;
+        k.depth = depth;
+        k.format = format;
+        k.pixels = pixels;
+        return k;
+      }
+
+      FrameKernelRegistry()
+        : variant_(detectKernelVariant()) {
+        add< 10, 0 >(false, FREENECT_VIDEO_IR_10BIT_PACKED);
+        add< 10, 640 * 488 >(false, FREENECT_VIDEO_IR_10BIT_PACKED);
+        add< 10, 1280 * 1024 >(false, FREENECT_VIDEO_IR_10BIT_PACKED);
+        add< 11, 0 >(true, FREENECT_DEPTH_11BIT_PACKED);
+        add< 11, 640 * 480 >(true, FREENECT_DEPTH_11BIT_PACKED);
+        add< 10, 0 >(true, FREENECT_DEPTH_10BIT_PACKED);
+        add< 10, 640 * 480 >(true, FREENECT_DEPTH_10BIT_PACKED);
+      }
+
+      template< int Bits, int Pixels >
+      void add(bool depth, int format) {
+        boost::array< Entry, 3 >& entry = entries_[key(depth, format, Pixels)];
+        entry[KERNEL_SCALAR].function = &UnpackKernel< Bits, Pixels, KERNEL_SCALAR >::run;
+#ifdef FREENECT_KERNEL_DISPATCH
+        entry[KERNEL_SSE4].function = &UnpackKernel< Bits, Pixels, KERNEL_SSE4 >::run;
+        entry[KERNEL_AVX2].function = &UnpackKernel< Bits, Pixels, KERNEL_AVX2 >::run;
+#endif
+        for (int v = KERNEL_SCALAR; v <= KERNEL_AVX2; ++v)
+          entry[v].bits = Bits;
+      }
+
+      static std::string describe(const Key& k, KernelVariant variant) {
+        std::string s(k.depth ? "depth format " : "video format ");
+        s += char('0' + k.format);
+        s += k.pixels ? " (frame size specialized) " : " ";
+        s += KERNEL_VARIANT_NAMES[variant];
+        return s;
+      }
+
+      KernelVariant variant_;
+      EntryMap entries_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: FRAME_KERNELS_W5HC2NRB */
@@ -0,0 +1,303 @@
+#ifndef FRAME_MEMORY_7VKQ2HXE
+#define FRAME_MEMORY_7VKQ2HXE
+
+#include <new>
+#include <vector>
+#include <string>
+#include <sstream>
+#include <cstring>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/weak_ptr.hpp>
+#include <boost/shared_array.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/thread/mutex.hpp>
+
+#if defined(__linux__)
+#include <sys/mman.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace freenect_camera {
+
+  /**
+   * Backing of frame buffers. Locked memory is mlock()ed and prefaulted, so
+   * the capture path does not page fault. Huge pages additionally need
+   * fewer TLB entries; without reserved huge pages transparent huge pages
+   * are requested, and without permission to lock the memory stays
+   * unlocked but prefaulted.
+   */
+  enum FrameMemoryMode {
+    FRAME_MEMORY_HEAP = 0,
+    FRAME_MEMORY_LOCKED,
+    FRAME_MEMORY_HUGEPAGES
+  };
+
+  /** memory of the frame buffers of a stream, in bytes */
+  struct MemoryAccount : public boost::noncopyable {
+    MemoryAccount()
+      : blocks(0), mapped(0), locked(0), huge(0), lock_failures(0), huge_fallbacks(0) {}
+
+    std::string summary() const {
+      std::ostringstream s;
+      s << blocks << " buffers, " << mapped / 1024 << " kB mapped, " << locked / 1024 << " kB locked, "
+        << huge / 1024 << " kB on huge pages";
+      if (lock_failures)
+        s << ", " << lock_failures << " buffers could not be locked";
+      if (huge_fallbacks)
+        s << ", " << huge_fallbacks << " buffers without reserved huge pages";
+      return s.str();
+    }
+
+    boost::atomic< unsigned long > blocks;
+    boost::atomic< boost::uint64_t > mapped;
+    // resident for sure, the rest may be paged out again
+    boost::atomic< boost::uint64_t > locked;
+    boost::atomic< boost::uint64_t > huge;
+    boost::atomic< unsigned long > lock_failures;
+    boost::atomic< unsigned long > huge_fallbacks;
+  };
+
+  namespace detail {
+
+    const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+    inline size_t pageSize() {
+#if defined(__linux__)
+      static const size_t size = size_t(sysconf(_SC_PAGESIZE));
+#elif defined(_WIN32)
+      SYSTEM_INFO info;
+      GetSystemInfo(&info);
+      const size_t size = info.dwPageSize;
+#else
+      const size_t size = 4096;
+#endif
+      return size;
+    }
+
+    inline size_t roundUp(size_t bytes, size_t alignment) {
+      return (bytes + alignment - 1) / alignment * alignment;
+    }
+
+    /** releases a block and takes it off the account */
+    struct FrameMemoryRelease {
+      FrameMemoryRelease(FrameMemoryMode mode, size_t size, bool locked, bool huge,
+          const boost::shared_ptr< MemoryAccount >& account)
+        : mode(mode), size(size), locked(locked), huge(huge), account(account) {}
+
+      void operator()(unsigned char* p) const {
+        if (!p)
+          return;
+        if (account) {
+          --account->blocks;
+          account->mapped -= size;
+          if (locked)
+            account->locked -= size;
+          if (huge)
+            account->huge -= size;
+        }
+        if (mode == FRAME_MEMORY_HEAP) {
+          delete[] p;
+          return;
+        }
+#if defined(__linux__)
+        if (locked)
+          munlock(p, size);
+        munmap(p, size);
+#elif defined(_WIN32)
+        if (locked)
+          VirtualUnlock(p, size);
+        VirtualFree(p, 0, MEM_RELEASE);
+#else
+        delete[] p;
+#endif
+      }
+
+      FrameMemoryMode mode;
+      size_t size;
+      bool locked;
+      bool huge;
+      boost::shared_ptr< MemoryAccount > account;
+    };
+
+  } /* end namespace detail */
+
+  /**
+   * Allocate a frame buffer of at least bytes with the given backing,
+   * falling back to weaker backings where the system does not permit it.
+   * Locked and huge page buffers are prefaulted. Throws std::bad_alloc if
+   * no memory could be mapped at all.
+   */
+  inline boost::shared_array< unsigned char > allocateFrameMemory(size_t bytes, FrameMemoryMode mode,
+      const boost::shared_ptr< MemoryAccount >& account = boost::shared_ptr< MemoryAccount >()) {
+    bytes = std::max< size_t >(bytes, 1);
+    unsigned char* p = NULL;
+    size_t size = bytes;
+    bool locked = false;
+    bool huge = false;
+
+#if defined(__linux__)
+    if (mode != FRAME_MEMORY_HEAP) {
+      if (mode == FRAME_MEMORY_HUGEPAGES) {
+        size = detail::roundUp(bytes, detail::HUGE_PAGE_SIZE);
+        void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (mapping != MAP_FAILED) {
+          p = static_cast< unsigned char* >(mapping);
+          huge = true;
+        } else if (account) {
+          // no reserved huge pages (vm.nr_hugepages), transparent huge pages may still apply
+          ++account->huge_fallbacks;
+        }
+      }
+      if (!p) {
+        size = detail::roundUp(bytes, mode == FRAME_MEMORY_HUGEPAGES ? detail::HUGE_PAGE_SIZE : detail::pageSize());
+        void* mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mapping == MAP_FAILED)
+          throw std::bad_alloc();
+        p = static_cast< unsigned char* >(mapping);
+#ifdef MADV_HUGEPAGE
+        if (mode == FRAME_MEMORY_HUGEPAGES)
+          madvise(p, size, MADV_HUGEPAGE);
+#endif
+      }
+      // locking faults the pages in, RLIMIT_MEMLOCK may forbid it
+      locked = mlock(p, size) == 0;
+    }
+#elif defined(_WIN32)
+    if (mode != FRAME_MEMORY_HEAP) {
+      // large pages need the SeLockMemoryPrivilege, they are never paged out
+      const SIZE_T large = mode == FRAME_MEMORY_HUGEPAGES ? GetLargePageMinimum() : 0;
+      if (large) {
+        size = detail::roundUp(bytes, large);
+        p = static_cast< unsigned char* >(VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE));
+        huge = locked = p != NULL;
+      }
+      if (!p) {
+        if (mode == FRAME_MEMORY_HUGEPAGES && account)
+          ++account->huge_fallbacks;
+        size = detail::roundUp(bytes, detail::pageSize());
+        p = static_cast< unsigned char* >(VirtualAlloc(NULL, size, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE));
+        if (!p)
+          throw std::bad_alloc();
+        locked = VirtualLock(p, size) != 0;
+      }
+    }
+#endif
+
+    if (!p) {
+      mode = FRAME_MEMORY_HEAP;
+      p = new unsigned char[bytes];
+    } else {
+      // prefault, also where locking failed, the stream start pays for it instead of the first frames
+      const size_t step = detail::pageSize();
+      for (size_t offset = 0; offset < size; offset += step)
+        p[offset] = 0;
+      if (!locked && account)
+        ++account->lock_failures;
+    }
+
+    if (account) {
+      ++account->blocks;
+      account->mapped += size;
+      if (locked)
+        account->locked += size;
+      if (huge)
+        account->huge += size;
+    }
+    return boost::shared_array< unsigned char >(p, detail::FrameMemoryRelease(mode, size, locked, huge, account));
+  }
+
+  /**
+   * \class FramePool
+   *
+   * \brief Recycles equally sized frame buffers.
+   *
+   * acquire() hands out an idle buffer, or allocates one if there is none.
+   * A buffer goes back to the pool when its last copy is released, on
+   * whatever thread that happens, unless the buffer size changed meanwhile
+   * or the pool holds enough idle buffers already. Create the pool with
+   * create(), the buffers refer back to it.
+   */
+  class FramePool : public boost::enable_shared_from_this< FramePool >, public boost::noncopyable {
+    public:
+
+      static boost::shared_ptr< FramePool > create(FrameMemoryMode mode, unsigned idle_limit) {
+        return boost::shared_ptr< FramePool >(new FramePool(mode, idle_limit));
+      }
+
+      /** switch to buffers of bytes, prefaulting count of them now */
+      void reset(size_t bytes, unsigned count) {
+        std::vector< boost::shared_array< unsigned char > > blocks;
+        for (unsigned i = 0; i < count; ++i)
+          blocks.push_back(allocateFrameMemory(bytes, mode_, account_));
+        boost::mutex::scoped_lock lock(mutex_);
+        bytes_ = bytes;
+        idle_.swap(blocks);
+      }
+
+      boost::shared_array< unsigned char > acquire() {
+        boost::shared_array< unsigned char > block;
+        size_t bytes;
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          bytes = bytes_;
+          if (!idle_.empty()) {
+            block = idle_.back();
+            idle_.pop_back();
+          }
+        }
+        if (!block) {
+          ++misses_;
+          block = allocateFrameMemory(bytes, mode_, account_);
+        }
+        return boost::shared_array< unsigned char >(block.get(), Return(shared_from_this(), block, bytes));
+      }
+
+      size_t bytes() const { return bytes_; }
+      /** buffers which had to be allocated after reset() */
+      unsigned long misses() const { return misses_; }
+      const MemoryAccount& account() const { return *account_; }
+
+    private:
+
+      FramePool(FrameMemoryMode mode, unsigned idle_limit)
+        : mode_(mode), idle_limit_(std::max(1u, idle_limit)), account_(new MemoryAccount), bytes_(0), misses_(0) {}
+
+      void release(const boost::shared_array< unsigned char >& block, size_t bytes) {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (bytes == bytes_ && idle_.size() < idle_limit_)
+          idle_.push_back(block);
+      }
+
+      struct Return {
+        Return(const boost::shared_ptr< FramePool >& pool, const boost::shared_array< unsigned char >& block, size_t bytes)
+          : pool(pool), block(block), bytes(bytes) {}
+
+        void operator()(unsigned char*) {
+          if (boost::shared_ptr< FramePool > p = pool.lock())
+            p->release(block, bytes);
+          block.reset();
+        }
+
+        boost::weak_ptr< FramePool > pool;
+        boost::shared_array< unsigned char > block;
+        size_t bytes;
+      };
+
+      const FrameMemoryMode mode_;
+      const size_t idle_limit_;
+      boost::shared_ptr< MemoryAccount > account_;
+      boost::mutex mutex_;
+      std::vector< boost::shared_array< unsigned char > > idle_;
+      size_t bytes_;
+      boost::atomic< unsigned long > misses_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: FRAME_MEMORY_7VKQ2HXE */
@@ -0,0 +1,276 @@
+#ifndef FRAME_PIPELINE_K3MZ8QWD
+#define FRAME_PIPELINE_K3MZ8QWD
+
+#include <string>
+#include <vector>
+#include <exception>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+#include <tbb/flow_graph.h>
+#include <tbb/task_arena.h>
+#include <tbb/tick_count.h>
+
+namespace freenect_camera {
+
+  /**
+   * \class FramePipeline
+   *
+   * \brief A chain of processing stages which frames pass one after another.
+   *
+   * A stage returns false to drop the frame, the later stages then skip it.
+   * run() executes the chain on the calling thread. After start() frames
+   * are pushed into a tbb::flow graph instead, where every stage is a node:
+   * serial stages handle one frame at a time and in order, parallel stages
+   * may work on several frames at once, and successive frames are in
+   * different stages at the same time. The graph runs in the task arena
+   * given to start(), or in the one of the calling thread. The time spent
+   * in every stage is recorded either way.
+   */
+  template< typename Frame >
+  class FramePipeline : public boost::noncopyable {
+    public:
+
+      typedef boost::function< bool ( Frame& ) > StageFunction;
+
+      struct StageStatistics {
+        std::string name;
+        bool parallel;
+        unsigned long frames;
+        unsigned long errors;
+        boost::uint64_t time;     // ns
+        boost::uint64_t max_time; // ns
+      };
+
+      FramePipeline()
+        : in_flight_(0), max_in_flight_(0), next_sequence_(0) {}
+
+      ~FramePipeline() {
+        stop();
+      }
+
+      /** append a stage, only while the graph is not running */
+      void addStage(const std::string& name, const StageFunction& function, bool parallel) {
+        boost::shared_ptr< Stage > stage(new Stage);
+        stage->name = name;
+        stage->function = function;
+        stage->parallel = parallel;
+        stages_.push_back(stage);
+      }
+
+      void clear() {
+        stop();
+        stages_.clear();
+      }
+
+      bool empty() const { return stages_.empty(); }
+
+      /** pass a frame through all stages on the calling thread */
+      void run(Frame& frame) {
+        for (size_t i = 0; i < stages_.size(); ++i)
+          if (!execute(*stages_[i], frame))
+            break;
+      }
+
+      /**
+       * build the graph, at most max_in_flight frames are processed at once.
+       * The stages run on the workers of arena if given, it must outlive stop().
+       */
+      void start(unsigned max_in_flight, tbb::task_arena* arena = NULL) {
+        stop();
+        boost::mutex::scoped_lock lock(mutex_);
+        if (stages_.empty())
+          return;
+        max_in_flight_ = std::max(1u, max_in_flight);
+        next_sequence_ = 0;
+        // a graph attaches to the arena it is constructed in
+        if (arena)
+          arena->execute(BuildGraph(*this));
+        else
+          buildGraph();
+      }
+
+      bool running() const { return graph_.get() != NULL; }
+
+      /**
+       * Hand a frame to the graph, called from a single thread. Returns false
+       * if the graph is not running or max_in_flight frames are still in it.
+       */
+      bool push(const Frame& frame) {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!graph_ || in_flight_.load() >= max_in_flight_)
+          return false;
+        ++in_flight_;
+        MessagePtr message(new Message);
+        message->sequence = next_sequence_++;
+        message->frame = frame;
+        message->dropped = false;
+        graph_->stages.front()->try_put(message);
+        return true;
+      }
+
+      /** wait for the frames in flight and tear the graph down */
+      void stop() {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (!graph_)
+          return;
+        graph_->graph.wait_for_all();
+        graph_.reset();
+        in_flight_ = 0;
+      }
+
+      std::vector< StageStatistics > statistics() const {
+        std::vector< StageStatistics > result(stages_.size());
+        for (size_t i = 0; i < stages_.size(); ++i) {
+          result[i].name = stages_[i]->name;
+          result[i].parallel = stages_[i]->parallel;
+          result[i].frames = stages_[i]->frames.load();
+          result[i].errors = stages_[i]->errors.load();
+          result[i].time = stages_[i]->time.load();
+          result[i].max_time = stages_[i]->max_time.load();
+        }
+        return result;
+      }
+
+      /** restart the maximum stage times */
+      void resetMaxTimes() {
+        for (size_t i = 0; i < stages_.size(); ++i)
+          stages_[i]->max_time = 0;
+      }
+
+    private:
+
+      void buildGraph() {
+        graph_.reset(new Graph);
+
+        // a serial stage behind a parallel one gets the frames back in order
+        bool reordered = false;
+        tbb::flow::sender< MessagePtr >* previous = NULL;
+        for (size_t i = 0; i < stages_.size(); ++i) {
+          if (previous && reordered && !stages_[i]->parallel) {
+            boost::shared_ptr< Sequencer > sequencer(new Sequencer(graph_->graph, SequenceBody()));
+            tbb::flow::make_edge(*previous, *sequencer);
+            graph_->sequencers.push_back(sequencer);
+            previous = sequencer.get();
+            reordered = false;
+          }
+          boost::shared_ptr< StageNode > node(new StageNode(graph_->graph,
+            stages_[i]->parallel ? size_t(tbb::flow::unlimited) : size_t(tbb::flow::serial),
+            StageBody(*this, *stages_[i])));
+          if (previous)
+            tbb::flow::make_edge(*previous, *node);
+          graph_->stages.push_back(node);
+          previous = node.get();
+          reordered = reordered || stages_[i]->parallel;
+        }
+        graph_->done.reset(new DoneNode(graph_->graph, tbb::flow::unlimited, DoneBody(*this)));
+        tbb::flow::make_edge(*previous, *graph_->done);
+      }
+
+      struct BuildGraph {
+        explicit BuildGraph(FramePipeline& pipeline) : pipeline_(&pipeline) {}
+
+        void operator()() const {
+          pipeline_->buildGraph();
+        }
+
+        FramePipeline* pipeline_;
+      };
+
+      struct Stage : public boost::noncopyable {
+        Stage() : parallel(false), frames(0), errors(0), time(0), max_time(0) {}
+        std::string name;
+        StageFunction function;
+        bool parallel;
+        boost::atomic< unsigned long > frames;
+        boost::atomic< unsigned long > errors;
+        boost::atomic< boost::uint64_t > time;
+        boost::atomic< boost::uint64_t > max_time;
+      };
+
+      struct Message {
+        size_t sequence;
+        Frame frame;
+        bool dropped;
+      };
+      typedef boost::shared_ptr< Message > MessagePtr;
+
+      bool execute(Stage& stage, Frame& frame) {
+        tbb::tick_count start = tbb::tick_count::now();
+        bool ok = false;
+        try {
+          ok = stage.function(frame);
+        } catch (const std::exception&) {
+          // a failing consumer must not take the graph down
+          ++stage.errors;
+        }
+        boost::uint64_t elapsed = boost::uint64_t((tbb::tick_count::now() - start).seconds() * 1e9);
+        ++stage.frames;
+        stage.time += elapsed;
+        boost::uint64_t max_time = stage.max_time.load();
+        while (elapsed > max_time && !stage.max_time.compare_exchange_weak(max_time, elapsed))
+          ;
+        return ok;
+      }
+
+      struct StageBody {
+        StageBody(FramePipeline& pipeline, Stage& stage)
+          : pipeline_(&pipeline), stage_(&stage) {}
+
+        MessagePtr operator()(MessagePtr message) const {
+          if (!message->dropped && !pipeline_->execute(*stage_, message->frame))
+            message->dropped = true;
+          return message;
+        }
+
+        FramePipeline* pipeline_;
+        Stage* stage_;
+      };
+
+      struct SequenceBody {
+        size_t operator()(const MessagePtr& message) const {
+          return message->sequence;
+        }
+      };
+
+      struct DoneBody {
+        explicit DoneBody(FramePipeline& pipeline) : pipeline_(&pipeline) {}
+
+        tbb::flow::continue_msg operator()(MessagePtr) const {
+          --pipeline_->in_flight_;
+          return tbb::flow::continue_msg();
+        }
+
+        FramePipeline* pipeline_;
+      };
+
+      typedef tbb::flow::function_node< MessagePtr, MessagePtr > StageNode;
+      typedef tbb::flow::sequencer_node< MessagePtr > Sequencer;
+      typedef tbb::flow::function_node< MessagePtr, tbb::flow::continue_msg > DoneNode;
+
+      // the nodes are destroyed before the graph they belong to
+      struct Graph {
+        tbb::flow::graph graph;
+        std::vector< boost::shared_ptr< StageNode > > stages;
+        std::vector< boost::shared_ptr< Sequencer > > sequencers;
+        boost::scoped_ptr< DoneNode > done;
+      };
+
+      std::vector< boost::shared_ptr< Stage > > stages_;
+      // guards the graph against a push while it is torn down
+      boost::mutex mutex_;
+      boost::scoped_ptr< Graph > graph_;
+      boost::atomic< unsigned > in_flight_;
+      unsigned max_in_flight_;
+      size_t next_sequence_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: FRAME_PIPELINE_K3MZ8QWD */
@@ -0,0 +1,88 @@
+#ifndef FRAME_SEQUENCER_P2WD6YCA
+#define FRAME_SEQUENCER_P2WD6YCA
+
+#include <algorithm>
+#include <boost/cstdint.hpp>
+
+namespace freenect_camera {
+
+  /**
+   * \class FrameSequencer
+   *
+   * \brief Numbers the frames of a stream by the device clock.
+   *
+   * The nominal frame interval is learned as the shortest of the first
+   * intervals after a (re)start. Afterwards every interval is rounded to a
+   * number of frame periods; frames missing in between count as lost and
+   * skip their sequence numbers. Intervals deviating by more than a tenth
+   * of a period from a whole number of periods count as irregular. The
+   * device timestamp is 32 bit and may wrap around.
+   */
+  class FrameSequencer {
+    public:
+
+      static const unsigned LEARN_FRAMES = 8;
+
+      FrameSequencer()
+        : expected_(0), received_(0), lost_(0), irregular_(0),
+          started_(false), last_(0), interval_(0), learned_(0) {}
+
+      /**
+       * The stream was (re)started, possibly in another mode. The gap until
+       * the next frame is not counted and the interval is learned again.
+       */
+      void restart() {
+        started_ = false;
+        interval_ = 0;
+        learned_ = 0;
+      }
+
+      /** account a frame, returns its sequence number */
+      boost::uint32_t update(boost::uint32_t timestamp) {
+        boost::uint64_t frames = 1;
+        if (started_) {
+          const boost::uint32_t delta = timestamp - last_;
+          if (learned_ < LEARN_FRAMES) {
+            if (delta > 0 && (interval_ == 0 || delta < interval_))
+              interval_ = delta;
+            ++learned_;
+          } else if (interval_ > 0) {
+            frames = std::max<boost::uint64_t>(1, (delta + interval_ / 2) / interval_);
+            const boost::int64_t deviation = boost::int64_t(delta) - boost::int64_t(frames * interval_);
+            if ((deviation < 0 ? -deviation : deviation) * 10 > boost::int64_t(interval_))
+              ++irregular_;
+            lost_ += frames - 1;
+          }
+        }
+        started_ = true;
+        last_ = timestamp;
+        ++received_;
+        expected_ += frames;
+        return boost::uint32_t(expected_ - 1);
+      }
+
+      /** frames the device should have delivered, received and lost */
+      boost::uint64_t expected() const { return expected_; }
+      boost::uint64_t received() const { return received_; }
+      boost::uint64_t lost() const { return lost_; }
+      boost::uint64_t irregular() const { return irregular_; }
+
+      /** learned frame interval in device clock ticks, 0 while learning */
+      boost::uint32_t interval() const { return learned_ < LEARN_FRAMES ? 0 : interval_; }
+
+    private:
+
+      boost::uint64_t expected_;
+      boost::uint64_t received_;
+      boost::uint64_t lost_;
+      boost::uint64_t irregular_;
+
+      bool started_;
+      boost::uint32_t last_;
+      boost::uint32_t interval_;
+      unsigned learned_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: FRAME_SEQUENCER_P2WD6YCA */
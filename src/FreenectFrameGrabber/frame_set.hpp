@@ -0,0 +1,278 @@
+#ifndef FRAME_SET_M4TB9ZQE
+#define FRAME_SET_M4TB9ZQE
+
+#include <map>
+#include <deque>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+#include <boost/bind.hpp>
+#include <boost/atomic.hpp>
+#include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/thread.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/locks.hpp>
+#include <boost/thread/condition_variable.hpp>
+
+namespace freenect_camera {
+
+  /**
+   * \class FrameSetHub
+   *
+   * \brief Collects frames of several devices into sets of the same time.
+   *
+   * Members (a stream of a device) join a named group and post their frames
+   * with host-corrected timestamps. When a frame arrives, the frames of the
+   * other members closest to it are looked up; if all of them are within
+   * the tolerance of the group they form a set. The set time is the mean of
+   * the frame times, every member is handed its frame and its skew against
+   * the set time. Frames are passed by handle, a set costs a few pointer
+   * moves per member. Frames older than a set, and frames beyond the queue
+   * length of a member, are dropped.
+   *
+   * With a tolerance of at most half the frame period a later frame can not
+   * be closer, so sets are completed as soon as the last frame arrives.
+   * post() runs on the device threads and never waits for a consumer:
+   * completed sets are queued and delivered one at a time and in order by
+   * a thread of the hub. If the consumers fall behind by more than
+   * PENDING_SETS sets the oldest set is dropped. Times are nanoseconds.
+   */
+  template< typename Frame >
+  class FrameSetHub : public boost::noncopyable {
+    public:
+
+      /** set time, the frame of the member and its time minus the set time */
+      typedef boost::function< void ( boost::uint64_t, const Frame&, boost::int64_t ) > Delivery;
+
+      static const size_t QUEUE_LENGTH = 4;
+      // completed sets waiting for the delivery thread
+      static const size_t PENDING_SETS = 2;
+
+      static FrameSetHub& instance() {
+        static FrameSetHub hub;
+        return hub;
+      }
+
+      ~FrameSetHub() {
+        boost::mutex::scoped_lock membership(membership_mutex_);
+        stopThread();
+      }
+
+      /** join a group, the smallest tolerance of its current members applies */
+      void join(const std::string& group, const std::string& member, const Delivery& delivery, boost::uint64_t tolerance) {
+        boost::mutex::scoped_lock membership(membership_mutex_);
+        boost::mutex::scoped_lock lock(mutex_);
+        Group& g = groups_[group];
+        Member& m = g.members[member];
+        m.delivery = delivery;
+        m.tolerance = tolerance;
+        m.frames.clear();
+        updateTolerance(g);
+        if (!thread_) {
+          stop_ = false;
+          thread_.reset(new boost::thread(boost::bind(&FrameSetHub::deliveryThread, this)));
+        }
+      }
+
+      /**
+       * leave a group, returns after a set being delivered to the member.
+       * Must not be called from a delivery.
+       */
+      void leave(const std::string& group, const std::string& member) {
+        boost::mutex::scoped_lock membership(membership_mutex_);
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          typename GroupMap::iterator it = groups_.find(group);
+          if (it == groups_.end())
+            return;
+          Group& g = it->second;
+          g.members.erase(member);
+          if (g.members.empty())
+            groups_.erase(it);
+          else
+            // a tight member leaving must not keep the others at its tolerance
+            updateTolerance(g);
+          // queued sets keep their frames for the other members
+          for (typename std::deque< Set >::iterator set = pending_.begin(); set != pending_.end(); ++set)
+            for (typename std::vector< Handoff >::iterator h = set->handoffs.begin(); h != set->handoffs.end(); ++h)
+              if (set->group == group && h->member == member)
+                h->delivery.clear();
+          while (delivering_)
+            idle_.wait(lock);
+          if (!groups_.empty())
+            return;
+        }
+        stopThread();
+      }
+
+      /** sets dropped because the consumers fell behind */
+      unsigned long dropped() const { return dropped_; }
+
+      /** post a frame of a member, completes and queues a set if possible */
+      void post(const std::string& group, const std::string& member, boost::uint64_t time, const Frame& frame) {
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          typename GroupMap::iterator git = groups_.find(group);
+          if (git == groups_.end())
+            return;
+          Group& g = git->second;
+          typename MemberMap::iterator mit = g.members.find(member);
+          if (mit == g.members.end())
+            return;
+          std::deque< Entry >& queue = mit->second.frames;
+          queue.push_back(Entry(time, frame));
+          if (queue.size() > QUEUE_LENGTH)
+            queue.pop_front();
+
+          // the closest frame of every member
+          std::vector< size_t > picks;
+          boost::int64_t offset_sum = 0;
+          for (typename MemberMap::iterator it = g.members.begin(); it != g.members.end(); ++it) {
+            const std::deque< Entry >& candidates = it->second.frames;
+            size_t best = candidates.size();
+            boost::int64_t best_offset = 0;
+            for (size_t i = 0; i < candidates.size(); ++i) {
+              const boost::int64_t offset = boost::int64_t(candidates[i].time - time);
+              if (best == candidates.size() || absolute(offset) < absolute(best_offset)) {
+                best = i;
+                best_offset = offset;
+              }
+            }
+            if (best == candidates.size() || boost::uint64_t(absolute(best_offset)) > g.tolerance)
+              return;
+            picks.push_back(best);
+            offset_sum += best_offset;
+          }
+
+          if (pending_.size() >= PENDING_SETS) {
+            pending_.pop_front();
+            ++dropped_;
+          }
+          pending_.push_back(Set());
+          Set& set = pending_.back();
+          set.group = group;
+          set.time = time + offset_sum / boost::int64_t(picks.size());
+          size_t index = 0;
+          for (typename MemberMap::iterator it = g.members.begin(); it != g.members.end(); ++it, ++index) {
+            std::deque< Entry >& queue_of = it->second.frames;
+            const Entry& entry = queue_of[picks[index]];
+            set.handoffs.push_back(Handoff(it->first, it->second.delivery, entry.frame, boost::int64_t(entry.time - set.time)));
+            queue_of.erase(queue_of.begin(), queue_of.begin() + picks[index] + 1);
+          }
+        }
+        ready_.notify_one();
+      }
+
+    private:
+
+      struct Entry {
+        Entry(boost::uint64_t time, const Frame& frame) : time(time), frame(frame) {}
+        boost::uint64_t time;
+        Frame frame;
+      };
+
+      /** the frame of a member in a completed set */
+      struct Handoff {
+        Handoff(const std::string& member, const Delivery& delivery, const Frame& frame, boost::int64_t skew)
+          : member(member), delivery(delivery), frame(frame), skew(skew) {}
+        std::string member;
+        Delivery delivery;
+        Frame frame;
+        boost::int64_t skew;
+      };
+
+      struct Set {
+        std::string group;
+        boost::uint64_t time;
+        std::vector< Handoff > handoffs;
+      };
+
+      struct Member {
+        Member() : tolerance(0) {}
+        Delivery delivery;
+        boost::uint64_t tolerance;
+        std::deque< Entry > frames;
+      };
+      typedef std::map< std::string, Member > MemberMap;
+
+      struct Group {
+        Group() : tolerance(0) {}
+        boost::uint64_t tolerance;
+        MemberMap members;
+      };
+      typedef std::map< std::string, Group > GroupMap;
+
+      FrameSetHub()
+        : stop_(false), delivering_(false), dropped_(0) {}
+
+      static void updateTolerance(Group& g) {
+        g.tolerance = g.members.begin()->second.tolerance;
+        for (typename MemberMap::const_iterator it = g.members.begin(); it != g.members.end(); ++it)
+          g.tolerance = std::min(g.tolerance, it->second.tolerance);
+      }
+
+      static boost::int64_t absolute(boost::int64_t v) {
+        return v < 0 ? -v : v;
+      }
+
+      void deliveryThread() {
+        while (true) {
+          Set set;
+          {
+            boost::mutex::scoped_lock lock(mutex_);
+            while (pending_.empty() && !stop_)
+              ready_.wait(lock);
+            if (stop_)
+              return;
+            set.group.swap(pending_.front().group);
+            set.time = pending_.front().time;
+            set.handoffs.swap(pending_.front().handoffs);
+            pending_.pop_front();
+            delivering_ = true;
+          }
+          for (size_t i = 0; i < set.handoffs.size(); ++i)
+            if (set.handoffs[i].delivery)
+              set.handoffs[i].delivery(set.time, set.handoffs[i].frame, set.handoffs[i].skew);
+          {
+            boost::mutex::scoped_lock lock(mutex_);
+            delivering_ = false;
+          }
+          idle_.notify_all();
+        }
+      }
+
+      /** called with membership_mutex_ held */
+      void stopThread() {
+        {
+          boost::mutex::scoped_lock lock(mutex_);
+          stop_ = true;
+          pending_.clear();
+        }
+        ready_.notify_all();
+        if (thread_) {
+          thread_->join();
+          thread_.reset();
+        }
+      }
+
+      // serializes join() and leave(), which start and stop the delivery thread
+      boost::mutex membership_mutex_;
+      boost::mutex mutex_;
+      // a set was queued, or the thread is stopped
+      boost::condition_variable ready_;
+      // the delivery thread finished a set
+      boost::condition_variable idle_;
+      GroupMap groups_;
+      std::deque< Set > pending_;
+      boost::scoped_ptr< boost::thread > thread_;
+      bool stop_;
+      bool delivering_;
+      boost::atomic< unsigned long > dropped_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: FRAME_SET_M4TB9ZQE */
@@ -11,6 +11,7 @@
 #include <libfreenect.h>
 #include <libfreenect_registration.h>
 #include "image_buffer.hpp"
+#include "frame_sequencer.hpp"
 
 namespace freenect_camera {
 
@@ -22,7 +23,15 @@ namespace freenect_camera {
   typedef freenect_resolution OutputMode;
 
   bool isImageMode(const ImageBuffer& buffer) {
-    return buffer.metadata.video_format == FREENECT_VIDEO_RGB;
+    switch (buffer.metadata.video_format) {
+      case FREENECT_VIDEO_RGB:
+      case FREENECT_VIDEO_BAYER:
+      case FREENECT_VIDEO_YUV_RGB:
+      case FREENECT_VIDEO_YUV_RAW:
+        return true;
+      default:
+        return false;
+    }
   }
 
   class FreenectDriver;
@@ -50,6 +59,8 @@ namespace freenect_camera {
         streaming_video_ = should_stream_video_ = false;
         new_video_resolution_ = getDefaultImageMode();
         new_video_format_ = FREENECT_VIDEO_RGB;
+        image_format_ = FREENECT_VIDEO_RGB;
+        ir_format_ = FREENECT_VIDEO_IR_8BIT;
         video_buffer_.metadata.resolution = FREENECT_RESOLUTION_DUMMY;
         video_buffer_.metadata.video_format = FREENECT_VIDEO_DUMMY;
 
@@ -58,6 +69,10 @@ namespace freenect_camera {
         new_depth_format_ = FREENECT_DEPTH_MM;
         depth_buffer_.metadata.resolution = FREENECT_RESOLUTION_DUMMY;
         depth_buffer_.metadata.depth_format = FREENECT_DEPTH_DUMMY;
+
+        frame_memory_ = FRAME_MEMORY_HEAP;
+        video_memory_.reset(new MemoryAccount);
+        depth_memory_.reset(new MemoryAccount);
       }
 
       ~FreenectDevice() {
@@ -65,7 +80,10 @@ namespace freenect_camera {
       }
 
       void shutdown() {
+        if (!device_)
+          return;
         freenect_close_device(device_);
+        device_ = NULL;
         freenect_destroy_registration(&registration_);
       }
 
@@ -117,6 +135,40 @@ namespace freenect_camera {
         throw std::runtime_error("[ERROR] The kinect does not support hardware synchronization");
       }
 
+      /** registration data read from the device when it was opened */
+      const freenect_registration& getRegistration() const {
+        return registration_;
+      }
+
+      /** frame accounting of the streams since the device was opened */
+      FrameSequencer getVideoSequence() {
+        boost::lock_guard<boost::mutex> buffer_lock(video_buffer_.mutex);
+        return video_sequence_;
+      }
+
+      FrameSequencer getDepthSequence() {
+        boost::lock_guard<boost::mutex> buffer_lock(depth_buffer_.mutex);
+        return depth_sequence_;
+      }
+
+      /**
+       * Backing of the buffers libfreenect writes the frames to, applied when
+       * a stream is (re)configured
+       */
+      void setFrameMemory(FrameMemoryMode mode) {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        frame_memory_ = mode;
+      }
+
+      /** memory of the stream buffers */
+      const MemoryAccount& getVideoMemory() const {
+        return *video_memory_;
+      }
+
+      const MemoryAccount& getDepthMemory() const {
+        return *depth_memory_;
+      }
+
       /**
        * Get the baseline (distance between rgb/depth sensor)
        */
@@ -179,10 +231,16 @@ namespace freenect_camera {
 
       void startImageStream() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
-        new_video_format_ = FREENECT_VIDEO_RGB;
+        new_video_format_ = image_format_;
         should_stream_video_ = true;
       }
 
+      /** Video format used by startImageStream (RGB, BAYER or YUV) */
+      void setImageFormat(freenect_video_format format) {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        image_format_ = format;
+      }
+
       bool isImageStreamRunning() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         return streaming_video_ && _isImageModeEnabled();
@@ -196,10 +254,16 @@ namespace freenect_camera {
 
       void startIRStream() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
-        new_video_format_ = FREENECT_VIDEO_IR_8BIT;
+        new_video_format_ = ir_format_;
         should_stream_video_ = true;
       }
 
+      /** Video format used by startIRStream (IR_8BIT, IR_10BIT or IR_10BIT_PACKED) */
+      void setIRFormat(freenect_video_format format) {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        ir_format_ = format;
+      }
+
       bool isIRStreamRunning() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         return streaming_video_ && !_isImageModeEnabled();
@@ -243,6 +307,11 @@ namespace freenect_camera {
           (enable) ? FREENECT_DEPTH_REGISTERED : FREENECT_DEPTH_MM;
       }
 
+      void setDepthFormat(freenect_depth_format format) {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        new_depth_format_ = format;
+      }
+
       void stopDepthStream() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
         should_stream_depth_ = false;
@@ -258,6 +327,61 @@ namespace freenect_camera {
         return streaming_depth_;
       }
 
+      /** requested stream configuration, to bring a reopened device into the same state */
+      struct StreamState {
+        bool video;
+        freenect_video_format video_format;
+        freenect_resolution video_resolution;
+        freenect_video_format image_format;
+        freenect_video_format ir_format;
+        bool depth;
+        freenect_depth_format depth_format;
+        freenect_resolution depth_resolution;
+      };
+
+      StreamState getStreamState() {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        StreamState state;
+        state.video = should_stream_video_;
+        state.video_format = new_video_format_;
+        state.video_resolution = new_video_resolution_;
+        state.image_format = image_format_;
+        state.ir_format = ir_format_;
+        state.depth = should_stream_depth_;
+        state.depth_format = new_depth_format_;
+        state.depth_resolution = new_depth_resolution_;
+        return state;
+      }
+
+      /** applied by the next executeChanges */
+      void restoreStreamState(const StreamState& state) {
+        boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        should_stream_video_ = state.video;
+        new_video_format_ = state.video_format;
+        new_video_resolution_ = state.video_resolution;
+        image_format_ = state.image_format;
+        ir_format_ = state.ir_format;
+        should_stream_depth_ = state.depth;
+        new_depth_format_ = state.depth_format;
+        new_depth_resolution_ = state.depth_resolution;
+      }
+
+      /* MOTOR SUBDEVICE FUNCTIONS */
+
+      /**
+       * Read the accelerometer (m/s^2). This is a synchronous USB control
+       * transfer, so it must not be called from a frame callback.
+       */
+      bool getAccelerometer(double& x, double& y, double& z) {
+        if (freenect_update_tilt_state(device_) < 0)
+          return false;
+        freenect_raw_tilt_state* state = freenect_get_tilt_state(device_);
+        if (!state)
+          return false;
+        freenect_get_mks_accel(state, &x, &y, &z);
+        return true;
+      }
+
       /* LIBFREENECT ASYNC CALLBACKS */
 
       static void freenectDepthCallback(
@@ -265,7 +389,7 @@ namespace freenect_camera {
 
         FreenectDevice* device = 
             static_cast<FreenectDevice*>(freenect_get_user(dev));
-        device->depthCallback(depth);
+        device->depthCallback(depth, timestamp);
       }
 
       static void freenectVideoCallback(
@@ -273,7 +397,7 @@ namespace freenect_camera {
 
         FreenectDevice* device = 
             static_cast<FreenectDevice*>(freenect_get_user(dev));
-        device->videoCallback(video);
+        device->videoCallback(video, timestamp);
       }
 
     private:
@@ -288,17 +412,25 @@ namespace freenect_camera {
       boost::function<void(const ImageBuffer&)> ir_callback_;
 
       ImageBuffer video_buffer_;
+      FrameSequencer video_sequence_;
       bool streaming_video_;
       bool should_stream_video_;
       freenect_resolution new_video_resolution_;
       freenect_video_format new_video_format_; 
+      freenect_video_format image_format_;
+      freenect_video_format ir_format_;
 
       ImageBuffer depth_buffer_;
+      FrameSequencer depth_sequence_;
       bool streaming_depth_;
       bool should_stream_depth_;
       freenect_resolution new_depth_resolution_;
       freenect_depth_format new_depth_format_;
 
+      FrameMemoryMode frame_memory_;
+      boost::shared_ptr<MemoryAccount> video_memory_;
+      boost::shared_ptr<MemoryAccount> depth_memory_;
+
       /* Prevents changing settings unless the freenect thread in the driver
        * is ready */
       boost::recursive_mutex m_settings_;
@@ -308,15 +440,19 @@ namespace freenect_camera {
       return isImageMode(video_buffer_);
     }
 
-    void depthCallback(void* depth) {
+    void depthCallback(void* depth, uint32_t timestamp) {
       boost::lock_guard<boost::mutex> buffer_lock(depth_buffer_.mutex);
       assert(depth == depth_buffer_.image_buffer.get());
+      depth_buffer_.timestamp = timestamp;
+      depth_buffer_.sequence = depth_sequence_.update(timestamp);
       depth_callback_.operator()(depth_buffer_);
     }
 
-    void videoCallback(void* video) {
+    void videoCallback(void* video, uint32_t timestamp) {
       boost::lock_guard<boost::mutex> buffer_lock(video_buffer_.mutex);
       assert(video == video_buffer_.image_buffer.get());
+      video_buffer_.timestamp = timestamp;
+      video_buffer_.sequence = video_sequence_.update(timestamp);
       if (isImageMode(video_buffer_)) {
         image_callback_.operator()(video_buffer_);
       } else {
@@ -326,8 +462,13 @@ namespace freenect_camera {
 
 
   public:
-      void executeChanges() {
+      /**
+       * Apply the requested stream settings. Returns false if a stream could
+       * not be (re)started, it then stays stopped until it is started again.
+       */
+      bool executeChanges() {
         boost::lock_guard<boost::recursive_mutex> lock(m_settings_);
+        bool ok = true;
 
         bool change_video_settings = 
           video_buffer_.metadata.video_format != new_video_format_ ||
@@ -343,23 +484,33 @@ namespace freenect_camera {
               video_buffer_.metadata.video_format != new_video_format_) {
             try {
               allocateBufferVideo(video_buffer_, new_video_format_, 
-                 new_video_resolution_, registration_);
+                 new_video_resolution_, registration_, frame_memory_, video_memory_);
             } catch (std::runtime_error& e) {
               printf("[ERROR] Unsupported video format/resolution provided. %s\n",
                   e.what());
               printf("[INFO] Setting default settings (RGB/VGA)\n");
               allocateBufferVideo(video_buffer_, FREENECT_VIDEO_BAYER,
-                  FREENECT_RESOLUTION_MEDIUM, registration_);
+                  FREENECT_RESOLUTION_MEDIUM, registration_, frame_memory_, video_memory_);
+            }
+            if (freenect_set_video_mode(device_, video_buffer_.metadata) < 0 ||
+                freenect_set_video_buffer(device_, video_buffer_.image_buffer.get()) < 0) {
+              printf("[ERROR] Unable to set video mode\n");
+              ok = false;
             }
-            freenect_set_video_mode(device_, video_buffer_.metadata);
-            freenect_set_video_buffer(device_, video_buffer_.image_buffer.get());
             new_video_resolution_ = video_buffer_.metadata.resolution;
             new_video_format_ = video_buffer_.metadata.video_format;
           }
           // Restart stream if required
           if (should_stream_video_) {
-            freenect_start_video(device_);
-            streaming_video_ = true;
+            if (freenect_start_video(device_) < 0) {
+              printf("[ERROR] Unable to start video stream\n");
+              should_stream_video_ = false;
+              ok = false;
+            } else {
+              streaming_video_ = true;
+              boost::lock_guard<boost::mutex> buffer_lock(video_buffer_.mutex);
+              video_sequence_.restart();
+            }
           }
         }
 
@@ -377,25 +528,36 @@ namespace freenect_camera {
               depth_buffer_.metadata.depth_format != new_depth_format_) {
             try {
               allocateBufferDepth(depth_buffer_, new_depth_format_, 
-                 new_depth_resolution_, registration_);
+                 new_depth_resolution_, registration_, frame_memory_, depth_memory_);
             } catch (std::runtime_error& e) {
               printf("[ERROR] Unsupported depth format/resolution provided. %s\n",
                   e.what());
               printf("[INFO] Setting default settings (depth registered/VGA)\n");
               allocateBufferDepth(depth_buffer_, FREENECT_DEPTH_MM,
-                  FREENECT_RESOLUTION_MEDIUM, registration_);
+                  FREENECT_RESOLUTION_MEDIUM, registration_, frame_memory_, depth_memory_);
+            }
+            if (freenect_set_depth_mode(device_, depth_buffer_.metadata) < 0 ||
+                freenect_set_depth_buffer(device_, depth_buffer_.image_buffer.get()) < 0) {
+              printf("[ERROR] Unable to set depth mode\n");
+              ok = false;
             }
-            freenect_set_depth_mode(device_, depth_buffer_.metadata);
-            freenect_set_depth_buffer(device_, depth_buffer_.image_buffer.get());
             new_depth_resolution_ = depth_buffer_.metadata.resolution;
             new_depth_format_ = depth_buffer_.metadata.depth_format;
           }
           // Restart stream if required
           if (should_stream_depth_) {
-            freenect_start_depth(device_);
-            streaming_depth_ = true;
+            if (freenect_start_depth(device_) < 0) {
+              printf("[ERROR] Unable to start depth stream\n");
+              should_stream_depth_ = false;
+              ok = false;
+            } else {
+              streaming_depth_ = true;
+              boost::lock_guard<boost::mutex> buffer_lock(depth_buffer_.mutex);
+              depth_sequence_.restart();
+            }
           }
         }
+        return ok;
       }
 
   };
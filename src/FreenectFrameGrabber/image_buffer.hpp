@@ -10,6 +10,7 @@
 #include <boost/lexical_cast.hpp>
 
 #include <libfreenect.h>
+#include "frame_memory.hpp"
 
 namespace freenect_camera {
 
@@ -29,6 +30,8 @@ namespace freenect_camera {
     freenect_frame_mode metadata;
     float focal_length;
     bool is_registered;
+    uint32_t timestamp;
+    uint32_t sequence;
   };
 
   
@@ -54,13 +57,16 @@ namespace freenect_camera {
   }
 
   /**
-   * Reallocate the video buffer if the video format or resolution changes
+   * Reallocate the video buffer if the video format or resolution changes,
+   * locked or huge page buffers are prefaulted here
    */
   void allocateBufferVideo(
       ImageBuffer& buffer,
       const freenect_video_format& format,
       const freenect_resolution& resolution,
-      const freenect_registration& registration) {
+      const freenect_registration& registration,
+      FrameMemoryMode memory = FRAME_MEMORY_HEAP,
+      const boost::shared_ptr<MemoryAccount>& account = boost::shared_ptr<MemoryAccount>()) {
 
     // Obtain a lock on the buffer. This is mostly for debugging, as allocate
     // buffer should only be called when the buffer is not being used by the
@@ -75,6 +81,7 @@ namespace freenect_camera {
       case FREENECT_VIDEO_RGB:
       case FREENECT_VIDEO_BAYER:
       case FREENECT_VIDEO_YUV_RGB:
+      case FREENECT_VIDEO_YUV_RAW:
       case FREENECT_VIDEO_IR_8BIT:
       case FREENECT_VIDEO_IR_10BIT:
       case FREENECT_VIDEO_IR_10BIT_PACKED:
@@ -100,11 +107,12 @@ namespace freenect_camera {
     }
 
     // All is good, reallocate the buffer and calculate other pieces of info
-    buffer.image_buffer.reset(new unsigned char[buffer.metadata.bytes]);
+    buffer.image_buffer = allocateFrameMemory(buffer.metadata.bytes, memory, account);
     switch(format) {
       case FREENECT_VIDEO_RGB:
       case FREENECT_VIDEO_BAYER:
       case FREENECT_VIDEO_YUV_RGB:
+      case FREENECT_VIDEO_YUV_RAW:
         buffer.focal_length = getRGBFocalLength(buffer.metadata.width);
         break;
       case FREENECT_VIDEO_IR_8BIT:
@@ -126,7 +134,9 @@ namespace freenect_camera {
       ImageBuffer& buffer,
       const freenect_depth_format& format,
       const freenect_resolution& resolution,
-      const freenect_registration& registration) {
+      const freenect_registration& registration,
+      FrameMemoryMode memory = FRAME_MEMORY_HEAP,
+      const boost::shared_ptr<MemoryAccount>& account = boost::shared_ptr<MemoryAccount>()) {
 
     // Obtain a lock on the buffer. This is mostly for debugging, as allocate
     // buffer should only be called when the buffer is not being used by the
@@ -165,7 +175,7 @@ namespace freenect_camera {
     }
 
     // All is good, reallocate the buffer and calculate other pieces of info
-    buffer.image_buffer.reset(new unsigned char[buffer.metadata.bytes]);
+    buffer.image_buffer = allocateFrameMemory(buffer.metadata.bytes, memory, account);
     switch(format) {
       case FREENECT_DEPTH_11BIT:
       case FREENECT_DEPTH_10BIT:
@@ -0,0 +1,254 @@
+#ifndef IR_MARKER_DETECTOR_W2JX6MFA
+#define IR_MARKER_DETECTOR_W2JX6MFA
+
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FREENECT_HAVE_SSE2
+#endif
+
+namespace freenect_camera {
+
+  /**
+   * A bright blob found in an IR frame.
+   */
+  struct IRMarker {
+    double x;          // intensity weighted centroid
+    double y;
+    unsigned area;     // pixels
+    double intensity;  // mean intensity
+    unsigned peak;     // maximum intensity
+  };
+
+  namespace detail {
+
+    /** bit i set if pixel i of the 16 pixel chunk is >= threshold, threshold must fit the pixel type */
+    inline unsigned thresholdChunk(const boost::uint8_t* p, unsigned threshold) {
+#ifdef FREENECT_HAVE_SSE2
+      const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+      const __m128i t = _mm_set1_epi8(char(threshold));
+      return unsigned(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(v, t), v)));
+#else
+      unsigned mask = 0;
+      for (int i = 0; i < 16; ++i)
+        if (p[i] >= threshold)
+          mask |= 1u << i;
+      return mask;
+#endif
+    }
+
+    inline unsigned thresholdChunk(const boost::uint16_t* p, unsigned threshold) {
+#ifdef FREENECT_HAVE_SSE2
+      const __m128i t = _mm_set1_epi16(short(threshold));
+      const __m128i zero = _mm_setzero_si128();
+      // threshold - v saturates to zero exactly if v >= threshold
+      const __m128i a = _mm_cmpeq_epi16(_mm_subs_epu16(t,
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p))), zero);
+      const __m128i b = _mm_cmpeq_epi16(_mm_subs_epu16(t,
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 8))), zero);
+      return unsigned(_mm_movemask_epi8(_mm_packs_epi16(a, b)));
+#else
+      unsigned mask = 0;
+      for (int i = 0; i < 16; ++i)
+        if (p[i] >= threshold)
+          mask |= 1u << i;
+      return mask;
+#endif
+    }
+
+  } // namespace detail
+
+  /**
+   * \class IRMarkerDetector
+   *
+   * \brief Thresholds an IR frame and labels the bright pixels in a single
+   * pass over the data.
+   *
+   * Every row is scanned for runs of pixels above the threshold (16 pixels
+   * at a time, dark chunks are skipped with one compare), runs touching a
+   * run of the previous row (8-connected) are merged with union-find. The
+   * moments of every blob are accumulated on the way, so the frame is only
+   * read once. Scratch memory is kept between frames.
+   */
+  class IRMarkerDetector {
+    public:
+
+      IRMarkerDetector()
+        : threshold_(200), min_area_(2), max_area_(1000) {}
+
+      void setThreshold(unsigned threshold) { threshold_ = std::max(1u, threshold); }
+      void setAreaLimits(unsigned min_area, unsigned max_area) {
+        min_area_ = min_area;
+        max_area_ = max_area;
+      }
+
+      void detect(const boost::uint8_t* data, int width, int height, std::vector<IRMarker>& markers) {
+        detectImpl(data, width, height, markers);
+      }
+
+      void detect(const boost::uint16_t* data, int width, int height, std::vector<IRMarker>& markers) {
+        detectImpl(data, width, height, markers);
+      }
+
+    private:
+
+      struct Run {
+        int x0;
+        int x1;
+        int label;
+      };
+
+      struct Moments {
+        double sum;
+        double sum_x;
+        double sum_y;
+        unsigned area;
+        unsigned peak;
+      };
+
+      int find(int label) {
+        while (parent_[label] != label) {
+          parent_[label] = parent_[parent_[label]];
+          label = parent_[label];
+        }
+        return label;
+      }
+
+      int merge(int a, int b) {
+        a = find(a);
+        b = find(b);
+        if (a == b)
+          return a;
+        if (b < a)
+          std::swap(a, b);
+        parent_[b] = a;
+        return a;
+      }
+
+      template<typename T>
+      void addRun(const T* row, int y, int x0, int x1) {
+        Moments m;
+        m.sum = 0;
+        m.sum_x = 0;
+        m.area = unsigned(x1 - x0 + 1);
+        m.peak = 0;
+        for (int x = x0; x <= x1; ++x) {
+          const unsigned v = row[x];
+          m.sum += v;
+          m.sum_x += double(v) * x;
+          m.peak = std::max(m.peak, v);
+        }
+        m.sum_y = m.sum * y;
+
+        // connect to overlapping runs of the previous row (8-connected)
+        while (prev_pos_ < prev_.size() && prev_[prev_pos_].x1 < x0 - 1)
+          ++prev_pos_;
+        int label = -1;
+        for (size_t k = prev_pos_; k < prev_.size() && prev_[k].x0 <= x1 + 1; ++k)
+          label = (label < 0) ? find(prev_[k].label) : merge(label, prev_[k].label);
+
+        if (label < 0) {
+          label = int(parent_.size());
+          parent_.push_back(label);
+          Moments empty = { 0, 0, 0, 0, 0 };
+          moments_.push_back(empty);
+        }
+        Moments& acc = moments_[label];
+        acc.sum += m.sum;
+        acc.sum_x += m.sum_x;
+        acc.sum_y += m.sum_y;
+        acc.area += m.area;
+        acc.peak = std::max(acc.peak, m.peak);
+
+        Run run = { x0, x1, label };
+        cur_.push_back(run);
+      }
+
+      template<typename T>
+      void detectImpl(const T* data, int width, int height, std::vector<IRMarker>& markers) {
+        markers.clear();
+        parent_.clear();
+        moments_.clear();
+        prev_.clear();
+        // a 10 bit threshold on 8 bit frames only matches saturated pixels, the vector compare
+        // would truncate it
+        const unsigned threshold = std::min(threshold_, unsigned(std::numeric_limits<T>::max()));
+
+        for (int y = 0; y < height; ++y) {
+          const T* row = data + y * width;
+          cur_.clear();
+          prev_pos_ = 0;
+          int start = -1;
+          int x = 0;
+          for (; x + 16 <= width; x += 16) {
+            const unsigned mask = detail::thresholdChunk(row + x, threshold);
+            if ((mask == 0 && start < 0) || (mask == 0xFFFF && start >= 0))
+              continue;
+            for (int i = 0; i < 16; ++i) {
+              const bool on = (mask >> i) & 1;
+              if (on && start < 0) {
+                start = x + i;
+              } else if (!on && start >= 0) {
+                addRun(row, y, start, x + i - 1);
+                start = -1;
+              }
+            }
+          }
+          for (; x < width; ++x) {
+            const bool on = row[x] >= threshold;
+            if (on && start < 0) {
+              start = x;
+            } else if (!on && start >= 0) {
+              addRun(row, y, start, x - 1);
+              start = -1;
+            }
+          }
+          if (start >= 0)
+            addRun(row, y, start, width - 1);
+          prev_.swap(cur_);
+        }
+
+        // fold the moments of merged labels into their roots
+        for (size_t l = 0; l < parent_.size(); ++l) {
+          const int root = find(int(l));
+          if (root == int(l))
+            continue;
+          Moments& acc = moments_[root];
+          acc.sum += moments_[l].sum;
+          acc.sum_x += moments_[l].sum_x;
+          acc.sum_y += moments_[l].sum_y;
+          acc.area += moments_[l].area;
+          acc.peak = std::max(acc.peak, moments_[l].peak);
+        }
+        for (size_t l = 0; l < parent_.size(); ++l) {
+          const Moments& m = moments_[l];
+          if (parent_[l] != int(l) || m.area < min_area_ || m.area > max_area_ || m.sum <= 0)
+            continue;
+          IRMarker marker;
+          marker.x = m.sum_x / m.sum;
+          marker.y = m.sum_y / m.sum;
+          marker.area = m.area;
+          marker.intensity = m.sum / m.area;
+          marker.peak = m.peak;
+          markers.push_back(marker);
+        }
+      }
+
+      unsigned threshold_;
+      unsigned min_area_;
+      unsigned max_area_;
+
+      std::vector<int> parent_;
+      std::vector<Moments> moments_;
+      std::vector<Run> prev_;
+      std::vector<Run> cur_;
+      size_t prev_pos_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: IR_MARKER_DETECTOR_W2JX6MFA */
@@ -0,0 +1,227 @@
+#ifndef REGISTRATION_CACHE_M5QW8ZJC
+#define REGISTRATION_CACHE_M5QW8ZJC
+
+#include <string>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <libfreenect.h>
+#include <libfreenect_registration.h>
+
+#if defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace freenect_camera {
+
+  static const boost::uint32_t REGISTRATION_CACHE_MAGIC = 0x43524e46; // "FNRC"
+  static const boost::uint32_t REGISTRATION_CACHE_VERSION = 1;
+
+  // size of the libfreenect registration tables
+  static const int REGISTRATION_WIDTH = 640;
+  static const int REGISTRATION_HEIGHT = 480;
+
+  /** viewing ray (x / f, y / f) of every pixel of a depth frame */
+  inline void computeDepthRays(float focal_length, float* rays) {
+    const float cx = 0.5f * (REGISTRATION_WIDTH - 1);
+    const float cy = 0.5f * (REGISTRATION_HEIGHT - 1);
+    for (int y = 0; y < REGISTRATION_HEIGHT; ++y)
+      for (int x = 0; x < REGISTRATION_WIDTH; ++x) {
+        *rays++ = (x - cx) / focal_length;
+        *rays++ = (y - cy) / focal_length;
+      }
+  }
+
+  /**
+   * \class RegistrationCache
+   *
+   * \brief Registration data of a device and the lookup tables derived from
+   * it, stored in a file per camera serial which is mapped into memory.
+   *
+   * The file holds a header with the registration parameters followed by
+   * the raw to mm table, the depth to RGB shift table, the registration
+   * table and a ray table (x / f, y / f for every depth pixel). It is
+   * validated by size, version, serial and a checksum before use and is
+   * always replaced atomically.
+   */
+  class RegistrationCache : public boost::noncopyable {
+    public:
+
+      struct Header {
+        boost::uint32_t magic;
+        boost::uint32_t version;
+        char serial[32];
+        freenect_reg_info reg_info;
+        freenect_reg_pad_info reg_pad_info;
+        freenect_zero_plane_info zero_plane_info;
+        double const_shift;
+        boost::uint32_t width;
+        boost::uint32_t height;
+        boost::uint32_t payload_size;
+        boost::uint32_t checksum;
+      };
+
+      /** cache file of a device */
+      static std::string path(const std::string& directory, const std::string& serial) {
+        std::string path = directory;
+        if (!path.empty() && path[path.size() - 1] != '/' && path[path.size() - 1] != '\\')
+          path += '/';
+        return path + "freenect_registration_" + serial + ".bin";
+      }
+
+      /** map and validate a cache file, returns NULL if it is missing or invalid */
+      static boost::shared_ptr<RegistrationCache> load(const std::string& file, const std::string& serial) {
+        using namespace boost::interprocess;
+        boost::shared_ptr<RegistrationCache> cache(new RegistrationCache);
+        const boost::shared_ptr<RegistrationCache> invalid;
+        try {
+          cache->file_.reset(new file_mapping(file.c_str(), read_only));
+          cache->region_.reset(new mapped_region(*cache->file_, read_only));
+        } catch (interprocess_exception&) {
+          return invalid;
+        }
+
+        if (cache->region_->get_size() < sizeof(Header))
+          return invalid;
+        const Header* header = static_cast<const Header*>(cache->region_->get_address());
+        if (header->magic != REGISTRATION_CACHE_MAGIC || header->version != REGISTRATION_CACHE_VERSION ||
+            header->width != REGISTRATION_WIDTH || header->height != REGISTRATION_HEIGHT ||
+            header->payload_size != payloadSize() ||
+            cache->region_->get_size() < sizeof(Header) + header->payload_size ||
+            strncmp(header->serial, serial.c_str(), sizeof(header->serial)) != 0)
+          return invalid;
+        const unsigned char* payload = reinterpret_cast<const unsigned char*>(header + 1);
+        if (checksum(payload, header->payload_size) != header->checksum)
+          return invalid;
+
+        cache->header_ = header;
+        return cache;
+      }
+
+      /**
+       * Write the cache file of a device. The file is written next to the
+       * old one and renamed, so readers never see a partial file.
+       */
+      static bool store(const std::string& file, const std::string& serial,
+          const freenect_registration& registration, float focal_length) {
+        std::vector<unsigned char> payload(payloadSize());
+        unsigned char* p = &payload[0];
+        memcpy(p, registration.raw_to_mm_shift, rawToMMSize());
+        p += rawToMMSize();
+        memcpy(p, registration.depth_to_rgb_shift, depthToRGBSize());
+        p += depthToRGBSize();
+        memcpy(p, registration.registration_table, registrationTableSize());
+        p += registrationTableSize();
+
+        computeDepthRays(focal_length, reinterpret_cast<float*>(p));
+
+        Header header;
+        memset(&header, 0, sizeof(header));
+        header.magic = REGISTRATION_CACHE_MAGIC;
+        header.version = REGISTRATION_CACHE_VERSION;
+        strncpy(header.serial, serial.c_str(), sizeof(header.serial) - 1);
+        header.reg_info = registration.reg_info;
+        header.reg_pad_info = registration.reg_pad_info;
+        header.zero_plane_info = registration.zero_plane_info;
+        header.const_shift = registration.const_shift;
+        header.width = REGISTRATION_WIDTH;
+        header.height = REGISTRATION_HEIGHT;
+        header.payload_size = boost::uint32_t(payload.size());
+        header.checksum = checksum(&payload[0], payload.size());
+
+        const std::string tmp = file + ".tmp";
+        {
+          std::ofstream out(tmp.c_str(), std::ios::binary | std::ios::trunc);
+          out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+          out.write(reinterpret_cast<const char*>(&payload[0]), payload.size());
+          if (!out)
+            return false;
+        }
+        // readers see either the old or the new file, never none
+#if defined(_WIN32)
+        const bool replaced = MoveFileExA(tmp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+        const bool replaced = std::rename(tmp.c_str(), file.c_str()) == 0;
+#endif
+        if (!replaced)
+          std::remove(tmp.c_str());
+        return replaced;
+      }
+
+      /** does the cache hold exactly this registration? */
+      bool matches(const freenect_registration& registration) const {
+        return memcmp(&header_->reg_info, &registration.reg_info, sizeof(registration.reg_info)) == 0 &&
+          memcmp(&header_->reg_pad_info, &registration.reg_pad_info, sizeof(registration.reg_pad_info)) == 0 &&
+          memcmp(&header_->zero_plane_info, &registration.zero_plane_info, sizeof(registration.zero_plane_info)) == 0 &&
+          header_->const_shift == registration.const_shift &&
+          memcmp(rawToMM(), registration.raw_to_mm_shift, rawToMMSize()) == 0 &&
+          memcmp(depthToRGBShift(), registration.depth_to_rgb_shift, depthToRGBSize()) == 0 &&
+          memcmp(registrationTable(), registration.registration_table, registrationTableSize()) == 0;
+      }
+
+      const freenect_zero_plane_info& zeroPlaneInfo() const { return header_->zero_plane_info; }
+
+      /** raw depth to mm, FREENECT_DEPTH_RAW_MAX_VALUE entries */
+      const boost::uint16_t* rawToMM() const {
+        return reinterpret_cast<const boost::uint16_t*>(payload());
+      }
+
+      /** horizontal RGB shift by depth in mm, FREENECT_DEPTH_MM_MAX_VALUE entries */
+      const boost::int32_t* depthToRGBShift() const {
+        return reinterpret_cast<const boost::int32_t*>(payload() + rawToMMSize());
+      }
+
+      /** RGB position (x * 256, y) of every depth pixel */
+      const boost::int32_t (*registrationTable() const)[2] {
+        return reinterpret_cast<const boost::int32_t (*)[2]>(payload() + rawToMMSize() + depthToRGBSize());
+      }
+
+      /** viewing ray (x / f, y / f) of every depth pixel */
+      const float* rays() const {
+        return reinterpret_cast<const float*>(payload() + rawToMMSize() + depthToRGBSize() + registrationTableSize());
+      }
+
+    private:
+
+      RegistrationCache() : header_(NULL) {}
+
+      const unsigned char* payload() const {
+        return reinterpret_cast<const unsigned char*>(header_ + 1);
+      }
+
+      static size_t rawToMMSize() { return FREENECT_DEPTH_RAW_MAX_VALUE * sizeof(boost::uint16_t); }
+      static size_t depthToRGBSize() { return FREENECT_DEPTH_MM_MAX_VALUE * sizeof(boost::int32_t); }
+      static size_t registrationTableSize() { return REGISTRATION_WIDTH * REGISTRATION_HEIGHT * 2 * sizeof(boost::int32_t); }
+      static size_t raySize() { return REGISTRATION_WIDTH * REGISTRATION_HEIGHT * 2 * sizeof(float); }
+      static size_t payloadSize() { return rawToMMSize() + depthToRGBSize() + registrationTableSize() + raySize(); }
+
+      /** FNV-1a over 32 bit words */
+      static boost::uint32_t checksum(const unsigned char* data, size_t size) {
+        boost::uint32_t hash = 2166136261u;
+        size_t i = 0;
+        for (; i + 4 <= size; i += 4) {
+          boost::uint32_t word;
+          memcpy(&word, data + i, 4);
+          hash = (hash ^ word) * 16777619u;
+        }
+        for (; i < size; ++i)
+          hash = (hash ^ data[i]) * 16777619u;
+        return hash;
+      }
+
+      boost::scoped_ptr<boost::interprocess::file_mapping> file_;
+      boost::scoped_ptr<boost::interprocess::mapped_region> region_;
+      const Header* header_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: REGISTRATION_CACHE_M5QW8ZJC */
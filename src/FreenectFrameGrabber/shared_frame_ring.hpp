@@ -0,0 +1,479 @@
+#ifndef SHARED_FRAME_RING_R7NB2XQE
+#define SHARED_FRAME_RING_R7NB2XQE
+
+#include <string>
+#include <cstring>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/interprocess/shared_memory_object.hpp>
+#include <boost/interprocess/mapped_region.hpp>
+
+#include <libfreenect.h>
+
+namespace freenect_camera {
+
+  static const boost::uint32_t SHARED_FRAME_RING_MAGIC = 0x52464e46; // "FNFR"
+  static const boost::uint32_t SHARED_FRAME_RING_VERSION = 4;
+
+  /**
+   * Per frame information stored in front of every slot.
+   */
+  struct SharedFrameInfo {
+    boost::uint32_t frame_count;
+    // slot holding the frame
+    boost::uint32_t slot;
+    boost::uint32_t device_timestamp;
+    boost::uint64_t host_timestamp;
+    freenect_frame_mode mode;
+  };
+
+  /**
+   * \class SharedFrameRing
+   *
+   * \brief Layout of a frame ring in shared memory.
+   *
+   * The ring consists of a header followed by slot_count slots. The producer
+   * writes slots round robin, every slot is guarded by a seqlock counter which
+   * is odd while the slot is written. Readers never block the producer, they
+   * validate the counter after reading instead.
+   *
+   * A reader may also lease a slot to use the frame in place. The producer
+   * skips leased slots. All readers together hold at most max_leases
+   * leases, so the producer always finds a free slot. Every reader
+   * registers in a reader entry of the header with its own heartbeat and
+   * leases; the producer reclaims the entry of a reader without heartbeat
+   * for LEASE_TIMEOUT, so a crashed reader does not shrink the ring.
+   */
+  struct SharedFrameRing {
+
+    static const unsigned MAX_SLOTS = 32;
+    // readers which can lease at the same time, further readers only copy
+    static const unsigned MAX_READERS = 8;
+    // the entry of a reader without a heartbeat for this long is reclaimed, ms
+    static const boost::uint32_t LEASE_TIMEOUT = 5000;
+
+    /** entry of a registered reader */
+    struct Reader {
+      // 0 while the entry is free
+      boost::atomic<boost::uint32_t> token;
+      boost::atomic<boost::uint32_t> heartbeat;
+      boost::atomic<boost::uint32_t> leases;
+      // leases per slot
+      boost::atomic<boost::uint32_t> slot_leases[MAX_SLOTS];
+    };
+
+    /** decrement a count of a reader unless its entry was reclaimed meanwhile */
+    static void release(Reader& reader, boost::atomic<boost::uint32_t>& count, boost::uint32_t token) {
+      boost::uint32_t value = count.load(boost::memory_order_relaxed);
+      while (value != 0 && reader.token.load(boost::memory_order_acquire) == token &&
+          !count.compare_exchange_weak(value, value - 1, boost::memory_order_release))
+        ;
+    }
+
+    struct Header {
+      boost::uint32_t magic;
+      boost::uint32_t version;
+      boost::uint32_t slot_count;
+      boost::uint32_t slot_stride;
+      boost::uint32_t capacity;
+      boost::atomic<boost::uint32_t> write_count;
+      // slot of the newest frame
+      boost::atomic<boost::uint32_t> latest_slot;
+      // host time in ms (truncated) at which a reader last asked for frames
+      boost::atomic<boost::uint32_t> reader_heartbeat;
+      // leases of all readers together at most
+      boost::uint32_t max_leases;
+      // source of reader tokens, never 0
+      boost::atomic<boost::uint32_t> next_token;
+      Reader readers[MAX_READERS];
+    };
+
+    struct Slot {
+      boost::atomic<boost::uint32_t> sequence;
+      SharedFrameInfo info;
+    };
+
+    static size_t slotStride(size_t capacity) {
+      return (sizeof(Slot) + capacity + 63) & ~size_t(63);
+    }
+
+    static size_t headerSize() {
+      return (sizeof(Header) + 63) & ~size_t(63);
+    }
+
+    static size_t totalSize(unsigned slot_count, size_t capacity) {
+      return headerSize() + slot_count * slotStride(capacity);
+    }
+
+    static Slot* slot(void* base, unsigned index) {
+      Header* header = static_cast<Header*>(base);
+      return reinterpret_cast<Slot*>(static_cast<char*>(base) + headerSize() +
+          size_t(index % header->slot_count) * header->slot_stride);
+    }
+
+    static unsigned char* payload(Slot* slot) {
+      return reinterpret_cast<unsigned char*>(slot) + sizeof(Slot);
+    }
+  };
+
+  /**
+   * Name of the shared memory segment for a device stream.
+   */
+  inline std::string sharedFrameRingName(const std::string& serial, const std::string& stream) {
+    return "ubitrack_freenect_" + serial + "_" + stream;
+  }
+
+  /**
+   * \class SharedFrameWriter
+   *
+   * \brief Producer side of a shared frame ring. Publishing a frame costs
+   * exactly one copy, regardless of the number of attached readers.
+   */
+  class SharedFrameWriter : public boost::noncopyable {
+    public:
+
+      enum PublishResult {
+        PUBLISHED = 0,
+        // larger than the slots
+        TOO_LARGE,
+        // every slot is leased by a reader, the frame was dropped
+        ALL_LEASED
+      };
+
+      SharedFrameWriter(const std::string& name, unsigned slot_count, size_t capacity)
+        : name_(name), next_slot_(0) {
+        using namespace boost::interprocess;
+        if (slot_count < 2)
+          slot_count = 2;
+        if (slot_count > SharedFrameRing::MAX_SLOTS)
+          slot_count = SharedFrameRing::MAX_SLOTS;
+        shared_memory_object::remove(name_.c_str());
+        shm_.reset(new shared_memory_object(create_only, name_.c_str(), read_write));
+        shm_->truncate(SharedFrameRing::totalSize(slot_count, capacity));
+        region_.reset(new mapped_region(*shm_, read_write));
+
+        SharedFrameRing::Header* header = new (region_->get_address()) SharedFrameRing::Header;
+        header->slot_count = slot_count;
+        header->slot_stride = boost::uint32_t(SharedFrameRing::slotStride(capacity));
+        header->capacity = boost::uint32_t(capacity);
+        for (unsigned i = 0; i < slot_count; ++i)
+          new (SharedFrameRing::slot(header, i)) SharedFrameRing::Slot;
+        header->write_count.store(0, boost::memory_order_relaxed);
+        header->latest_slot.store(0, boost::memory_order_relaxed);
+        header->reader_heartbeat.store(0, boost::memory_order_relaxed);
+        // half of the ring stays free for new frames
+        header->max_leases = slot_count / 2;
+        header->next_token.store(1, boost::memory_order_relaxed);
+        for (unsigned r = 0; r < SharedFrameRing::MAX_READERS; ++r) {
+          SharedFrameRing::Reader& reader = header->readers[r];
+          reader.token.store(0, boost::memory_order_relaxed);
+          reader.heartbeat.store(0, boost::memory_order_relaxed);
+          reader.leases.store(0, boost::memory_order_relaxed);
+          for (unsigned i = 0; i < SharedFrameRing::MAX_SLOTS; ++i)
+            reader.slot_leases[i].store(0, boost::memory_order_relaxed);
+        }
+        for (unsigned i = 0; i < slot_count; ++i)
+          SharedFrameRing::slot(header, i)->sequence.store(0, boost::memory_order_relaxed);
+        header->version = SHARED_FRAME_RING_VERSION;
+        // publish the magic last, readers check it before anything else
+        boost::atomic_thread_fence(boost::memory_order_release);
+        header->magic = SHARED_FRAME_RING_MAGIC;
+      }
+
+      ~SharedFrameWriter() {
+        region_.reset();
+        shm_.reset();
+        boost::interprocess::shared_memory_object::remove(name_.c_str());
+      }
+
+      /** copy a frame into the next slot which is not leased */
+      PublishResult publish(const void* data, const freenect_frame_mode& mode,
+          boost::uint32_t device_timestamp, boost::uint64_t host_timestamp) {
+        SharedFrameRing::Header* header = static_cast<SharedFrameRing::Header*>(region_->get_address());
+        if (mode.bytes < 0 || boost::uint32_t(mode.bytes) > header->capacity)
+          return TOO_LARGE;
+
+        reclaimStaleReaders(boost::uint32_t(host_timestamp / 1000000));
+        for (unsigned attempt = 0; attempt < header->slot_count; ++attempt) {
+          const boost::uint32_t index = (next_slot_ + attempt) % header->slot_count;
+          SharedFrameRing::Slot* slot = SharedFrameRing::slot(header, index);
+
+          // mark the slot as written before looking at the leases, a reader
+          // increments the leases before checking the counter, so one of
+          // both sees the other
+          const boost::uint32_t seq = slot->sequence.load(boost::memory_order_relaxed);
+          slot->sequence.store(seq + 1, boost::memory_order_seq_cst);
+          if (leased(index)) {
+            // the slot was not touched, the frame in it stays valid
+            slot->sequence.store(seq, boost::memory_order_seq_cst);
+            continue;
+          }
+
+          const boost::uint32_t count = header->write_count.load(boost::memory_order_relaxed);
+          slot->info.frame_count = count + 1;
+          slot->info.slot = index;
+          slot->info.device_timestamp = device_timestamp;
+          slot->info.host_timestamp = host_timestamp;
+          slot->info.mode = mode;
+          memcpy(SharedFrameRing::payload(slot), data, mode.bytes);
+
+          slot->sequence.store(seq + 2, boost::memory_order_release);
+          header->latest_slot.store(index, boost::memory_order_release);
+          header->write_count.store(count + 1, boost::memory_order_release);
+          next_slot_ = index + 1;
+          return PUBLISHED;
+        }
+        return ALL_LEASED;
+      }
+
+      /**
+       * Returns true if a reader asked for frames within the last
+       * timeout_ms milliseconds.
+       */
+      bool hasActiveReader(boost::uint32_t now_ms, boost::uint32_t timeout_ms) const {
+        SharedFrameRing::Header* header = static_cast<SharedFrameRing::Header*>(region_->get_address());
+        const boost::uint32_t heartbeat = header->reader_heartbeat.load(boost::memory_order_relaxed);
+        // a heartbeat of zero means no reader ever attached
+        return heartbeat != 0 && boost::uint32_t(now_ms - heartbeat) < timeout_ms;
+      }
+
+    private:
+
+      /** true if a registered reader holds a lease on the slot */
+      bool leased(boost::uint32_t index) const {
+        SharedFrameRing::Header* header = static_cast<SharedFrameRing::Header*>(region_->get_address());
+        for (unsigned r = 0; r < SharedFrameRing::MAX_READERS; ++r)
+          if (header->readers[r].token.load(boost::memory_order_seq_cst) != 0 &&
+              header->readers[r].slot_leases[index].load(boost::memory_order_seq_cst) != 0)
+            return true;
+        return false;
+      }
+
+      /** free the entries of readers without a heartbeat, with their leases */
+      void reclaimStaleReaders(boost::uint32_t now_ms) {
+        SharedFrameRing::Header* header = static_cast<SharedFrameRing::Header*>(region_->get_address());
+        for (unsigned r = 0; r < SharedFrameRing::MAX_READERS; ++r) {
+          SharedFrameRing::Reader& reader = header->readers[r];
+          boost::uint32_t token = reader.token.load(boost::memory_order_acquire);
+          if (token == 0 || boost::uint32_t(now_ms - reader.heartbeat.load(boost::memory_order_relaxed)) < SharedFrameRing::LEASE_TIMEOUT)
+            continue;
+          // the token goes first, a late release of the reader then leaves the counts alone
+          if (!reader.token.compare_exchange_strong(token, 0, boost::memory_order_acq_rel))
+            continue;
+          for (unsigned i = 0; i < SharedFrameRing::MAX_SLOTS; ++i)
+            reader.slot_leases[i].store(0, boost::memory_order_relaxed);
+          reader.leases.store(0, boost::memory_order_release);
+        }
+      }
+
+      std::string name_;
+      boost::scoped_ptr<boost::interprocess::shared_memory_object> shm_;
+      boost::scoped_ptr<boost::interprocess::mapped_region> region_;
+      boost::uint32_t next_slot_;
+  };
+
+  /**
+   * A mapping of a ring by a reader. Leases refer to it, so the ring stays
+   * mapped while frames used in place are alive.
+   */
+  struct SharedFrameMapping : public boost::noncopyable {
+    SharedFrameMapping() : header(NULL) {}
+
+    boost::interprocess::shared_memory_object shm;
+    boost::interprocess::mapped_region region;
+    SharedFrameRing::Header* header;
+  };
+
+  /**
+   * \class SharedFrameLease
+   *
+   * \brief A slot of a ring the producer does not overwrite while the lease
+   * exists.
+   */
+  class SharedFrameLease : public boost::noncopyable {
+    public:
+
+      SharedFrameLease(const boost::shared_ptr<SharedFrameMapping>& mapping, SharedFrameRing::Reader& reader,
+          boost::uint32_t token, boost::uint32_t slot)
+        : mapping_(mapping), reader_(reader), token_(token), slot_(slot) {}
+
+      ~SharedFrameLease() {
+        SharedFrameRing::release(reader_, reader_.slot_leases[slot_], token_);
+        SharedFrameRing::release(reader_, reader_.leases, token_);
+      }
+
+    private:
+      boost::shared_ptr<SharedFrameMapping> mapping_;
+      SharedFrameRing::Reader& reader_;
+      boost::uint32_t token_;
+      boost::uint32_t slot_;
+  };
+
+  /**
+   * \class SharedFrameReader
+   *
+   * \brief Consumer side of a shared frame ring.
+   *
+   * Frames are accessed in place: peekLatest() returns the newest slot and its
+   * seqlock counter, the payload can then be read directly from the mapping
+   * and must be checked with verify() afterwards, or leased with lease() to
+   * keep using it.
+   */
+  class SharedFrameReader : public boost::noncopyable {
+    public:
+
+      explicit SharedFrameReader(const std::string& name)
+        : name_(name), header_(NULL), reader_(NULL), token_(0) {}
+
+      /** try to map the ring, returns false if the producer is not running */
+      bool attach() {
+        using namespace boost::interprocess;
+        detach();
+        boost::shared_ptr<SharedFrameMapping> mapping(new SharedFrameMapping);
+        try {
+          shared_memory_object shm(open_only, name_.c_str(), read_write);
+          mapped_region region(shm, read_write);
+          mapping->shm.swap(shm);
+          mapping->region.swap(region);
+        } catch (interprocess_exception&) {
+          return false;
+        }
+        SharedFrameRing::Header* header = static_cast<SharedFrameRing::Header*>(mapping->region.get_address());
+        if (mapping->region.get_size() < SharedFrameRing::headerSize() ||
+            header->magic != SHARED_FRAME_RING_MAGIC ||
+            header->version != SHARED_FRAME_RING_VERSION ||
+            mapping->region.get_size() < SharedFrameRing::headerSize() + size_t(header->slot_count) * header->slot_stride)
+          return false;
+        boost::atomic_thread_fence(boost::memory_order_acquire);
+        mapping->header = header;
+        mapping_ = mapping;
+        header_ = header;
+        return true;
+      }
+
+      /**
+       * unmap the ring once the leases of its frames are released. With
+       * leases alive the reader entry stays until the producer reclaims it.
+       */
+      void detach() {
+        // without leases alive the entry is free right away
+        boost::uint32_t token = token_;
+        if (reader_ && reader_->leases.load(boost::memory_order_acquire) == 0)
+          reader_->token.compare_exchange_strong(token, 0, boost::memory_order_acq_rel);
+        header_ = NULL;
+        reader_ = NULL;
+        token_ = 0;
+        mapping_.reset();
+      }
+
+      bool isAttached() const {
+        return header_ != NULL;
+      }
+
+      /**
+       * Tell the producer that this reader wants frames, which keeps a
+       * stream with an idle timeout running, and keeps the leases of the
+       * reader valid. Registers the reader if a reader entry is free.
+       */
+      void heartbeat(boost::uint32_t now_ms) {
+        now_ms = now_ms ? now_ms : 1;
+        header_->reader_heartbeat.store(now_ms, boost::memory_order_relaxed);
+        // the producer reclaimed the entry after a stall, the leases are gone
+        if (reader_ && reader_->token.load(boost::memory_order_acquire) != token_)
+          reader_ = NULL;
+        if (reader_) {
+          reader_->heartbeat.store(now_ms, boost::memory_order_relaxed);
+          return;
+        }
+        boost::uint32_t token = header_->next_token.fetch_add(1, boost::memory_order_relaxed);
+        if (token == 0)
+          token = header_->next_token.fetch_add(1, boost::memory_order_relaxed);
+        for (unsigned r = 0; r < SharedFrameRing::MAX_READERS; ++r) {
+          SharedFrameRing::Reader& reader = header_->readers[r];
+          boost::uint32_t free_token = 0;
+          // the heartbeat first, the producer must not reclaim the fresh entry
+          if (reader.token.load(boost::memory_order_relaxed) != 0)
+            continue;
+          reader.heartbeat.store(now_ms, boost::memory_order_relaxed);
+          if (reader.token.compare_exchange_strong(free_token, token, boost::memory_order_acq_rel)) {
+            reader_ = &reader;
+            token_ = token;
+            return;
+          }
+        }
+      }
+
+      /** number of frames published since the ring was created */
+      boost::uint32_t writeCount() const {
+        return header_->write_count.load(boost::memory_order_acquire);
+      }
+
+      /**
+       * Get the newest frame. Returns false if no frame newer than
+       * last_count is available or the slot is being written right now.
+       */
+      bool peekLatest(boost::uint32_t last_count, SharedFrameInfo& info,
+          const unsigned char*& data, boost::uint32_t& sequence) const {
+        const boost::uint32_t count = writeCount();
+        if (count == 0 || count == last_count)
+          return false;
+        SharedFrameRing::Slot* slot = SharedFrameRing::slot(header_,
+            header_->latest_slot.load(boost::memory_order_acquire));
+        sequence = slot->sequence.load(boost::memory_order_acquire);
+        if (sequence & 1)
+          return false;
+        info = slot->info;
+        data = SharedFrameRing::payload(slot);
+        if (info.frame_count == last_count || info.mode.bytes < 0 || boost::uint32_t(info.mode.bytes) > header_->capacity)
+          return false;
+        return verify(info, sequence);
+      }
+
+      /** check that a frame obtained by peekLatest() was not overwritten */
+      bool verify(const SharedFrameInfo& info, boost::uint32_t sequence) const {
+        SharedFrameRing::Slot* slot = SharedFrameRing::slot(header_, info.slot);
+        boost::atomic_thread_fence(boost::memory_order_acquire);
+        return slot->sequence.load(boost::memory_order_relaxed) == sequence;
+      }
+
+      /**
+       * Lease the slot of a frame obtained by peekLatest(), so it can be used
+       * in place. Returns an empty pointer if the frame was overwritten
+       * meanwhile, the reader is not registered (see heartbeat()) or all
+       * readers together hold the leases the ring allows.
+       */
+      boost::shared_ptr<SharedFrameLease> lease(const SharedFrameInfo& info, boost::uint32_t sequence) {
+        boost::shared_ptr<SharedFrameLease> lease;
+        if (!reader_ || info.slot >= header_->slot_count)
+          return lease;
+        // reserve first, then count the leases of every reader; two readers
+        // racing for the last lease may both give up, but never both get it
+        reader_->leases.fetch_add(1, boost::memory_order_seq_cst);
+        reader_->slot_leases[info.slot].fetch_add(1, boost::memory_order_seq_cst);
+        // releases both counts if the lease is refused or the frame is gone
+        lease.reset(new SharedFrameLease(mapping_, *reader_, token_, info.slot));
+        boost::uint32_t total = 0;
+        for (unsigned r = 0; r < SharedFrameRing::MAX_READERS; ++r)
+          if (header_->readers[r].token.load(boost::memory_order_seq_cst) != 0)
+            total += header_->readers[r].leases.load(boost::memory_order_seq_cst);
+        if (total > header_->max_leases || reader_->token.load(boost::memory_order_seq_cst) != token_ ||
+            SharedFrameRing::slot(header_, info.slot)->sequence.load(boost::memory_order_seq_cst) != sequence)
+          lease.reset();
+        return lease;
+      }
+
+    private:
+      std::string name_;
+      SharedFrameRing::Header* header_;
+      // entry of this reader while registered
+      SharedFrameRing::Reader* reader_;
+      boost::uint32_t token_;
+      boost::shared_ptr<SharedFrameMapping> mapping_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: SHARED_FRAME_RING_R7NB2XQE */
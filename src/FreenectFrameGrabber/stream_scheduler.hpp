@@ -0,0 +1,153 @@
+#ifndef STREAM_SCHEDULER_R7XN2KLP
+#define STREAM_SCHEDULER_R7XN2KLP
+
+#include <map>
+#include <string>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread/mutex.hpp>
+
+namespace freenect_camera {
+
+  /**
+   * \class StreamStartScheduler
+   *
+   * \brief Serializes the stream starts of all devices in the process.
+   *
+   * Starting several isochronous streams at the same time can exceed the
+   * USB bandwidth which the host controller is able to reserve at once.
+   * Streams therefore ask for a start and are granted one at a time, a
+   * stagger interval apart. Among the waiting streams the one with the
+   * highest bandwidth goes first, so the large reservations are made while
+   * the bus is still empty. A failed start is retried after an exponential
+   * backoff, other streams may start in the meantime.
+   *
+   * Times are nanoseconds, streams are identified by name (serial and
+   * endpoint).
+   */
+  class StreamStartScheduler : public boost::noncopyable {
+    public:
+
+      static StreamStartScheduler& instance() {
+        static StreamStartScheduler scheduler;
+        return scheduler;
+      }
+
+      /** minimum time between two starts, the largest configured value wins */
+      void setStagger(boost::uint64_t stagger) {
+        boost::mutex::scoped_lock lock(mutex_);
+        stagger_ = std::max(stagger_, stagger);
+      }
+
+      /**
+       * Queue a stream start. Waiting streams must repeat the request while
+       * they wait, requests which are not repeated expire.
+       */
+      void request(const std::string& stream, boost::uint64_t bandwidth, boost::uint64_t now) {
+        boost::mutex::scoped_lock lock(mutex_);
+        PendingMap::iterator it = pending_.find(stream);
+        if (it != pending_.end()) {
+          it->second.seen = now;
+          return;
+        }
+        Request& request = pending_[stream];
+        request.bandwidth = bandwidth;
+        request.requested = now;
+        request.seen = now;
+        request.not_before = now;
+        request.attempts = 0;
+      }
+
+      /** remove a stream which is no longer needed */
+      void cancel(const std::string& stream) {
+        boost::mutex::scoped_lock lock(mutex_);
+        pending_.erase(stream);
+        if (in_flight_ == stream)
+          in_flight_.clear();
+      }
+
+      /**
+       * May the stream be started now? On success waited is the time since
+       * the request. The caller must report the outcome with started() or
+       * failed().
+       */
+      bool grant(const std::string& stream, boost::uint64_t now, boost::uint64_t& waited) {
+        boost::mutex::scoped_lock lock(mutex_);
+        // a start which was never reported does not block the others forever
+        if (!in_flight_.empty() && now - granted_ > IN_FLIGHT_TIMEOUT)
+          in_flight_.clear();
+        if (!in_flight_.empty() || now < last_start_ + stagger_)
+          return false;
+
+        PendingMap::iterator best = pending_.end();
+        for (PendingMap::iterator it = pending_.begin(); it != pending_.end(); ) {
+          if (now > it->second.seen + REQUEST_TIMEOUT) {
+            pending_.erase(it++);
+            continue;
+          }
+          if (it->second.not_before <= now && (best == pending_.end() || it->second.bandwidth > best->second.bandwidth))
+            best = it;
+          ++it;
+        }
+        if (best == pending_.end() || best->first != stream)
+          return false;
+
+        in_flight_ = stream;
+        granted_ = now;
+        waited = now - best->second.requested;
+        return true;
+      }
+
+      /** the granted start succeeded */
+      void started(const std::string& stream, boost::uint64_t now) {
+        boost::mutex::scoped_lock lock(mutex_);
+        pending_.erase(stream);
+        if (in_flight_ == stream)
+          in_flight_.clear();
+        last_start_ = now;
+      }
+
+      /** the granted start failed, returns the number of failed attempts */
+      unsigned failed(const std::string& stream, boost::uint64_t now) {
+        boost::mutex::scoped_lock lock(mutex_);
+        if (in_flight_ == stream)
+          in_flight_.clear();
+        last_start_ = now;
+        PendingMap::iterator it = pending_.find(stream);
+        if (it == pending_.end())
+          return 0;
+        it->second.attempts++;
+        it->second.not_before = now + (BASE_BACKOFF << std::min(it->second.attempts - 1, 5u));
+        return it->second.attempts;
+      }
+
+    private:
+
+      static const boost::uint64_t BASE_BACKOFF = 250000000ULL;
+      static const boost::uint64_t IN_FLIGHT_TIMEOUT = 5000000000ULL;
+      static const boost::uint64_t REQUEST_TIMEOUT = 2000000000ULL;
+
+      StreamStartScheduler()
+        : stagger_(0), last_start_(0), granted_(0) {}
+
+      struct Request {
+        boost::uint64_t bandwidth;
+        boost::uint64_t requested;
+        boost::uint64_t seen;
+        boost::uint64_t not_before;
+        unsigned attempts;
+      };
+      typedef std::map<std::string, Request> PendingMap;
+
+      boost::mutex mutex_;
+      boost::uint64_t stagger_;
+      boost::uint64_t last_start_;
+      PendingMap pending_;
+      std::string in_flight_;
+      boost::uint64_t granted_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: STREAM_SCHEDULER_R7XN2KLP */
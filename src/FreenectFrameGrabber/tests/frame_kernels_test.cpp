@@ -0,0 +1,105 @@
+/*
+ * Checks the conversion kernels of the FreenectFrameGrabber: the scalar
+ * unpacking against a bit by bit reference, and every vector variant the
+ * CPU supports against the scalar kernel, on fixed and random frames.
+ * Returns nonzero if any kernel differs.
+ */
+
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <boost/cstdint.hpp>
+
+#include "../frame_kernels.hpp"
+
+using namespace freenect_camera;
+
+namespace {
+
+  // frame sizes for the generic kernels, around the vector widths and with odd tails
+  const int GENERIC_PIXELS[] = { 0, 1, 7, 8, 9, 15, 16, 17, 31, 32, 33, 8 * 97 + 5, 640 * 480 };
+  const int GENERIC_SIZES = sizeof(GENERIC_PIXELS) / sizeof(GENERIC_PIXELS[0]);
+  // every frame size gets two random frames
+  const int RANDOM_FRAMES = 2 * GENERIC_SIZES;
+
+  boost::uint32_t random(boost::uint32_t& seed) {
+    seed = seed * 1664525u + 1013904223u;
+    return seed;
+  }
+
+  /** pixel i of an MSB first packed stream, one bit at a time */
+  boost::uint16_t referencePixel(const std::vector< boost::uint8_t >& packed, int bits, int i) {
+    boost::uint16_t value = 0;
+    for (int b = 0; b < bits; ++b) {
+      const int bit = i * bits + b;
+      value = boost::uint16_t((value << 1) | ((packed[bit / 8] >> (7 - bit % 8)) & 1));
+    }
+    return value;
+  }
+
+  template< int Bits >
+  bool checkScalar(const std::vector< boost::uint8_t >& pattern, int pixels, const char* name) {
+    std::vector< boost::uint8_t > packed((pixels * Bits + 7) / 8 + 1);
+    for (size_t i = 0; i < packed.size(); ++i)
+      packed[i] = pattern[i % pattern.size()];
+    std::vector< boost::uint16_t > result(pixels + 1, 0xFFFF);
+    UnpackKernel< Bits, 0, KERNEL_SCALAR >::run(&packed[0], &result[0], pixels);
+    for (int i = 0; i < pixels; ++i) {
+      if (result[i] != referencePixel(packed, Bits, i)) {
+        std::printf("FAIL: scalar %d bit kernel, %s pattern, %d pixels, pixel %d\n", Bits, name, pixels, i);
+        return false;
+      }
+    }
+    if (result[pixels] != 0xFFFF) {
+      std::printf("FAIL: scalar %d bit kernel, %s pattern, writes past %d pixels\n", Bits, name, pixels);
+      return false;
+    }
+    return true;
+  }
+
+  /** all kernels on a frame filled with pattern, generic kernels get pixels */
+  bool check(const std::vector< boost::uint8_t >& pattern, int pixels, const char* name) {
+    bool ok = checkScalar< 10 >(pattern, pixels, name);
+    ok = checkScalar< 11 >(pattern, pixels, name) && ok;
+    const std::vector< std::string > failures = FrameKernelRegistry::instance().compare(pattern, pixels);
+    for (size_t f = 0; f < failures.size(); ++f)
+      std::printf("FAIL: %s, %s pattern, %d pixels\n", failures[f].c_str(), name, pixels);
+    return ok && failures.empty();
+  }
+
+  bool checkAllSizes(const std::vector< boost::uint8_t >& pattern, const char* name) {
+    bool ok = true;
+    for (int i = 0; i < GENERIC_SIZES; ++i)
+      ok = check(pattern, GENERIC_PIXELS[i], name) && ok;
+    return ok;
+  }
+
+} // namespace
+
+int main() {
+  std::printf("vector kernels: %s\n", KERNEL_VARIANT_NAMES[FrameKernelRegistry::instance().variant()]);
+  bool ok = true;
+
+  ok = checkAllSizes(std::vector< boost::uint8_t >(1, 0x00), "zero") && ok;
+  ok = checkAllSizes(std::vector< boost::uint8_t >(1, 0xFF), "ones") && ok;
+  std::vector< boost::uint8_t > pattern;
+  pattern.push_back(0xAA);
+  pattern.push_back(0x55);
+  ok = checkAllSizes(pattern, "alternating") && ok;
+  pattern.clear();
+  for (int i = 0; i < 256; ++i)
+    pattern.push_back(boost::uint8_t(i));
+  ok = checkAllSizes(pattern, "ramp") && ok;
+
+  // longer than a frame of the specialized sizes, so no frame repeats it
+  boost::uint32_t seed = 0x2545F491u;
+  pattern.resize(1280 * 1024 * 2);
+  for (int frame = 0; frame < RANDOM_FRAMES; ++frame) {
+    for (size_t i = 0; i < pattern.size(); ++i)
+      pattern[i] = boost::uint8_t(random(seed) >> 24);
+    ok = check(pattern, GENERIC_PIXELS[frame % GENERIC_SIZES], "random") && ok;
+  }
+
+  std::printf(ok ? "all kernels match\n" : "kernels differ\n");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,390 @@
+#ifndef THREAD_PLACEMENT_Q8JD3XVN
+#define THREAD_PLACEMENT_Q8JD3XVN
+
+#include <string>
+#include <vector>
+#include <sstream>
+#include <cstring>
+#include <cstdlib>
+#include <algorithm>
+#include <boost/cstdint.hpp>
+#include <boost/atomic.hpp>
+
+#include <tbb/task_arena.h>
+#include <tbb/task_scheduler_observer.h>
+#include <tbb/enumerable_thread_specific.h>
+
+#if defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#elif defined(_WIN32)
+#include <windows.h>
+#endif
+
+namespace freenect_camera {
+
+  /**
+   * CPUs and real-time priority for a thread. No CPUs keeps the affinity of
+   * the process, priority 0 the normal scheduling.
+   */
+  struct ThreadPlacement {
+    ThreadPlacement() : priority(0) {}
+
+    bool empty() const { return cpus.empty() && priority == 0; }
+
+    std::vector< int > cpus;
+    // SCHED_FIFO priority, 1 (lowest) to 99
+    int priority;
+  };
+
+  /** parse a CPU list like "2" or "0,2-3", returns false if malformed */
+  inline bool parseCpuList(const std::string& list, std::vector< int >& cpus) {
+    cpus.clear();
+    std::stringstream ss(list);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+      item.erase(std::remove(item.begin(), item.end(), ' '), item.end());
+      if (item.empty())
+        continue;
+      const char* s = item.c_str();
+      char* end;
+      long first = std::strtol(s, &end, 10);
+      long last = first;
+      if (end == s)
+        return false;
+      if (*end == '-') {
+        s = end + 1;
+        last = std::strtol(s, &end, 10);
+        if (end == s)
+          return false;
+      }
+      if (*end != '\0' || first < 0 || last < first || last > 1023)
+        return false;
+      for (long cpu = first; cpu <= last; ++cpu)
+        cpus.push_back(int(cpu));
+    }
+    return true;
+  }
+
+  /**
+   * Apply a placement to the calling thread. Settings which are not
+   * permitted are skipped, the thread keeps running as before. Returns the
+   * effective settings for the log, failures are listed in warnings.
+   */
+  inline std::string applyThreadPlacement(const ThreadPlacement& placement, std::string& warnings) {
+    std::ostringstream effective;
+    std::ostringstream failed;
+#if defined(__linux__)
+    if (!placement.cpus.empty()) {
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      for (size_t i = 0; i < placement.cpus.size(); ++i)
+        if (placement.cpus[i] < CPU_SETSIZE)
+          CPU_SET(placement.cpus[i], &set);
+      int error = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+      if (error)
+        failed << "affinity: " << std::strerror(error) << "; ";
+    }
+    if (placement.priority > 0) {
+      sched_param param;
+      param.sched_priority = std::min(std::max(placement.priority, sched_get_priority_min(SCHED_FIFO)),
+        sched_get_priority_max(SCHED_FIFO));
+      int error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+      // EPERM without CAP_SYS_NICE or an rtprio limit
+      if (error)
+        failed << "SCHED_FIFO " << param.sched_priority << ": " << std::strerror(error) << "; ";
+    }
+
+    // report what the thread actually got
+    cpu_set_t set;
+    if (pthread_getaffinity_np(pthread_self(), sizeof(set), &set) == 0) {
+      effective << "CPUs";
+      const char* separator = " ";
+      for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (CPU_ISSET(cpu, &set)) {
+          effective << separator << cpu;
+          separator = ",";
+        }
+      }
+    }
+    int policy;
+    sched_param param;
+    if (pthread_getschedparam(pthread_self(), &policy, &param) == 0) {
+      if (policy == SCHED_FIFO)
+        effective << ", SCHED_FIFO " << param.sched_priority;
+      else if (policy == SCHED_RR)
+        effective << ", SCHED_RR " << param.sched_priority;
+      else
+        effective << ", normal priority";
+    }
+#elif defined(_WIN32)
+    if (!placement.cpus.empty()) {
+      DWORD_PTR mask = 0;
+      for (size_t i = 0; i < placement.cpus.size(); ++i)
+        if (placement.cpus[i] < int(sizeof(DWORD_PTR) * 8))
+          mask |= DWORD_PTR(1) << placement.cpus[i];
+      if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+        failed << "affinity: error " << GetLastError() << "; ";
+      else
+        effective << "CPU mask 0x" << std::hex << mask << std::dec;
+    }
+    // Windows has no SCHED_FIFO, time critical is the closest
+    if (placement.priority > 0) {
+      if (!SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL))
+        failed << "time critical priority: error " << GetLastError() << "; ";
+      else
+        effective << (placement.cpus.empty() ? "" : ", ") << "time critical priority";
+    }
+#else
+    if (!placement.empty())
+      failed << "thread placement is not supported on this platform; ";
+#endif
+    warnings = failed.str();
+    if (!warnings.empty())
+      warnings.erase(warnings.size() - 2);
+    return effective.str();
+  }
+
+  /**
+   * The affinity and scheduling of a thread, to put it back after a
+   * placement was applied.
+   */
+  class SavedThreadPlacement {
+    public:
+
+      SavedThreadPlacement() : saved_(false) {}
+
+      /** remember the settings of the calling thread */
+      void save() {
+#if defined(__linux__)
+        saved_ = pthread_getaffinity_np(pthread_self(), sizeof(cpus_), &cpus_) == 0 &&
+          pthread_getschedparam(pthread_self(), &policy_, &param_) == 0;
+#elif defined(_WIN32)
+        priority_ = GetThreadPriority(GetCurrentThread());
+        // only SetThreadAffinityMask tells the current mask
+        DWORD_PTR process_mask, system_mask;
+        saved_ = priority_ != THREAD_PRIORITY_ERROR_RETURN &&
+          GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask) != 0;
+        if (saved_) {
+          mask_ = SetThreadAffinityMask(GetCurrentThread(), process_mask);
+          saved_ = mask_ != 0;
+          if (saved_)
+            SetThreadAffinityMask(GetCurrentThread(), mask_);
+        }
+#endif
+      }
+
+      /** put the saved settings back on the calling thread, returns false if that failed */
+      bool restore() {
+        if (!saved_)
+          return true;
+        saved_ = false;
+#if defined(__linux__)
+        bool ok = pthread_setschedparam(pthread_self(), policy_, &param_) == 0;
+        return pthread_setaffinity_np(pthread_self(), sizeof(cpus_), &cpus_) == 0 && ok;
+#elif defined(_WIN32)
+        bool ok = SetThreadPriority(GetCurrentThread(), priority_) != 0;
+        return SetThreadAffinityMask(GetCurrentThread(), mask_) != 0 && ok;
+#else
+        return true;
+#endif
+      }
+
+    private:
+
+      bool saved_;
+#if defined(__linux__)
+      cpu_set_t cpus_;
+      int policy_;
+      sched_param param_;
+#elif defined(_WIN32)
+      DWORD_PTR mask_;
+      int priority_;
+#endif
+  };
+
+  /**
+   * Applies a placement to the TBB workers while they work in one arena.
+   * TBB workers are shared by the process and move between arenas, so a
+   * worker gets its previous affinity and scheduling back when it leaves
+   * the arena. Give the arena its own workers by running only the
+   * placed work in it.
+   */
+  class WorkerPlacementObserver : public tbb::task_scheduler_observer {
+    public:
+
+      WorkerPlacementObserver(tbb::task_arena& arena, const ThreadPlacement& placement)
+        : tbb::task_scheduler_observer(arena), placement_(placement),
+          placed_(0), failed_(0), active_(0), restore_failed_(0) {}
+
+      ~WorkerPlacementObserver() {
+        observe(false);
+      }
+
+      virtual void on_scheduler_entry(bool is_worker) {
+        if (!is_worker)
+          return;
+        ++active_;
+        saved_.local().save();
+        std::string warnings;
+        applyThreadPlacement(placement_, warnings);
+        if (warnings.empty())
+          ++placed_;
+        else
+          ++failed_;
+      }
+
+      virtual void on_scheduler_exit(bool is_worker) {
+        if (!is_worker)
+          return;
+        if (!saved_.local().restore())
+          ++restore_failed_;
+        --active_;
+      }
+
+      /** workers placed, and workers for which a setting failed */
+      unsigned placed() const { return placed_; }
+      unsigned failed() const { return failed_; }
+      /** workers in the arena right now, they are restored when they leave */
+      unsigned active() const { return active_; }
+      /** workers whose previous settings could not be put back */
+      unsigned restoreFailed() const { return restore_failed_; }
+
+    private:
+
+      ThreadPlacement placement_;
+      tbb::enumerable_thread_specific< SavedThreadPlacement > saved_;
+      boost::atomic< unsigned > placed_;
+      boost::atomic< unsigned > failed_;
+      boost::atomic< unsigned > active_;
+      boost::atomic< unsigned > restore_failed_;
+  };
+
+  /**
+   * \class ArrivalLateness
+   *
+   * \brief How late frames reach the host compared to the camera timing.
+   *
+   * Frames leave the camera at a fixed period, so with the sequence number
+   * of a frame its arrival can be predicted from an earlier frame. Frames
+   * arriving earliest compared to the prediction are on time, the others
+   * are late by the difference. This is mostly the time the USB thread
+   * needed to wake up and handle the transfer. The period is refined after
+   * every window from the earliest frames of both window halves, which also
+   * follows the drift between the camera and the host clock. The first
+   * window after a (re)start only learns the period.
+   */
+  class ArrivalLateness {
+    public:
+
+      static const unsigned LEARN_FRAMES = 60;
+      // frames counting as late in the statistics, ns
+      static const boost::uint64_t LATE_THRESHOLD = 1000000;
+
+      explicit ArrivalLateness(unsigned window = 300)
+        : window_(std::max(2u, window)), started_(false), learning_(true), period_(0),
+          origin_sequence_(0), origin_time_(0), last_sequence_(0), last_time_(0), window_frames_(0) {
+        resetStatistics();
+      }
+
+      /**
+       * A frame with sequence number sequence arrived at host time now (ns).
+       * Returns true when a statistics window is complete, the caller reads
+       * the statistics and calls resetStatistics().
+       */
+      bool add(boost::uint32_t sequence, boost::uint64_t now, boost::uint64_t nominal_period) {
+        // the stream was restarted, or stalled for a second
+        if (!started_ || sequence <= last_sequence_ || now - last_time_ > 1000000000u)
+          start(sequence, now, nominal_period);
+        last_sequence_ = sequence;
+        last_time_ = now;
+
+        const double offset = double(boost::int64_t(now - origin_time_)) - double(sequence - origin_sequence_) * period_;
+        const unsigned length = learning_ ? LEARN_FRAMES : window_;
+        Earliest& half = earliest_[window_frames_ < length / 2 ? 0 : 1];
+        if (!half.valid || offset < half.offset) {
+          half.valid = true;
+          half.offset = offset;
+          half.sequence = sequence;
+          half.time = now;
+        }
+        if (!learning_) {
+          // the origin was on time, earlier frames move the reference
+          const double lateness = std::max(0.0, offset - std::min(0.0, earliest_[0].offset));
+          ++frames_;
+          sum_ += lateness;
+          max_ = std::max(max_, lateness);
+          if (lateness > LATE_THRESHOLD)
+            ++late_;
+        }
+        if (++window_frames_ < length)
+          return false;
+
+        if (earliest_[0].valid && earliest_[1].valid && earliest_[1].sequence > earliest_[0].sequence)
+          period_ += (earliest_[1].offset - earliest_[0].offset) / (earliest_[1].sequence - earliest_[0].sequence);
+        origin_sequence_ = earliest_[1].sequence;
+        origin_time_ = earliest_[1].time;
+        earliest_[0].valid = earliest_[1].valid = false;
+        window_frames_ = 0;
+        if (learning_) {
+          learning_ = false;
+          return false;
+        }
+        return true;
+      }
+
+      unsigned long frames() const { return frames_; }
+      unsigned long late() const { return late_; }
+      /** ns */
+      double mean() const { return frames_ ? sum_ / frames_ : 0.0; }
+      double max() const { return max_; }
+      double period() const { return period_; }
+
+      void resetStatistics() {
+        frames_ = 0;
+        late_ = 0;
+        sum_ = 0;
+        max_ = 0;
+      }
+
+    private:
+
+      void start(boost::uint32_t sequence, boost::uint64_t now, boost::uint64_t nominal_period) {
+        started_ = true;
+        learning_ = true;
+        period_ = double(nominal_period);
+        origin_sequence_ = sequence;
+        origin_time_ = now;
+        window_frames_ = 0;
+        earliest_[0].valid = earliest_[1].valid = false;
+        resetStatistics();
+      }
+
+      struct Earliest {
+        Earliest() : valid(false), offset(0), sequence(0), time(0) {}
+        bool valid;
+        double offset;
+        boost::uint32_t sequence;
+        boost::uint64_t time;
+      };
+
+      unsigned window_;
+      bool started_;
+      bool learning_;
+      double period_;
+      boost::uint32_t origin_sequence_;
+      boost::uint64_t origin_time_;
+      boost::uint32_t last_sequence_;
+      boost::uint64_t last_time_;
+      unsigned window_frames_;
+      Earliest earliest_[2];
+
+      unsigned long frames_;
+      unsigned long late_;
+      double sum_;
+      double max_;
+  };
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: THREAD_PLACEMENT_Q8JD3XVN */
@@ -0,0 +1,113 @@
+#ifndef YUV_CONVERT_P5TD1VHC
+#define YUV_CONVERT_P5TD1VHC
+
+#include <boost/cstdint.hpp>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FREENECT_HAVE_SSE2
+#endif
+
+namespace freenect_camera {
+
+  /**
+   * Conversion of the raw UYVY stream (FREENECT_VIDEO_YUV_RAW).
+   *
+   * The coefficients are the BT.601 ones libfreenect uses for
+   * FREENECT_VIDEO_YUV_RGB, in 6 bit fixed point so the vector and the
+   * scalar code produce identical results.
+   */
+
+  namespace detail {
+
+    inline unsigned char clampByte(int v) {
+      return (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+    }
+
+    inline void convertUYVYPixelPair(const unsigned char* src, unsigned char* dst) {
+      const int u = src[0] - 128;
+      const int v = src[2] - 128;
+      const int y0 = (src[1] - 16) * 75;
+      const int y1 = (src[3] - 16) * 75;
+      const int r = v * 102;
+      const int g = -v * 52 - u * 25;
+      const int b = u * 129;
+      dst[0] = clampByte((y0 + r) >> 6);
+      dst[1] = clampByte((y0 + g) >> 6);
+      dst[2] = clampByte((y0 + b) >> 6);
+      dst[3] = clampByte((y1 + r) >> 6);
+      dst[4] = clampByte((y1 + g) >> 6);
+      dst[5] = clampByte((y1 + b) >> 6);
+    }
+
+  } // namespace detail
+
+  /**
+   * Convert UYVY to packed RGB, pixels must be even.
+   */
+  inline void convertUYVYToRGB(const unsigned char* src, unsigned char* dst, int pixels) {
+    int i = 0;
+#ifdef FREENECT_HAVE_SSE2
+    const __m128i lo_mask = _mm_set1_epi16(0x00FF);
+    const __m128i low_word = _mm_set1_epi32(0x0000FFFF);
+    const __m128i c16 = _mm_set1_epi16(16);
+    const __m128i c128 = _mm_set1_epi16(128);
+    const __m128i cy = _mm_set1_epi16(75);
+    const __m128i crv = _mm_set1_epi16(102);
+    const __m128i cgv = _mm_set1_epi16(-52);
+    const __m128i cgu = _mm_set1_epi16(-25);
+    const __m128i cbu = _mm_set1_epi16(129);
+    unsigned char r[16], g[16], b[16];
+
+    // 8 pixels per iteration
+    for (; i + 8 <= pixels; i += 8) {
+      __m128i raw = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+      __m128i y = _mm_mullo_epi16(_mm_sub_epi16(_mm_srli_epi16(raw, 8), c16), cy);
+      __m128i uv = _mm_and_si128(raw, lo_mask);
+      // every 32 bit lane holds U (low) and V (high) of a pixel pair, duplicate them
+      __m128i u = _mm_and_si128(uv, low_word);
+      u = _mm_sub_epi16(_mm_or_si128(u, _mm_slli_epi32(u, 16)), c128);
+      __m128i v = _mm_srli_epi32(uv, 16);
+      v = _mm_sub_epi16(_mm_or_si128(v, _mm_slli_epi32(v, 16)), c128);
+
+      // saturated sums only clip values which are out of range anyway
+      __m128i vr = _mm_srai_epi16(_mm_adds_epi16(y, _mm_mullo_epi16(v, crv)), 6);
+      __m128i vg = _mm_srai_epi16(_mm_adds_epi16(y,
+            _mm_adds_epi16(_mm_mullo_epi16(v, cgv), _mm_mullo_epi16(u, cgu))), 6);
+      __m128i vb = _mm_srai_epi16(_mm_adds_epi16(y, _mm_mullo_epi16(u, cbu)), 6);
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(r), _mm_packus_epi16(vr, vr));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(g), _mm_packus_epi16(vg, vg));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(b), _mm_packus_epi16(vb, vb));
+      unsigned char* out = dst + i * 3;
+      for (int k = 0; k < 8; ++k) {
+        out[3 * k] = r[k];
+        out[3 * k + 1] = g[k];
+        out[3 * k + 2] = b[k];
+      }
+    }
+#endif
+    for (; i + 2 <= pixels; i += 2)
+      detail::convertUYVYPixelPair(src + i * 2, dst + i * 3);
+  }
+
+  /**
+   * Extract the luminance of UYVY, the fast path for gray consumers.
+   */
+  inline void convertUYVYToGray(const unsigned char* src, unsigned char* dst, int pixels) {
+    int i = 0;
+#ifdef FREENECT_HAVE_SSE2
+    for (; i + 16 <= pixels; i += 16) {
+      __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2));
+      __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i * 2 + 16));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+          _mm_packus_epi16(_mm_srli_epi16(a, 8), _mm_srli_epi16(b, 8)));
+    }
+#endif
+    for (; i < pixels; ++i)
+      dst[i] = src[i * 2 + 1];
+  }
+
+} /* end namespace freenect_camera */
+
+#endif /* end of include guard: YUV_CONVERT_P5TD1VHC */